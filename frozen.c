@@ -0,0 +1,1572 @@
+/*
+ * This file is part of Pytricia.
+ * Joel Sommers <jsommers@colgate.edu>
+ *
+ * Pytricia is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pytricia is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Pytricia.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#endif
+
+#include "frozen.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define FROZEN_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * The flat engine is the patricia tree itself, copied breadth-first into
+ * index-addressed arrays so that a walk touches no pointers.  Index 0 is a
+ * sentinel that never matches and whose children are itself, which lets a
+ * batch of addresses be walked in lock-step: lanes that have run off the
+ * bottom of the tree just keep spinning on the sentinel until every lane
+ * is done.
+ *
+ * IPv4 nodes are kept as separate arrays so that each field can be pulled
+ * into a vector register with one gather.  A glue node gets an impossible
+ * (address, mask) pair, so the match test needs no special case.
+ */
+
+typedef struct {
+    uint32_t *bit;
+    uint32_t *child;            /* child[2*i + direction] */
+    uint32_t *addr;             /* host order, already masked */
+    uint32_t *mask;
+    int32_t *id;                /* index into frozen->nodes, -1 for glue */
+} flat4_t;
+
+typedef struct {
+    uint32_t bit;
+    int32_t id;
+    uint32_t child[2];
+    uint64_t addr[2];           /* host order, already masked */
+    uint64_t mask[2];
+} flat6_node_t;
+
+/*
+ * The interval engine keeps the start of every run from frozen_flatten()
+ * in a static search tree of cache-line sized blocks (an "S-tree"): block k
+ * holds B sorted keys and has B + 1 children, k * (B + 1) + 1 .. + B + 1,
+ * so a search reads one line per level and picks the child by counting how
+ * many of the block's keys are <= the address.  That count is four SIMD
+ * compares for IPv4 (B = 16) and four 128-bit compares for IPv6 (B = 4).
+ * IPv4 keys are stored with the sign bit flipped so that a signed compare
+ * orders them as unsigned.  Slots past the last run are padded with the
+ * largest key and point at the last run, which is where such an address
+ * belongs anyway.
+ */
+
+#define STREE4_B 16
+#define STREE6_B 4
+#define STREE4_BIAS 0x80000000U
+
+/*
+ * The poptrie engine (Asai & Ohara, SIGCOMM 2015) is a multibit trie over
+ * the address, left-aligned in 128 bits.  The top 16 bits index a direct
+ * table; below that each node consumes 6 bits.  Rather than 64 child
+ * pointers, a node keeps two 64-bit vectors: bit v of vector says child v
+ * is another node, and bit v of leafvec says a new run of leaves starts at
+ * v.  Children and leaves each sit in one contiguous block, so the offset
+ * of child v in its block is a popcount of the vector up to v.  A leaf is
+ * the index of a run from frozen_flatten().
+ */
+
+#define POPTRIE_DIRECT_BITS 16
+#define POPTRIE_STRIDE 6
+#define POPTRIE_LEAF 0x80000000U
+
+typedef struct {
+    uint64_t vector;
+    uint64_t leafvec;
+    uint32_t base0;             /* first leaf */
+    uint32_t base1;             /* first child node */
+} poptrie_node_t;
+
+struct _frozen_t {
+    int kind;
+    int family;
+    size_t nnodes;              /* prefix-bearing nodes, or runs */
+    patricia_node_t **nodes;
+    uint32_t root;
+    flat4_t f4;
+    flat6_node_t *f6;
+    size_t nblocks;
+    void *keys_raw;
+    uint32_t *keys4;            /* nblocks * STREE4_B */
+    uint64_t *keys6;            /* nblocks * STREE6_B * 2 (hi, lo) */
+    uint32_t *rank;             /* run index for each key slot */
+    uint32_t *direct;           /* 1 << POPTRIE_DIRECT_BITS entries */
+    poptrie_node_t *pnodes;
+    size_t npnodes, pnodes_cap;
+    uint32_t *leaves;
+    size_t nleaves, leaves_cap;
+    size_t nodes_cap;           /* poptrie: nodes is appended to by patches */
+    size_t built_nnodes;        /* nnodes after the last full build */
+    size_t pgarbage;            /* pnodes left unreachable by patches */
+    frozen_lookup_fn native;
+};
+
+int
+frozen_tree_family(patricia_tree_t *tree) {
+    patricia_node_t *node = NULL;
+    int family = 0;
+
+    PATRICIA_WALK (tree->head, node) {
+        if (family == 0) {
+            family = node->prefix->family;
+        } else if (family != node->prefix->family) {
+            return -1;
+        }
+    } PATRICIA_WALK_END;
+    return family;
+}
+
+int
+frozen_kind(frozen_t *frozen) {
+    return frozen->kind;
+}
+
+int
+frozen_family(frozen_t *frozen) {
+    return frozen->family;
+}
+
+static uint32_t
+_load4(const u_char *addr) {
+    uint32_t a;
+    memcpy(&a, addr, 4);
+    return ntohl(a);
+}
+
+static void
+_load6(const u_char *addr, uint64_t *out) {
+    int i;
+    out[0] = out[1] = 0;
+    for (i = 0; i < 8; i++) {
+        out[0] = (out[0] << 8) | addr[i];
+        out[1] = (out[1] << 8) | addr[i + 8];
+    }
+}
+
+static uint32_t
+_mask4(u_int bitlen) {
+    return bitlen == 0 ? 0 : bitlen >= 32 ? 0xffffffffU : 0xffffffffU << (32 - bitlen);
+}
+
+static void
+_mask6(u_int bitlen, uint64_t *out) {
+    out[0] = bitlen == 0 ? 0 : bitlen >= 64 ? ~0ULL : ~0ULL << (64 - bitlen);
+    out[1] = bitlen <= 64 ? 0 : bitlen >= 128 ? ~0ULL : ~0ULL << (128 - bitlen);
+}
+
+void
+frozen_prefix_range(prefix_t *prefix, u128_t *first, u128_t *last) {
+    if (prefix->family == AF_INET) {
+        uint32_t mask = _mask4(prefix->bitlen);
+        uint32_t a = _load4(prefix_touchar(prefix)) & mask;
+        first->hi = last->hi = 0;
+        first->lo = a;
+        last->lo = a | ~mask;
+    } else {
+        uint64_t a[2], mask[2];
+        _load6(prefix_touchar(prefix), a);
+        _mask6(prefix->bitlen, mask);
+        first->hi = a[0] & mask[0];
+        first->lo = a[1] & mask[1];
+        last->hi = first->hi | ~mask[0];
+        last->lo = first->lo | ~mask[1];
+    }
+}
+
+/*
+ * Walk down towards within: return the longest prefix of family strictly
+ * shorter than within that covers it, and leave in *root the top of the
+ * subtree holding everything at least as long as within.
+ */
+static patricia_node_t *
+_descend(patricia_tree_t *tree, int family, prefix_t *within, patricia_node_t **root) {
+    patricia_node_t *node = tree->head;
+    patricia_node_t *cover = NULL;
+    u_char *addr = prefix_touchar(within);
+
+    while (node && node->bit < within->bitlen) {
+        if (node->prefix && node->prefix->family == family &&
+            comp_with_mask(prefix_touchar(node->prefix), addr, node->prefix->bitlen)) {
+            cover = node;
+        }
+        if (BIT_TEST(addr[node->bit >> 3], 0x80 >> (node->bit & 0x07))) {
+            node = node->r;
+        } else {
+            node = node->l;
+        }
+    }
+    *root = node;
+    return cover;
+}
+
+static int
+_emit(frozen_interval_t **runs, size_t *count, size_t *cap, u128_t start, patricia_node_t *node) {
+    frozen_interval_t *v = *runs;
+    size_t n = *count;
+
+    if (n > 0 && u128_cmp(v[n - 1].start, start) == 0) {
+        // a longer prefix starting at the same address takes over the run
+        v[n - 1].node = node;
+        if (n > 1 && v[n - 2].node == node) {
+            *count = n - 1;
+        }
+        return 0;
+    }
+    if (n > 0 && v[n - 1].node == node) {
+        return 0;
+    }
+    if (n == *cap) {
+        v = realloc(v, 2 * n * sizeof(*v));
+        if (!v) {
+            return -1;
+        }
+        *runs = v;
+        *cap = 2 * n;
+    }
+    v[n].start = start;
+    v[n].node = node;
+    *count = n + 1;
+    return 0;
+}
+
+/*
+ * The walk visits prefixes in address order, a prefix before the more
+ * specific ones under it, so a stack of the prefixes enclosing the current
+ * position is enough to know what matches between one prefix and the next.
+ */
+long
+frozen_flatten(patricia_tree_t *tree, int family, prefix_t *within, frozen_interval_t **out) {
+    struct {
+        u128_t last;
+        patricia_node_t *node;
+    } stack[PATRICIA_MAXBITS + 2];
+    int sp = 0;
+    u128_t first, last;
+    patricia_node_t *root = tree->head;
+    patricia_node_t *cover = NULL;
+    patricia_node_t *node = NULL;
+    size_t count = 0, cap = 16;
+    frozen_interval_t *runs = malloc(cap * sizeof(*runs));
+
+    if (!runs) {
+        return -1;
+    }
+    if (within) {
+        frozen_prefix_range(within, &first, &last);
+        cover = _descend(tree, family, within, &root);
+    } else {
+        first.hi = first.lo = 0;
+        last.hi = family == AF_INET6 ? ~0ULL : 0;
+        last.lo = family == AF_INET6 ? ~0ULL : 0xffffffffULL;
+    }
+
+    stack[sp].last = last;
+    stack[sp++].node = cover;
+    if (_emit(&runs, &count, &cap, first, cover) < 0) {
+        goto fail;
+    }
+
+    PATRICIA_WALK (root, node) {
+        prefix_t *prefix = node->prefix;
+        if (prefix->family == family &&
+            (!within || (prefix->bitlen >= within->bitlen &&
+                         comp_with_mask(prefix_touchar(prefix), prefix_touchar(within), within->bitlen)))) {
+            u128_t pfirst, plast;
+            frozen_prefix_range(prefix, &pfirst, &plast);
+            while (u128_cmp(stack[sp - 1].last, pfirst) < 0) {
+                sp--;
+                if (_emit(&runs, &count, &cap, u128_inc(stack[sp].last), stack[sp - 1].node) < 0) {
+                    goto fail;
+                }
+            }
+            if (_emit(&runs, &count, &cap, pfirst, node) < 0) {
+                goto fail;
+            }
+            stack[sp].last = plast;
+            stack[sp++].node = node;
+        }
+    } PATRICIA_WALK_END;
+
+    while (sp > 1) {
+        sp--;
+        if (u128_cmp(stack[sp].last, last) < 0 &&
+            _emit(&runs, &count, &cap, u128_inc(stack[sp].last), stack[sp - 1].node) < 0) {
+            goto fail;
+        }
+    }
+    *out = runs;
+    return (long)count;
+
+fail:
+    free(runs);
+    return -1;
+}
+
+static void
+_free_flat(frozen_t *frozen) {
+    free(frozen->f4.bit);
+    free(frozen->f4.child);
+    free(frozen->f4.addr);
+    free(frozen->f4.mask);
+    free(frozen->f4.id);
+    free(frozen->f6);
+    free(frozen->keys_raw);
+    free(frozen->rank);
+    free(frozen->direct);
+    free(frozen->pnodes);
+    free(frozen->leaves);
+}
+
+/* lay the tree out breadth-first; order[k] ends up holding the tree node
+ * that was given flat index k + 1 */
+static int
+_build_flat(frozen_t *frozen, patricia_tree_t *tree) {
+    patricia_node_t *node = NULL;
+    patricia_node_t **order = NULL;
+    size_t count = 0, head = 0, tail = 0;
+
+    PATRICIA_WALK_ALL (tree->head, node) {
+        count++;
+    } PATRICIA_WALK_END;
+
+    if (count > 0) {
+        order = malloc(count * sizeof(*order));
+        if (!order) {
+            return -1;
+        }
+        order[tail++] = tree->head;
+    }
+
+    if (frozen->family == AF_INET6) {
+        frozen->f6 = calloc(count + 1, sizeof(*frozen->f6));
+        if (!frozen->f6) {
+            free(order);
+            return -1;
+        }
+    } else {
+        frozen->f4.bit = calloc(count + 1, sizeof(uint32_t));
+        frozen->f4.child = calloc(2 * (count + 1), sizeof(uint32_t));
+        frozen->f4.addr = calloc(count + 1, sizeof(uint32_t));
+        frozen->f4.mask = calloc(count + 1, sizeof(uint32_t));
+        frozen->f4.id = calloc(count + 1, sizeof(int32_t));
+        if (!frozen->f4.bit || !frozen->f4.child || !frozen->f4.addr ||
+            !frozen->f4.mask || !frozen->f4.id) {
+            free(order);
+            return -1;
+        }
+    }
+
+    frozen->nodes = malloc((count + 1) * sizeof(*frozen->nodes));
+    if (!frozen->nodes) {
+        free(order);
+        return -1;
+    }
+
+    while (head < tail) {
+        patricia_node_t *tnode = order[head];
+        uint32_t index = (uint32_t)(++head);
+        int32_t id = -1;
+        uint32_t children[2] = {0, 0};
+
+        if (tnode->prefix) {
+            id = (int32_t)frozen->nnodes;
+            frozen->nodes[frozen->nnodes++] = tnode;
+        }
+        if (tnode->l) {
+            order[tail++] = tnode->l;
+            children[0] = (uint32_t)tail;
+        }
+        if (tnode->r) {
+            order[tail++] = tnode->r;
+            children[1] = (uint32_t)tail;
+        }
+
+        if (frozen->family == AF_INET6) {
+            flat6_node_t *fn = &frozen->f6[index];
+            fn->bit = tnode->bit;
+            fn->id = id;
+            fn->child[0] = children[0];
+            fn->child[1] = children[1];
+            if (tnode->prefix) {
+                _mask6(tnode->prefix->bitlen, fn->mask);
+                _load6(prefix_touchar(tnode->prefix), fn->addr);
+                fn->addr[0] &= fn->mask[0];
+                fn->addr[1] &= fn->mask[1];
+            } else {
+                fn->addr[0] = fn->addr[1] = ~0ULL;
+            }
+        } else {
+            frozen->f4.bit[index] = tnode->bit;
+            frozen->f4.id[index] = id;
+            frozen->f4.child[2 * index] = children[0];
+            frozen->f4.child[2 * index + 1] = children[1];
+            if (tnode->prefix) {
+                frozen->f4.mask[index] = _mask4(tnode->prefix->bitlen);
+                frozen->f4.addr[index] = _load4(prefix_touchar(tnode->prefix)) &
+                                         frozen->f4.mask[index];
+            } else {
+                frozen->f4.addr[index] = 0xffffffffU;
+            }
+        }
+    }
+
+    // sentinel: never matches, never leaves
+    if (frozen->family == AF_INET6) {
+        frozen->f6[0].bit = 128;
+        frozen->f6[0].id = -1;
+        frozen->f6[0].addr[0] = frozen->f6[0].addr[1] = ~0ULL;
+    } else {
+        frozen->f4.bit[0] = 32;
+        frozen->f4.id[0] = -1;
+        frozen->f4.addr[0] = 0xffffffffU;
+    }
+    frozen->root = count > 0 ? 1 : 0;
+    free(order);
+    return 0;
+}
+
+static int32_t
+_flat4_search(const flat4_t *f4, uint32_t root, uint32_t a) {
+    uint32_t index = root;
+    int32_t best = -1;
+
+    while (index) {
+        uint32_t bit = f4->bit[index];
+        if ((a & f4->mask[index]) == f4->addr[index]) {
+            best = f4->id[index];
+        }
+        if (bit >= 32) {
+            break;
+        }
+        index = f4->child[2 * index + ((a >> (31 - bit)) & 1)];
+    }
+    return best;
+}
+
+static int32_t
+_flat6_search(const flat6_node_t *f6, uint32_t root, const uint64_t *a) {
+    uint32_t index = root;
+    int32_t best = -1;
+
+    while (index) {
+        const flat6_node_t *fn = &f6[index];
+        if ((a[0] & fn->mask[0]) == fn->addr[0] &&
+            (a[1] & fn->mask[1]) == fn->addr[1]) {
+            best = fn->id;
+        }
+        if (fn->bit >= 128) {
+            break;
+        }
+        index = fn->child[(a[fn->bit >> 6] >> (63 - (fn->bit & 63))) & 1];
+    }
+    return best;
+}
+
+static void *
+_alloc_lines(size_t size, void **raw) {
+    *raw = malloc(size + 63);
+    if (!*raw) {
+        return NULL;
+    }
+    return (void *)(((uintptr_t)*raw + 63) & ~(uintptr_t)63);
+}
+
+// in-order fill of the S-tree from the sorted runs
+static void
+_stree_fill(frozen_t *frozen, const frozen_interval_t *runs, size_t n, size_t k, size_t b, size_t *t) {
+    size_t i;
+
+    if (k >= frozen->nblocks) {
+        return;
+    }
+    for (i = 0; i < b; i++) {
+        size_t slot = k * b + i;
+        u128_t key;
+        _stree_fill(frozen, runs, n, k * (b + 1) + i + 1, b, t);
+        if (*t < n) {
+            key = runs[*t].start;
+            frozen->rank[slot] = (uint32_t)(*t)++;
+        } else {
+            key.hi = key.lo = ~0ULL;
+            frozen->rank[slot] = (uint32_t)(n - 1);
+        }
+        if (frozen->family == AF_INET6) {
+            frozen->keys6[2 * slot] = key.hi;
+            frozen->keys6[2 * slot + 1] = key.lo;
+        } else {
+            frozen->keys4[slot] = (uint32_t)key.lo ^ STREE4_BIAS;
+        }
+    }
+    _stree_fill(frozen, runs, n, k * (b + 1) + b + 1, b, t);
+}
+
+static int
+_build_interval(frozen_t *frozen, patricia_tree_t *tree) {
+    frozen_interval_t *runs = NULL;
+    size_t b = frozen->family == AF_INET6 ? STREE6_B : STREE4_B;
+    size_t i, t = 0;
+    long n;
+
+    if (frozen->family == 0) {
+        return 0;
+    }
+    n = frozen_flatten(tree, frozen->family, NULL, &runs);
+    if (n < 0) {
+        return -1;
+    }
+
+    frozen->nnodes = (size_t)n;
+    frozen->nodes = malloc(n * sizeof(*frozen->nodes));
+    frozen->nblocks = (n + b - 1) / b;
+    frozen->rank = malloc(frozen->nblocks * b * sizeof(uint32_t));
+    if (frozen->family == AF_INET6) {
+        frozen->keys6 = _alloc_lines(frozen->nblocks * b * 2 * sizeof(uint64_t), &frozen->keys_raw);
+    } else {
+        frozen->keys4 = _alloc_lines(frozen->nblocks * b * sizeof(uint32_t), &frozen->keys_raw);
+    }
+    if (!frozen->nodes || !frozen->rank || !frozen->keys_raw) {
+        free(runs);
+        return -1;
+    }
+
+    for (i = 0; i < (size_t)n; i++) {
+        frozen->nodes[i] = runs[i].node;
+    }
+    _stree_fill(frozen, runs, (size_t)n, 0, b, &t);
+    free(runs);
+    return 0;
+}
+
+static int
+_count_le16(const uint32_t *keys, uint32_t x) {
+#ifdef __SSE2__
+    const __m128i *line = (const __m128i *)keys;
+    __m128i xv = _mm_set1_epi32((int)x);
+    int gt = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_load_si128(line), xv))) |
+             _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_load_si128(line + 1), xv))) << 4 |
+             _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_load_si128(line + 2), xv))) << 8 |
+             _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_load_si128(line + 3), xv))) << 12;
+    return 16 - __builtin_popcount(gt);
+#else
+    int i, count = 0;
+    for (i = 0; i < 16; i++) {
+        count += (int32_t)keys[i] <= (int32_t)x;
+    }
+    return count;
+#endif
+}
+
+static int32_t
+_stree4_search(const frozen_t *frozen, uint32_t a) {
+    uint32_t x = a ^ STREE4_BIAS;
+    size_t k = 0;
+    int32_t found = -1;
+
+    while (k < frozen->nblocks) {
+        int le = _count_le16(frozen->keys4 + k * STREE4_B, x);
+        if (le) {
+            found = (int32_t)frozen->rank[k * STREE4_B + le - 1];
+        }
+        k = k * (STREE4_B + 1) + le + 1;
+    }
+    return found;
+}
+
+static int32_t
+_stree6_search(const frozen_t *frozen, const uint64_t *a) {
+    size_t k = 0;
+    int32_t found = -1;
+
+    while (k < frozen->nblocks) {
+        const uint64_t *keys = frozen->keys6 + k * STREE6_B * 2;
+        int i, le = 0;
+        for (i = 0; i < STREE6_B; i++) {
+            le += (keys[2 * i] < a[0]) | ((keys[2 * i] == a[0]) & (keys[2 * i + 1] <= a[1]));
+        }
+        if (le) {
+            found = (int32_t)frozen->rank[k * STREE6_B + le - 1];
+        }
+        k = k * (STREE6_B + 1) + le + 1;
+    }
+    return found;
+}
+
+static int
+_popcount64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    int count = 0;
+    for (; x; count++) {
+        x &= x - 1;
+    }
+    return count;
+#endif
+}
+
+// IPv4 addresses sit in the top 32 bits
+static u128_t
+_left_align(frozen_t *frozen, u128_t a) {
+    if (frozen->family == AF_INET) {
+        a.hi = a.lo << 32;
+        a.lo = 0;
+    }
+    return a;
+}
+
+static u128_t
+_shl(u128_t a, int n) {
+    if (n >= 128) {
+        a.hi = a.lo = 0;
+    } else if (n >= 64) {
+        a.hi = a.lo << (n - 64);
+        a.lo = 0;
+    } else if (n > 0) {
+        a.hi = (a.hi << n) | (a.lo >> (64 - n));
+        a.lo <<= n;
+    }
+    return a;
+}
+
+static u128_t
+_or(u128_t a, u128_t b) {
+    a.hi |= b.hi;
+    a.lo |= b.lo;
+    return a;
+}
+
+// all-ones in the low n bits
+static u128_t
+_low_ones(int n) {
+    u128_t m;
+    m.hi = n >= 128 ? ~0ULL : n > 64 ? ~0ULL >> (128 - n) : 0;
+    m.lo = n >= 64 ? ~0ULL : n > 0 ? ~0ULL >> (64 - n) : 0;
+    return m;
+}
+
+// the 6 bits of a starting at bit offset (from the top); past the end reads 0
+static unsigned
+_stride_bits(u128_t a, int offset) {
+    if (offset + POPTRIE_STRIDE <= 64) {
+        return (unsigned)(a.hi >> (64 - POPTRIE_STRIDE - offset)) & 63;
+    } else if (offset >= 64) {
+        int e = offset - 64;
+        if (e + POPTRIE_STRIDE <= 64) {
+            return (unsigned)(a.lo >> (64 - POPTRIE_STRIDE - e)) & 63;
+        }
+        return (unsigned)(a.lo << (e + POPTRIE_STRIDE - 64)) & 63;
+    }
+    return (unsigned)((a.hi << (offset + POPTRIE_STRIDE - 64)) |
+                      (a.lo >> (128 - POPTRIE_STRIDE - offset))) & 63;
+}
+
+typedef struct {
+    u128_t *starts;             /* left-aligned run starts */
+    size_t n;
+    size_t id_base;             /* frozen->nodes index of the first run */
+} poptrie_runs_t;
+
+/* id of the run holding every address in [lo, hi], or -1 if the block is split */
+static long
+_run_for_block(const poptrie_runs_t *runs, u128_t lo, u128_t hi) {
+    size_t l = 0, r = runs->n;
+
+    // last run starting at or before lo; runs->starts[0] never comes after it
+    while (r - l > 1) {
+        size_t mid = l + (r - l) / 2;
+        if (u128_cmp(runs->starts[mid], lo) <= 0) {
+            l = mid;
+        } else {
+            r = mid;
+        }
+    }
+    if (l + 1 < runs->n && u128_cmp(runs->starts[l + 1], hi) <= 0) {
+        return -1;
+    }
+    return (long)(runs->id_base + l);
+}
+
+static long
+_poptrie_reserve(void **array, size_t *count, size_t *cap, size_t size, size_t more) {
+    size_t first = *count;
+    if (*count + more > *cap) {
+        size_t newcap = *cap ? *cap : 64;
+        void *grown;
+        while (newcap < *count + more) {
+            newcap *= 2;
+        }
+        grown = realloc(*array, newcap * size);
+        if (!grown) {
+            return -1;
+        }
+        *array = grown;
+        *cap = newcap;
+    }
+    *count += more;
+    return (long)first;
+}
+
+/* fill in node index, which covers the block of addresses starting at base
+ * whose first offset bits are fixed */
+static int
+_poptrie_fill(frozen_t *frozen, const poptrie_runs_t *runs, uint32_t index, u128_t base, int offset) {
+    int real = 128 - offset < POPTRIE_STRIDE ? 128 - offset : POPTRIE_STRIDE;
+    int below = 128 - offset - real;
+    long run[64];
+    u128_t child_base[64];
+    uint64_t vector = 0, leafvec = 0;
+    long base0, base1;
+    int v, nchildren = 0, nleaves = 0;
+
+    for (v = 0; v < 64; v++) {
+        u128_t bits;
+        bits.hi = 0;
+        bits.lo = (uint64_t)(v >> (POPTRIE_STRIDE - real));
+        child_base[v] = _or(base, _shl(bits, below));
+        run[v] = _run_for_block(runs, child_base[v], _or(child_base[v], _low_ones(below)));
+        if (run[v] < 0) {
+            vector |= 1ULL << v;
+            nchildren++;
+        } else if (v == 0 || run[v - 1] != run[v]) {
+            leafvec |= 1ULL << v;
+            nleaves++;
+        }
+    }
+
+    base0 = _poptrie_reserve((void **)&frozen->leaves, &frozen->nleaves, &frozen->leaves_cap,
+                             sizeof(uint32_t), nleaves);
+    base1 = _poptrie_reserve((void **)&frozen->pnodes, &frozen->npnodes, &frozen->pnodes_cap,
+                             sizeof(poptrie_node_t), nchildren);
+    if (base0 < 0 || base1 < 0) {
+        return -1;
+    }
+    for (v = 0, nleaves = 0; v < 64; v++) {
+        if (leafvec & (1ULL << v)) {
+            frozen->leaves[base0 + nleaves++] = (uint32_t)run[v];
+        }
+    }
+    frozen->pnodes[index].vector = vector;
+    frozen->pnodes[index].leafvec = leafvec;
+    frozen->pnodes[index].base0 = (uint32_t)base0;
+    frozen->pnodes[index].base1 = (uint32_t)base1;
+
+    for (v = 0, nchildren = 0; v < 64; v++) {
+        if (vector & (1ULL << v)) {
+            if (_poptrie_fill(frozen, runs, (uint32_t)base1 + nchildren++, child_base[v],
+                              offset + POPTRIE_STRIDE) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int
+_poptrie_fill_direct(frozen_t *frozen, const poptrie_runs_t *runs, uint32_t slot) {
+    u128_t lo;
+    long run, index;
+
+    lo.hi = (uint64_t)slot << (64 - POPTRIE_DIRECT_BITS);
+    lo.lo = 0;
+    run = _run_for_block(runs, lo, _or(lo, _low_ones(128 - POPTRIE_DIRECT_BITS)));
+    if (run >= 0) {
+        frozen->direct[slot] = POPTRIE_LEAF | (uint32_t)run;
+        return 0;
+    }
+    index = _poptrie_reserve((void **)&frozen->pnodes, &frozen->npnodes, &frozen->pnodes_cap,
+                             sizeof(poptrie_node_t), 1);
+    if (index < 0 || _poptrie_fill(frozen, runs, (uint32_t)index, lo, POPTRIE_DIRECT_BITS) < 0) {
+        return -1;
+    }
+    frozen->direct[slot] = (uint32_t)index;
+    return 0;
+}
+
+/* flatten the tree (or the part of it within a block), add the runs to
+ * frozen->nodes and hand back their left-aligned starts */
+static int
+_poptrie_load_runs(frozen_t *frozen, patricia_tree_t *tree, prefix_t *within, poptrie_runs_t *runs) {
+    frozen_interval_t *iv = NULL;
+    long i, n, first;
+
+    n = frozen_flatten(tree, frozen->family, within, &iv);
+    if (n < 0) {
+        return -1;
+    }
+    first = _poptrie_reserve((void **)&frozen->nodes, &frozen->nnodes, &frozen->nodes_cap,
+                             sizeof(*frozen->nodes), (size_t)n);
+    runs->starts = malloc(n * sizeof(u128_t));
+    if (first < 0 || !runs->starts) {
+        free(runs->starts);
+        free(iv);
+        return -1;
+    }
+    runs->n = (size_t)n;
+    runs->id_base = (size_t)first;
+    for (i = 0; i < n; i++) {
+        frozen->nodes[first + i] = iv[i].node;
+        runs->starts[i] = _left_align(frozen, iv[i].start);
+    }
+    free(iv);
+    return 0;
+}
+
+static int
+_build_poptrie(frozen_t *frozen, patricia_tree_t *tree) {
+    poptrie_runs_t runs;
+    uint32_t slot;
+
+    if (frozen->family == 0) {
+        return 0;
+    }
+    frozen->direct = malloc(((size_t)1 << POPTRIE_DIRECT_BITS) * sizeof(uint32_t));
+    if (!frozen->direct || _poptrie_load_runs(frozen, tree, NULL, &runs) < 0) {
+        return -1;
+    }
+
+    for (slot = 0; slot < (1U << POPTRIE_DIRECT_BITS); slot++) {
+        if (_poptrie_fill_direct(frozen, &runs, slot) < 0) {
+            free(runs.starts);
+            return -1;
+        }
+    }
+    free(runs.starts);
+    frozen->built_nnodes = frozen->nnodes;
+    return 0;
+}
+
+static size_t
+_poptrie_subtree_size(const frozen_t *frozen, uint32_t index) {
+    const poptrie_node_t *node = &frozen->pnodes[index];
+    size_t size = 1;
+    int i, nchildren = _popcount64(node->vector);
+
+    for (i = 0; i < nchildren; i++) {
+        size += _poptrie_subtree_size(frozen, node->base1 + i);
+    }
+    return size;
+}
+
+/*
+ * Rebuild the subtree under one direct slot to the side, then swing the
+ * slot over to it; the old subtree is left behind as garbage until the
+ * next full build.
+ */
+static int
+_poptrie_patch_slot(frozen_t *frozen, patricia_tree_t *tree, uint32_t slot) {
+    u_char addr[16] = {0};
+    prefix_t within;
+    poptrie_runs_t runs;
+    uint32_t old = frozen->direct[slot];
+    int rv;
+
+    addr[0] = (u_char)(slot >> 8);
+    addr[1] = (u_char)slot;
+    New_Prefix2(frozen->family, addr, POPTRIE_DIRECT_BITS, &within);
+    if (_poptrie_load_runs(frozen, tree, &within, &runs) < 0) {
+        return -1;
+    }
+    rv = _poptrie_fill_direct(frozen, &runs, slot);
+    free(runs.starts);
+    if (rv == 0 && !(old & POPTRIE_LEAF)) {
+        frozen->pgarbage += _poptrie_subtree_size(frozen, old);
+    }
+    return rv;
+}
+
+/* direct slots a prefix overlaps */
+static void
+_poptrie_slots(prefix_t *prefix, uint32_t *first, uint32_t *last) {
+    const u_char *addr = prefix_touchar(prefix);
+    uint32_t slot = (uint32_t)addr[0] << 8 | addr[1];
+    int fixed = prefix->bitlen < POPTRIE_DIRECT_BITS ? prefix->bitlen : POPTRIE_DIRECT_BITS;
+    uint32_t span = (1U << (POPTRIE_DIRECT_BITS - fixed)) - 1;
+
+    *first = slot & ~span;
+    *last = slot | span;
+}
+
+#define POPTRIE_PATCH_MAX_SLOTS 4096
+
+static int
+_patch_poptrie(frozen_t *frozen, patricia_tree_t *tree, prefix_t *changed, size_t n) {
+    uint64_t *dirty;
+    size_t i, ndirty = 0;
+    uint32_t slot, first, last;
+    int rv = 0;
+
+    // past this much garbage, a full build is the cheaper way to compact
+    if (frozen->pgarbage > frozen->npnodes / 2 + 1024 ||
+        frozen->nnodes > 2 * frozen->built_nnodes + 1024) {
+        return -1;
+    }
+    dirty = calloc((1U << POPTRIE_DIRECT_BITS) / 64, sizeof(uint64_t));
+    if (!dirty) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        _poptrie_slots(&changed[i], &first, &last);
+        for (slot = first; slot <= last; slot++) {
+            if (!(dirty[slot / 64] & (1ULL << (slot % 64)))) {
+                dirty[slot / 64] |= 1ULL << (slot % 64);
+                ndirty++;
+            }
+        }
+    }
+    if (ndirty > POPTRIE_PATCH_MAX_SLOTS) {
+        free(dirty);
+        return -1;
+    }
+    for (slot = 0; slot < (1U << POPTRIE_DIRECT_BITS) && rv == 0; slot++) {
+        if (dirty[slot / 64] & (1ULL << (slot % 64))) {
+            rv = _poptrie_patch_slot(frozen, tree, slot);
+        }
+    }
+    free(dirty);
+    return rv;
+}
+
+static int32_t
+_poptrie_search(const frozen_t *frozen, u128_t a) {
+    uint32_t index = frozen->direct[a.hi >> (64 - POPTRIE_DIRECT_BITS)];
+    const poptrie_node_t *node;
+    int offset = POPTRIE_DIRECT_BITS;
+    unsigned v;
+
+    if (index & POPTRIE_LEAF) {
+        return (int32_t)(index & ~POPTRIE_LEAF);
+    }
+    node = &frozen->pnodes[index];
+    v = _stride_bits(a, offset);
+    while (node->vector & (1ULL << v)) {
+        node = &frozen->pnodes[node->base1 + _popcount64(node->vector & ((2ULL << v) - 1)) - 1];
+        offset += POPTRIE_STRIDE;
+        v = _stride_bits(a, offset);
+    }
+    return (int32_t)frozen->leaves[node->base0 + _popcount64(node->leafvec & ((2ULL << v) - 1)) - 1];
+}
+
+typedef void (*flat4_batch_fn)(const flat4_t *, uint32_t, const uint32_t *, size_t, int32_t *);
+
+static void
+_flat4_batch_scalar(const flat4_t *f4, uint32_t root, const uint32_t *keys, size_t n, int32_t *ids) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        ids[i] = _flat4_search(f4, root, keys[i]);
+    }
+}
+
+#ifdef FROZEN_X86_DISPATCH
+
+/*
+ * Lock-step kernels: one lane per address.  Each round gathers the current
+ * node's fields for every lane, records a match, and gathers the next child
+ * index.  A /32 node has bit == 32, for which the variable shift yields 0,
+ * so the lane steps to child[2*i] == 0 (the sentinel) like any other leaf.
+ */
+
+__attribute__((target("avx2")))
+static void
+_flat4_batch_avx2(const flat4_t *f4, uint32_t root, const uint32_t *keys, size_t n, int32_t *ids) {
+    const int *bitp = (const int *)f4->bit;
+    const int *childp = (const int *)f4->child;
+    const int *addrp = (const int *)f4->addr;
+    const int *maskp = (const int *)f4->mask;
+    const int *idp = (const int *)f4->id;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(keys + i));
+        __m256i index = _mm256_set1_epi32((int)root);
+        __m256i best = _mm256_set1_epi32(-1);
+
+        while (!_mm256_testz_si256(index, index)) {
+            __m256i bit = _mm256_i32gather_epi32(bitp, index, 4);
+            __m256i paddr = _mm256_i32gather_epi32(addrp, index, 4);
+            __m256i pmask = _mm256_i32gather_epi32(maskp, index, 4);
+            __m256i id = _mm256_i32gather_epi32(idp, index, 4);
+            __m256i hit = _mm256_cmpeq_epi32(_mm256_and_si256(a, pmask), paddr);
+            __m256i dir = _mm256_srli_epi32(_mm256_sllv_epi32(a, bit), 31);
+
+            best = _mm256_blendv_epi8(best, id, hit);
+            index = _mm256_i32gather_epi32(childp, _mm256_add_epi32(_mm256_add_epi32(index, index), dir), 4);
+        }
+        _mm256_storeu_si256((__m256i *)(ids + i), best);
+    }
+    _flat4_batch_scalar(f4, root, keys + i, n - i, ids + i);
+}
+
+__attribute__((target("avx512f")))
+static void
+_flat4_batch_avx512(const flat4_t *f4, uint32_t root, const uint32_t *keys, size_t n, int32_t *ids) {
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m512i a = _mm512_loadu_si512((const void *)(keys + i));
+        __m512i index = _mm512_set1_epi32((int)root);
+        __m512i best = _mm512_set1_epi32(-1);
+
+        while (_mm512_test_epi32_mask(index, index)) {
+            __m512i bit = _mm512_i32gather_epi32(index, (const void *)f4->bit, 4);
+            __m512i paddr = _mm512_i32gather_epi32(index, (const void *)f4->addr, 4);
+            __m512i pmask = _mm512_i32gather_epi32(index, (const void *)f4->mask, 4);
+            __m512i id = _mm512_i32gather_epi32(index, (const void *)f4->id, 4);
+            __mmask16 hit = _mm512_cmpeq_epi32_mask(_mm512_and_si512(a, pmask), paddr);
+            __m512i dir = _mm512_srli_epi32(_mm512_sllv_epi32(a, bit), 31);
+
+            best = _mm512_mask_mov_epi32(best, hit, id);
+            index = _mm512_i32gather_epi32(_mm512_add_epi32(_mm512_add_epi32(index, index), dir),
+                                           (const void *)f4->child, 4);
+        }
+        _mm512_storeu_si512((void *)(ids + i), best);
+    }
+    _flat4_batch_avx2(f4, root, keys + i, n - i, ids + i);
+}
+
+#endif /* FROZEN_X86_DISPATCH */
+
+static flat4_batch_fn
+_flat4_batch_impl(void) {
+    static flat4_batch_fn impl = NULL;
+
+    if (impl == NULL) {
+        impl = _flat4_batch_scalar;
+#ifdef FROZEN_X86_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            impl = _flat4_batch_avx512;
+        } else if (__builtin_cpu_supports("avx2")) {
+            impl = _flat4_batch_avx2;
+        }
+#endif
+    }
+    return impl;
+}
+
+frozen_t *
+frozen_build(patricia_tree_t *tree, int kind) {
+    int family = frozen_tree_family(tree);
+    frozen_t *frozen;
+    int rv;
+
+    if (family < 0 || kind < FROZEN_FLAT || kind > FROZEN_POPTRIE) {
+        return NULL;
+    }
+
+    frozen = calloc(1, sizeof(*frozen));
+    if (!frozen) {
+        return NULL;
+    }
+    frozen->kind = kind;
+    frozen->family = family;
+
+    if (kind == FROZEN_POPTRIE) {
+        rv = _build_poptrie(frozen, tree);
+    } else if (kind == FROZEN_INTERVAL) {
+        rv = _build_interval(frozen, tree);
+    } else {
+        rv = _build_flat(frozen, tree);
+    }
+    if (rv < 0) {
+        frozen_free(frozen);
+        return NULL;
+    }
+    return frozen;
+}
+
+#define FROZEN_SAMPLES 4096
+#define FROZEN_TIMING_PASSES 8
+
+/* a packed host address somewhere inside a random prefix of the family */
+static void
+_sample_address(patricia_node_t **nodes, size_t nnodes, int family, uint32_t *seed, u_char *out) {
+    int width = family == AF_INET ? 4 : 16;
+    prefix_t *prefix;
+    int i;
+
+    *seed = *seed * 1103515245U + 12345U;
+    prefix = nodes[(*seed >> 8) % nnodes]->prefix;
+    for (i = 0; i < width; i++) {
+        int fixed = prefix->bitlen - 8 * i;
+        u_char host;
+        *seed = *seed * 1103515245U + 12345U;
+        host = (u_char)(*seed >> 16);
+        if (fixed >= 8) {
+            out[i] = prefix_touchar(prefix)[i];
+        } else if (fixed > 0) {
+            u_char mask = (u_char)(0xff << (8 - fixed));
+            out[i] = (prefix_touchar(prefix)[i] & mask) | (host & ~mask);
+        } else {
+            out[i] = host;
+        }
+    }
+}
+
+static double
+_time_lookups(frozen_t *frozen, const u_char *addrs, size_t n, size_t width) {
+    volatile uintptr_t sink = 0;
+    clock_t start = clock();
+    size_t i;
+    int pass;
+
+    for (pass = 0; pass < FROZEN_TIMING_PASSES; pass++) {
+        for (i = 0; i < n; i++) {
+            sink += (uintptr_t)frozen_search(frozen, addrs + i * width);
+        }
+    }
+    (void)sink;
+    return (double)(clock() - start);
+}
+
+frozen_t *
+frozen_build_best(patricia_tree_t *tree, const u_char *samples, size_t n) {
+    static const int kinds[] = {FROZEN_FLAT, FROZEN_INTERVAL, FROZEN_POPTRIE};
+    int family = frozen_tree_family(tree);
+    frozen_t *best = NULL;
+    double best_cost = 0;
+    patricia_node_t **nodes = NULL;
+    u_char *addrs;
+    size_t width = family == AF_INET6 ? 16 : 4;
+    size_t nnodes = 0, have, i;
+
+    if (family <= 0) {
+        return frozen_build(tree, FROZEN_FLAT);
+    }
+
+    // pad the observed sample out with addresses drawn from the table
+    have = n < FROZEN_SAMPLES ? n : FROZEN_SAMPLES;
+    addrs = malloc(FROZEN_SAMPLES * width);
+    if (!addrs) {
+        return NULL;
+    }
+    memcpy(addrs, samples, have * width);
+    if (have < FROZEN_SAMPLES) {
+        patricia_node_t *node;
+        uint32_t seed = 0x9e3779b9U;
+        nodes = malloc(tree->num_active_node * sizeof(*nodes));
+        if (!nodes) {
+            free(addrs);
+            return NULL;
+        }
+        PATRICIA_WALK(tree->head, node) {
+            nodes[nnodes++] = node;
+        } PATRICIA_WALK_END;
+        for (i = have; i < FROZEN_SAMPLES; i++) {
+            _sample_address(nodes, nnodes, family, &seed, addrs + i * width);
+        }
+        free(nodes);
+    }
+
+    for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+        frozen_t *frozen = frozen_build(tree, kinds[i]);
+        double cost;
+        if (!frozen) {
+            continue;
+        }
+        cost = _time_lookups(frozen, addrs, FROZEN_SAMPLES, width);
+        if (!best || cost < best_cost) {
+            frozen_free(best);
+            best = frozen;
+            best_cost = cost;
+        } else {
+            frozen_free(frozen);
+        }
+    }
+    free(addrs);
+    return best;
+}
+
+int
+frozen_patch(frozen_t *frozen, patricia_tree_t *tree, prefix_t *changed, size_t n) {
+    size_t i;
+
+    if (frozen->kind != FROZEN_POPTRIE || frozen->family == 0) {
+        return -1;
+    }
+    // a change of family can turn the tree mixed, which only a build can tell
+    for (i = 0; i < n; i++) {
+        if (changed[i].family != frozen->family) {
+            return -1;
+        }
+    }
+    return _patch_poptrie(frozen, tree, changed, n);
+}
+
+void
+frozen_free(frozen_t *frozen) {
+    if (frozen) {
+        _free_flat(frozen);
+        free(frozen->nodes);
+        free(frozen);
+    }
+}
+
+/* ids from a compiled lookup are only as good as the code it was given */
+static patricia_node_t *
+_node_for(frozen_t *frozen, int32_t id) {
+    return id < 0 || (size_t)id >= frozen->nnodes ? NULL : frozen->nodes[id];
+}
+
+static int32_t
+_search4(frozen_t *frozen, uint32_t a) {
+    if (frozen->kind == FROZEN_NATIVE) {
+        uint32_t packed = htonl(a);
+        return frozen->native((const unsigned char *)&packed);
+    } else if (frozen->kind == FROZEN_POPTRIE) {
+        u128_t key;
+        key.hi = (uint64_t)a << 32;
+        key.lo = 0;
+        return _poptrie_search(frozen, key);
+    } else if (frozen->kind == FROZEN_INTERVAL) {
+        return _stree4_search(frozen, a);
+    }
+    return _flat4_search(&frozen->f4, frozen->root, a);
+}
+
+static int32_t
+_search6(frozen_t *frozen, const uint64_t *a) {
+    if (frozen->kind == FROZEN_NATIVE) {
+        unsigned char packed[16];
+        int i;
+        for (i = 0; i < 8; i++) {
+            packed[i] = (unsigned char)(a[0] >> (56 - 8 * i));
+            packed[8 + i] = (unsigned char)(a[1] >> (56 - 8 * i));
+        }
+        return frozen->native(packed);
+    } else if (frozen->kind == FROZEN_POPTRIE) {
+        u128_t key;
+        key.hi = a[0];
+        key.lo = a[1];
+        return _poptrie_search(frozen, key);
+    } else if (frozen->kind == FROZEN_INTERVAL) {
+        return _stree6_search(frozen, a);
+    }
+    return _flat6_search(frozen->f6, frozen->root, a);
+}
+
+patricia_node_t *
+frozen_search(frozen_t *frozen, const u_char *addr) {
+    if (frozen->kind == FROZEN_NATIVE && frozen->family) {
+        return _node_for(frozen, frozen->native(addr));
+    } else if (frozen->family == AF_INET6) {
+        uint64_t a[2];
+        _load6(addr, a);
+        return _node_for(frozen, _search6(frozen, a));
+    } else if (frozen->family == AF_INET) {
+        return _node_for(frozen, _search4(frozen, _load4(addr)));
+    }
+    return NULL;
+}
+
+#define FROZEN_CHUNK 256
+
+void
+frozen_search_many4(frozen_t *frozen, const uint32_t *addrs, size_t n, patricia_node_t **out) {
+    int32_t ids[FROZEN_CHUNK];
+    flat4_batch_fn impl = _flat4_batch_impl();
+    size_t i, j;
+
+    if (frozen->family != AF_INET) {
+        for (i = 0; i < n; i++) {
+            out[i] = NULL;
+        }
+        return;
+    }
+
+    if (frozen->kind != FROZEN_FLAT) {
+        for (i = 0; i < n; i++) {
+            out[i] = _node_for(frozen, _search4(frozen, addrs[i]));
+        }
+        return;
+    }
+
+    for (i = 0; i < n; i += FROZEN_CHUNK) {
+        size_t len = n - i < FROZEN_CHUNK ? n - i : FROZEN_CHUNK;
+        impl(&frozen->f4, frozen->root, addrs + i, len, ids);
+        for (j = 0; j < len; j++) {
+            out[i + j] = _node_for(frozen, ids[j]);
+        }
+    }
+}
+
+void
+frozen_search_many(frozen_t *frozen, const u_char *addrs, size_t n, patricia_node_t **out) {
+    size_t i;
+
+    if (frozen->family == AF_INET6) {
+        for (i = 0; i < n; i++) {
+            out[i] = frozen_search(frozen, addrs + 16 * i);
+        }
+    } else if (frozen->family == AF_INET) {
+        uint32_t keys[FROZEN_CHUNK];
+        size_t j;
+        for (i = 0; i < n; i += FROZEN_CHUNK) {
+            size_t len = n - i < FROZEN_CHUNK ? n - i : FROZEN_CHUNK;
+            for (j = 0; j < len; j++) {
+                keys[j] = _load4(addrs + 4 * (i + j));
+            }
+            frozen_search_many4(frozen, keys, len, out + i);
+        }
+    } else {
+        for (i = 0; i < n; i++) {
+            out[i] = NULL;
+        }
+    }
+}
+
+/*
+ * Compiled lookups.  Prefix ids are positions in the tree's walk order,
+ * which is the order keys() reports them in.
+ */
+
+static patricia_node_t **
+_walk_nodes(patricia_tree_t *tree, size_t *count) {
+    patricia_node_t **nodes = malloc((tree->num_active_node + 1) * sizeof(*nodes));
+    patricia_node_t *node;
+    size_t n = 0;
+
+    if (!nodes) {
+        return NULL;
+    }
+    PATRICIA_WALK(tree->head, node) {
+        nodes[n++] = node;
+    } PATRICIA_WALK_END;
+    *count = n;
+    return nodes;
+}
+
+/* FNV-1a over each prefix's family, length and address, in walk order */
+static uint64_t
+_walk_signature(patricia_node_t **walk, size_t n) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i, j;
+
+    for (i = 0; i < n; i++) {
+        prefix_t *prefix = walk[i]->prefix;
+        u_char head[3] = {(u_char)prefix->family, (u_char)prefix->bitlen, (u_char)(prefix->bitlen >> 8)};
+        const u_char *addr = prefix_touchar(prefix);
+        for (j = 0; j < sizeof(head); j++) {
+            h = (h ^ head[j]) * 0x100000001b3ULL;
+        }
+        for (j = 0; j < (prefix->family == AF_INET6 ? 16u : 4u); j++) {
+            h = (h ^ addr[j]) * 0x100000001b3ULL;
+        }
+    }
+    return h;
+}
+
+int
+frozen_signature(patricia_tree_t *tree, uint64_t *out) {
+    size_t n;
+    patricia_node_t **walk = _walk_nodes(tree, &n);
+
+    if (!walk) {
+        return -1;
+    }
+    *out = _walk_signature(walk, n);
+    free(walk);
+    return 0;
+}
+
+typedef struct {
+    patricia_node_t *node;
+    int id;
+} node_id_t;
+
+static int
+_cmp_node_id(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)((const node_id_t *)a)->node;
+    uintptr_t y = (uintptr_t)((const node_id_t *)b)->node;
+    return x < y ? -1 : x > y;
+}
+
+typedef struct {
+    char *buf;
+    size_t len, cap;
+    int failed;
+} emit_buf_t;
+
+static void
+_emit_printf(emit_buf_t *out, int indent, const char *fmt, ...) {
+    va_list ap;
+    int need;
+
+    if (out->failed) {
+        return;
+    }
+    va_start(ap, fmt);
+    need = vsnprintf(NULL, 0, fmt, ap) + indent;
+    va_end(ap);
+    if (out->len + need + 1 > out->cap) {
+        size_t newcap = out->cap ? out->cap : 4096;
+        char *grown;
+        while (newcap < out->len + need + 1) {
+            newcap *= 2;
+        }
+        grown = realloc(out->buf, newcap);
+        if (!grown) {
+            out->failed = 1;
+            return;
+        }
+        out->buf = grown;
+        out->cap = newcap;
+    }
+    memset(out->buf + out->len, ' ', indent);
+    va_start(ap, fmt);
+    vsnprintf(out->buf + out->len + indent, out->cap - out->len - indent, fmt, ap);
+    va_end(ap);
+    out->len += need;
+}
+
+/* binary decision over runs[lo, hi), which is never empty */
+static void
+_emit_decision(emit_buf_t *out, int family, const frozen_interval_t *runs, const int *ids,
+               size_t lo, size_t hi, int indent) {
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        u128_t at = runs[mid].start;
+        if (family == AF_INET) {
+            _emit_printf(out, indent, "if (a < 0x%08xU) {\n", (unsigned)at.lo);
+        } else if (at.lo == 0) {
+            _emit_printf(out, indent, "if (hi < 0x%016llxULL) {\n", (unsigned long long)at.hi);
+        } else {
+            _emit_printf(out, indent, "if (hi < 0x%016llxULL || (hi == 0x%016llxULL && lo < 0x%016llxULL)) {\n",
+                         (unsigned long long)at.hi, (unsigned long long)at.hi, (unsigned long long)at.lo);
+        }
+        _emit_decision(out, family, runs, ids, lo, mid, indent + 4);
+        _emit_printf(out, indent, "}\n");
+        lo = mid;
+    }
+    _emit_printf(out, indent, "return %d;\n", ids[lo]);
+}
+
+char *
+frozen_emit_c(patricia_tree_t *tree, const char *name) {
+    int family = frozen_tree_family(tree);
+    frozen_interval_t *runs = NULL;
+    patricia_node_t **walk = NULL;
+    node_id_t *byptr = NULL;
+    int *ids = NULL;
+    emit_buf_t out = {NULL, 0, 0, 0};
+    size_t nwalk = 0, i;
+    long nruns = 0;
+
+    if (family < 0) {
+        return NULL;
+    }
+    walk = _walk_nodes(tree, &nwalk);
+    if (!walk) {
+        return NULL;
+    }
+    if (family) {
+        nruns = frozen_flatten(tree, family, NULL, &runs);
+        byptr = malloc((nwalk + 1) * sizeof(*byptr));
+        ids = malloc((nruns > 0 ? nruns : 1) * sizeof(*ids));
+        if (nruns < 0 || !byptr || !ids) {
+            out.failed = 1;
+            goto done;
+        }
+        for (i = 0; i < nwalk; i++) {
+            byptr[i].node = walk[i];
+            byptr[i].id = (int)i;
+        }
+        qsort(byptr, nwalk, sizeof(*byptr), _cmp_node_id);
+        for (i = 0; i < (size_t)nruns; i++) {
+            node_id_t key, *hit;
+            key.node = runs[i].node;
+            hit = runs[i].node ? bsearch(&key, byptr, nwalk, sizeof(*byptr), _cmp_node_id) : NULL;
+            ids[i] = hit ? hit->id : -1;
+        }
+    }
+
+    _emit_printf(&out, 0, "/* generated by pytricia: %lu prefixes, %ld runs */\n\n",
+                 (unsigned long)nwalk, nruns);
+    _emit_printf(&out, 0, "#include <stdint.h>\n\nint\n%s(const unsigned char *addr)\n{\n", name);
+    if (family == AF_INET) {
+        _emit_printf(&out, 4, "uint32_t a = (uint32_t)addr[0] << 24 | (uint32_t)addr[1] << 16 |\n");
+        _emit_printf(&out, 8, "(uint32_t)addr[2] << 8 | (uint32_t)addr[3];\n\n");
+    } else if (family == AF_INET6) {
+        _emit_printf(&out, 4, "uint64_t hi = 0, lo = 0;\n");
+        _emit_printf(&out, 4, "int i;\n\n");
+        _emit_printf(&out, 4, "for (i = 0; i < 8; i++) {\n");
+        _emit_printf(&out, 8, "hi = hi << 8 | addr[i];\n");
+        _emit_printf(&out, 8, "lo = lo << 8 | addr[8 + i];\n");
+        _emit_printf(&out, 4, "}\n\n");
+    }
+    if (family) {
+        _emit_decision(&out, family, runs, ids, 0, (size_t)nruns, 4);
+    } else {
+        _emit_printf(&out, 4, "(void)addr;\n");
+        _emit_printf(&out, 4, "return -1;\n");
+    }
+    _emit_printf(&out, 0, "}\n\n");
+    _emit_printf(&out, 0, "/* freeze(engine='native') checks this against the table */\n");
+    _emit_printf(&out, 0, "const uint64_t %s_signature = 0x%016llxULL;\n", name,
+                 (unsigned long long)_walk_signature(walk, nwalk));
+
+done:
+    free(walk);
+    free(runs);
+    free(byptr);
+    free(ids);
+    if (out.failed) {
+        free(out.buf);
+        return NULL;
+    }
+    return out.buf;
+}
+
+frozen_t *
+frozen_native(patricia_tree_t *tree, frozen_lookup_fn lookup) {
+    int family = frozen_tree_family(tree);
+    frozen_t *frozen;
+
+    if (family < 0) {
+        return NULL;
+    }
+    frozen = calloc(1, sizeof(*frozen));
+    if (!frozen) {
+        return NULL;
+    }
+    frozen->kind = FROZEN_NATIVE;
+    frozen->family = family;
+    frozen->native = lookup;
+    frozen->nodes = _walk_nodes(tree, &frozen->nnodes);
+    if (!frozen->nodes) {
+        free(frozen);
+        return NULL;
+    }
+    return frozen;
+}
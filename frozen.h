@@ -0,0 +1,157 @@
+/*
+ * This file is part of Pytricia.
+ * Joel Sommers <jsommers@colgate.edu>
+ *
+ * Pytricia is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pytricia is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Pytricia.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compiled, read-only views of a patricia tree ("frozen" tables).
+ *
+ * A frozen_t is built from a patricia_tree_t and answers longest-prefix
+ * match queries for full-length host addresses of a single address family.
+ * It never owns the tree's nodes or data; results are handed back as
+ * pointers to the tree's own patricia_node_t's, so the tree must outlive
+ * (and must not be structurally modified underneath) a frozen_t built
+ * from it.
+ */
+
+#ifndef _FROZEN_H
+#define _FROZEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "patricia.h"
+
+#define FROZEN_FLAT 1
+#define FROZEN_INTERVAL 2
+#define FROZEN_POPTRIE 3
+#define FROZEN_NATIVE 4
+
+typedef struct _frozen_t frozen_t;
+
+/* an address as a 128-bit integer; IPv4 addresses only use lo */
+typedef struct {
+    uint64_t hi, lo;
+} u128_t;
+
+static inline int
+u128_cmp (u128_t a, u128_t b)
+{
+    if (a.hi != b.hi)
+        return a.hi < b.hi ? -1 : 1;
+    if (a.lo != b.lo)
+        return a.lo < b.lo ? -1 : 1;
+    return 0;
+}
+
+static inline u128_t
+u128_inc (u128_t a)
+{
+    a.lo++;
+    if (a.lo == 0)
+        a.hi++;
+    return a;
+}
+
+/* the first and last address covered by prefix, as integers */
+void frozen_prefix_range (prefix_t *prefix, u128_t *first, u128_t *last);
+
+/*
+ * A run of consecutive addresses that share one longest match.  Runs are
+ * reported by where they start; each ends where the next one begins.
+ */
+typedef struct {
+    u128_t start;
+    patricia_node_t *node;      /* NULL if nothing matches */
+} frozen_interval_t;
+
+/*
+ * Cut the address space of family -- or only the block covered by within,
+ * if it isn't NULL -- into maximal runs with the same longest match, looking
+ * only at prefixes of that family.  Takes one in-order walk of the tree.
+ * Returns the number of runs and hands back a malloc'ed array, or -1 if
+ * memory runs out.
+ */
+long frozen_flatten (patricia_tree_t *tree, int family, prefix_t *within,
+                     frozen_interval_t **out);
+
+/* address family shared by every prefix in the tree; 0 if the tree is
+ * empty and -1 if it holds both IPv4 and IPv6 prefixes */
+int frozen_tree_family (patricia_tree_t *tree);
+
+/* returns NULL if the tree has mixed families or memory runs out */
+frozen_t *frozen_build (patricia_tree_t *tree, int kind);
+void frozen_free (frozen_t *frozen);
+
+/*
+ * Bring a frozen view up to date after the n prefixes in changed were added
+ * to or removed from the tree, rebuilding only the parts of it they cover.
+ * Only poptrie views can be patched.  Returns -1 if the view has to be
+ * rebuilt instead, which may leave it partly patched.
+ */
+int frozen_patch (frozen_t *frozen, patricia_tree_t *tree, prefix_t *changed,
+                  size_t n);
+
+/*
+ * Build every engine that can serve the tree, time each on the same sample
+ * of host addresses and keep the fastest.  samples holds n packed addresses
+ * of the tree's family; if there are too few, the rest are drawn from the
+ * tree's own prefixes.  Returns NULL where frozen_build() would.
+ */
+frozen_t *frozen_build_best (patricia_tree_t *tree, const u_char *samples,
+                             size_t n);
+
+/*
+ * A lookup function compiled from frozen_emit_c() output.  Takes a host
+ * address (4 or 16 bytes, network order) and returns the index of its
+ * longest match among the tree's prefixes in walk order, or -1.
+ */
+typedef int (*frozen_lookup_fn) (const unsigned char *addr);
+
+/*
+ * C source for a frozen_lookup_fn called name that answers for the tree as
+ * it is now: a decision tree over the match runs, with every boundary and
+ * result compiled in as a constant.  Returns a malloc'ed string, or NULL if
+ * the tree has mixed families or memory runs out.
+ */
+char *frozen_emit_c (patricia_tree_t *tree, const char *name);
+
+/*
+ * A hash of the tree's prefixes, in walk order.  frozen_emit_c() writes it
+ * into the source as name_signature, so a compiled lookup can be matched to
+ * the tree it was emitted for.  Returns -1 if memory runs out.
+ */
+int frozen_signature (patricia_tree_t *tree, uint64_t *out);
+
+/* wrap a compiled lookup emitted for this tree; it can't be rebuilt, so
+ * frozen_build() never returns a FROZEN_NATIVE view.  Ids the lookup returns
+ * past the tree's prefixes are treated as no match */
+frozen_t *frozen_native (patricia_tree_t *tree, frozen_lookup_fn lookup);
+
+int frozen_kind (frozen_t *frozen);
+int frozen_family (frozen_t *frozen);
+
+/* longest match for one host address (4 or 16 bytes, network order) */
+patricia_node_t *frozen_search (frozen_t *frozen, const u_char *addr);
+
+/* longest match for n packed host addresses of the frozen family */
+void frozen_search_many (frozen_t *frozen, const u_char *addrs, size_t n,
+                         patricia_node_t **out);
+
+/* same, for IPv4 addresses given as host-order integers */
+void frozen_search_many4 (frozen_t *frozen, const uint32_t *addrs, size_t n,
+                          patricia_node_t **out);
+
+#endif /* _FROZEN_H */
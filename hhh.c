@@ -0,0 +1,285 @@
+/*
+ * This file is part of Pytricia.
+ * Joel Sommers <jsommers@colgate.edu>
+ *
+ * Pytricia is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pytricia is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Pytricia.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include "hhh.h"
+
+/* below this, the shared scale is folded back into the counters */
+#define HHH_MIN_SCALE 1e-100
+
+/* compression frees 1/HHH_LOW_WATER of max_nodes, so it runs once per that
+ * much growth rather than on every update past the limit */
+#define HHH_LOW_WATER 4
+
+typedef struct {
+    double count;               /* in units of 1/scale */
+    double scratch;
+} hhh_counter_t;
+
+struct _hhh_t {
+    patricia_tree_t *tree;
+    int family;
+    int maxbits;
+    int step;
+    double epsilon;
+    size_t max_nodes;
+    size_t nnodes;
+    double scale;
+    double total;               /* in units of 1/scale */
+};
+
+static patricia_node_t *
+_hhh_add(hhh_t *hhh, const u_char *addr, int bitlen) {
+    u_char masked[16] = {0};
+    prefix_t prefix;
+    patricia_node_t *node;
+    int i;
+
+    for (i = 0; i < bitlen / 8; i++) {
+        masked[i] = addr[i];
+    }
+    if (bitlen % 8) {
+        masked[i] = addr[i] & (u_char)(0xff << (8 - bitlen % 8));
+    }
+    New_Prefix2(hhh->family, masked, bitlen, &prefix);
+    node = patricia_lookup(hhh->tree, &prefix);
+    if (node && !node->data) {
+        node->data = calloc(1, sizeof(hhh_counter_t));
+        if (!node->data) {
+            patricia_remove(hhh->tree, node);
+            return NULL;
+        }
+        hhh->nnodes++;
+    }
+    return node;
+}
+
+static hhh_counter_t *
+_hhh_counter(patricia_node_t *node) {
+    return (hhh_counter_t *)node->data;
+}
+
+/* nearest ancestor in the set */
+static patricia_node_t *
+_hhh_parent(patricia_node_t *node) {
+    patricia_node_t *parent = node->parent;
+    while (parent && !parent->prefix) {
+        parent = parent->parent;
+    }
+    return parent;
+}
+
+/* the set in walk order: every prefix before its descendants */
+static patricia_node_t **
+_hhh_nodes(hhh_t *hhh) {
+    patricia_node_t **nodes = malloc((hhh->nnodes + 1) * sizeof(*nodes));
+    patricia_node_t *node;
+    size_t n = 0;
+
+    if (!nodes) {
+        return NULL;
+    }
+    PATRICIA_WALK(hhh->tree->head, node) {
+        nodes[n++] = node;
+    } PATRICIA_WALK_END;
+    return nodes;
+}
+
+hhh_t *
+hhh_new(int family, int step, double epsilon, size_t max_nodes) {
+    u_char zero[16] = {0};
+    hhh_t *hhh = calloc(1, sizeof(*hhh));
+
+    if (!hhh) {
+        return NULL;
+    }
+    hhh->family = family;
+    hhh->maxbits = family == AF_INET6 ? 128 : 32;
+    hhh->step = step;
+    hhh->epsilon = epsilon;
+    hhh->max_nodes = max_nodes ? max_nodes : 1;
+    hhh->scale = 1.0;
+    hhh->tree = New_Patricia(hhh->maxbits);
+    if (!hhh->tree || !_hhh_add(hhh, zero, 0)) {
+        hhh_free(hhh);
+        return NULL;
+    }
+    return hhh;
+}
+
+void
+hhh_free(hhh_t *hhh) {
+    if (hhh) {
+        if (hhh->tree) {
+            Destroy_Patricia(hhh->tree, free);
+        }
+        free(hhh);
+    }
+}
+
+int
+hhh_family(hhh_t *hhh) {
+    return hhh->family;
+}
+
+size_t
+hhh_size(hhh_t *hhh) {
+    return hhh->nnodes;
+}
+
+double
+hhh_total(hhh_t *hhh) {
+    return hhh->total * hhh->scale;
+}
+
+int
+hhh_room(hhh_t *hhh, double sum) {
+    return sum >= 0 && sum <= (DBL_MAX - hhh->total) * hhh->scale;
+}
+
+/*
+ * Fold leaves holding less than threshold into their parents, deepest
+ * first.  scratch counts each prefix's children that stay.
+ */
+static int
+_hhh_compress(hhh_t *hhh, double threshold) {
+    patricia_node_t **nodes = _hhh_nodes(hhh);
+    size_t i, n = hhh->nnodes;
+
+    if (!nodes) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        _hhh_counter(nodes[i])->scratch = 0;
+    }
+    for (i = n; i-- > 1;) {
+        hhh_counter_t *counter = _hhh_counter(nodes[i]);
+        hhh_counter_t *parent = _hhh_counter(_hhh_parent(nodes[i]));
+        if (counter->scratch == 0 && counter->count < threshold) {
+            parent->count += counter->count;
+            free(counter);
+            nodes[i]->data = NULL;
+            patricia_remove(hhh->tree, nodes[i]);
+            hhh->nnodes--;
+        } else {
+            parent->scratch += 1;
+        }
+    }
+    free(nodes);
+    return 0;
+}
+
+int
+hhh_update(hhh_t *hhh, const u_char *addr, double weight) {
+    prefix_t host;
+    patricia_node_t *node;
+    hhh_counter_t *counter;
+    double w = weight / hhh->scale;
+
+    New_Prefix2(hhh->family, (void *)addr, hhh->maxbits, &host);
+    node = patricia_search_best(hhh->tree, &host);
+    counter = _hhh_counter(node);
+    counter->count += w;
+    hhh->total += w;
+
+    if (node->prefix->bitlen < hhh->maxbits && counter->count >= hhh->epsilon * hhh->total) {
+        int bitlen = node->prefix->bitlen + hhh->step;
+        if (!_hhh_add(hhh, addr, bitlen < hhh->maxbits ? bitlen : hhh->maxbits)) {
+            return -1;
+        }
+        if (hhh->nnodes > hhh->max_nodes) {
+            // fold down to the low-water mark, so the next compression is
+            // a quarter of max_nodes of growth away
+            size_t low = hhh->max_nodes - hhh->max_nodes / HHH_LOW_WATER;
+            double threshold = hhh->epsilon * hhh->total;
+            if (!(threshold > 0)) {
+                threshold = DBL_MIN;
+            }
+            while (hhh->nnodes > low) {
+                if (_hhh_compress(hhh, threshold) < 0) {
+                    return -1;
+                }
+                threshold *= 2;
+            }
+        }
+    }
+    return 0;
+}
+
+void
+hhh_decay(hhh_t *hhh, double factor) {
+    patricia_node_t *node;
+
+    hhh->scale *= factor;
+    if (hhh->scale >= HHH_MIN_SCALE) {
+        return;
+    }
+    PATRICIA_WALK(hhh->tree->head, node) {
+        _hhh_counter(node)->count *= hhh->scale;
+    } PATRICIA_WALK_END;
+    hhh->total *= hhh->scale;
+    hhh->scale = 1.0;
+}
+
+long
+hhh_heavy_hitters(hhh_t *hhh, double phi, hhh_result_t **out) {
+    patricia_node_t **nodes = _hhh_nodes(hhh);
+    hhh_result_t *results;
+    double threshold = phi * hhh->total;
+    size_t i, n = hhh->nnodes, count = 0;
+
+    results = malloc((n + 1) * sizeof(*results));
+    if (!nodes || !results) {
+        free(nodes);
+        free(results);
+        return -1;
+    }
+    // scratch carries what is left of each subtree once its heavy hitters
+    // are taken out, deepest first
+    for (i = 0; i < n; i++) {
+        _hhh_counter(nodes[i])->scratch = _hhh_counter(nodes[i])->count;
+    }
+    for (i = n; i-- > 0;) {
+        hhh_counter_t *counter = _hhh_counter(nodes[i]);
+        if (counter->scratch >= threshold && counter->scratch > 0) {
+            counter->scratch = -counter->scratch;       // reported; passes nothing up
+        } else if (i > 0) {
+            _hhh_counter(_hhh_parent(nodes[i]))->scratch += counter->scratch;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        hhh_counter_t *counter = _hhh_counter(nodes[i]);
+        if (counter->scratch < 0) {
+            results[count].node = nodes[i];
+            results[count++].count = -counter->scratch * hhh->scale;
+        }
+    }
+    free(nodes);
+    *out = results;
+    return (long)count;
+}
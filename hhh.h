@@ -0,0 +1,70 @@
+/*
+ * This file is part of Pytricia.
+ * Joel Sommers <jsommers@colgate.edu>
+ *
+ * Pytricia is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pytricia is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Pytricia.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Streaming hierarchical heavy hitters over a patricia tree.
+ *
+ * The tree holds an adaptive set of prefixes, each with a counter.  An
+ * address is counted at the longest prefix in the set that covers it; once
+ * that counter reaches epsilon of the total, the prefix grows a child one
+ * step longer along the address, so the set only deepens where traffic is
+ * concentrated.  When the set outgrows max_nodes, the smallest leaves are
+ * folded back into their parents until it is down to three quarters of
+ * max_nodes.  Decay multiplies every counter by a
+ * factor in O(1) through a shared scale.
+ */
+
+#ifndef _HHH_H
+#define _HHH_H
+
+#include <stddef.h>
+#include "patricia.h"
+
+typedef struct _hhh_t hhh_t;
+
+typedef struct {
+    patricia_node_t *node;
+    double count;               /* traffic not already in a reported descendant */
+} hhh_result_t;
+
+/* returns NULL if memory runs out */
+hhh_t *hhh_new (int family, int step, double epsilon, size_t max_nodes);
+void hhh_free (hhh_t *hhh);
+
+int hhh_family (hhh_t *hhh);
+size_t hhh_size (hhh_t *hhh);
+double hhh_total (hhh_t *hhh);
+
+/* whether weights adding up to sum can be counted without the total
+ * overflowing */
+int hhh_room (hhh_t *hhh, double sum);
+
+/* count weight for a host address (network order); -1 if memory runs out */
+int hhh_update (hhh_t *hhh, const u_char *addr, double weight);
+
+/* multiply every counter by 0 < factor <= 1 */
+void hhh_decay (hhh_t *hhh, double factor);
+
+/*
+ * Prefixes whose traffic, less that of heavy hitters below them, is at
+ * least phi of the total; in address order.  Returns how many and hands
+ * back a malloc'ed array, or -1 if memory runs out.
+ */
+long hhh_heavy_hitters (hhh_t *hhh, double phi, hhh_result_t **out);
+
+#endif /* _HHH_H */
@@ -0,0 +1,240 @@
+/*
+ * This file is part of Pytricia.
+ * Joel Sommers <jsommers@colgate.edu>
+ *
+ * Pytricia is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pytricia is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Pytricia.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "persist.h"
+
+static int
+_persist_bit(const u_char *addr, u_int bit) {
+    return (addr[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/* the number of leading bits a and b share, up to limit */
+static u_int
+_persist_common(const u_char *a, const u_char *b, u_int limit) {
+    u_int n = 0;
+
+    while (n + 8 <= limit && a[n >> 3] == b[n >> 3]) {
+        n += 8;
+    }
+    while (n < limit && _persist_bit(a, n) == _persist_bit(b, n)) {
+        n++;
+    }
+    return n;
+}
+
+/* a new node holding a reference to value and to each child */
+static persist_node_t *
+_persist_node(const u_char *addr, u_int bitlen, void *value,
+              persist_node_t *l, persist_node_t *r, const persist_ops_t *ops) {
+    persist_node_t *node = malloc(sizeof(*node));
+
+    if (!node) {
+        return NULL;
+    }
+    memset(node->addr, 0, sizeof(node->addr));
+    memcpy(node->addr, addr, (bitlen + 7) / 8);
+    if (bitlen % 8) {
+        node->addr[bitlen / 8] &= 0xff << (8 - bitlen % 8);
+    }
+    node->bitlen = bitlen;
+    node->refs = 1;
+    node->value = value;
+    node->l = l;
+    node->r = r;
+    if (value) {
+        ops->retain(value);
+    }
+    persist_retain(l);
+    persist_retain(r);
+    return node;
+}
+
+void
+persist_retain(persist_node_t *node) {
+    if (node) {
+        node->refs++;
+    }
+}
+
+void
+persist_release(persist_node_t *node, const persist_ops_t *ops) {
+    if (!node || --node->refs > 0) {
+        return;
+    }
+    persist_release(node->l, ops);
+    persist_release(node->r, ops);
+    if (node->value) {
+        ops->release(node->value);
+    }
+    free(node);
+}
+
+/* hands back a new node, or NULL if memory runs out */
+static persist_node_t *
+_persist_insert(persist_node_t *node, const u_char *addr, u_int bitlen,
+                void *value, const persist_ops_t *ops, int *added) {
+    persist_node_t *child, *rv;
+    u_int common;
+    int right;
+
+    if (!node) {
+        *added = 1;
+        return _persist_node(addr, bitlen, value, NULL, NULL, ops);
+    }
+    common = _persist_common(node->addr, addr,
+                             node->bitlen < bitlen ? node->bitlen : bitlen);
+    if (common == node->bitlen && common == bitlen) {
+        *added = node->value == NULL;
+        return _persist_node(addr, bitlen, value, node->l, node->r, ops);
+    }
+    if (common == node->bitlen) {
+        /* the prefix goes somewhere below node */
+        right = _persist_bit(addr, common);
+        child = _persist_insert(right ? node->r : node->l, addr, bitlen, value,
+                                ops, added);
+        if (!child) {
+            return NULL;
+        }
+        rv = _persist_node(node->addr, node->bitlen, node->value,
+                           right ? node->l : child, right ? child : node->r,
+                           ops);
+        persist_release(child, ops);
+        return rv;
+    }
+    *added = 1;
+    if (common == bitlen) {
+        /* the prefix contains node */
+        right = _persist_bit(node->addr, common);
+        return _persist_node(addr, bitlen, value, right ? NULL : node,
+                             right ? node : NULL, ops);
+    }
+    /* they part ways at bit common, under a new branch point */
+    child = _persist_node(addr, bitlen, value, NULL, NULL, ops);
+    if (!child) {
+        return NULL;
+    }
+    right = _persist_bit(addr, common);
+    rv = _persist_node(addr, common, NULL, right ? node : child,
+                       right ? child : node, ops);
+    persist_release(child, ops);
+    return rv;
+}
+
+int
+persist_insert(persist_node_t *root, const u_char *addr, u_int bitlen,
+               void *value, const persist_ops_t *ops, persist_node_t **out) {
+    int added = 0;
+
+    *out = _persist_insert(root, addr, bitlen, value, ops, &added);
+    return *out ? added : -1;
+}
+
+int
+persist_delete(persist_node_t *root, const u_char *addr, u_int bitlen,
+               const persist_ops_t *ops, persist_node_t **out) {
+    persist_node_t *child, *other;
+    int right, rv;
+
+    *out = root;
+    if (!root || root->bitlen > bitlen ||
+        _persist_common(root->addr, addr, root->bitlen) < root->bitlen) {
+        persist_retain(root);
+        return 0;
+    }
+    if (root->bitlen == bitlen) {
+        if (!root->value) {
+            persist_retain(root);
+            return 0;
+        }
+        if (root->l && root->r) {
+            /* still needed as a branch point */
+            *out = _persist_node(root->addr, root->bitlen, NULL, root->l,
+                                 root->r, ops);
+            return *out ? 1 : -1;
+        }
+        *out = root->l ? root->l : root->r;
+        persist_retain(*out);
+        return 1;
+    }
+
+    right = _persist_bit(addr, root->bitlen);
+    rv = persist_delete(right ? root->r : root->l, addr, bitlen, ops, &child);
+    if (rv < 0) {
+        *out = NULL;
+        return rv;
+    }
+    if (rv == 0) {
+        persist_release(child, ops);
+        persist_retain(root);
+        return 0;
+    }
+    other = right ? root->l : root->r;
+    if (!root->value && !child) {
+        /* a branch point left with one child gives way to it */
+        *out = other;
+        persist_retain(other);
+        return 1;
+    }
+    *out = _persist_node(root->addr, root->bitlen, root->value,
+                         right ? other : child, right ? child : other, ops);
+    persist_release(child, ops);
+    return *out ? 1 : -1;
+}
+
+persist_node_t *
+persist_search_best(persist_node_t *root, const u_char *addr, u_int bitlen) {
+    persist_node_t *node = root, *best = NULL;
+
+    while (node && node->bitlen <= bitlen &&
+           _persist_common(node->addr, addr, node->bitlen) == node->bitlen) {
+        if (node->value) {
+            best = node;
+        }
+        if (node->bitlen == bitlen) {
+            break;
+        }
+        node = _persist_bit(addr, node->bitlen) ? node->r : node->l;
+    }
+    return best;
+}
+
+persist_node_t *
+persist_search_exact(persist_node_t *root, const u_char *addr, u_int bitlen) {
+    persist_node_t *node = persist_search_best(root, addr, bitlen);
+
+    return node && node->bitlen == bitlen ? node : NULL;
+}
+
+int
+persist_walk(persist_node_t *root, persist_walk_fn fn, void *arg) {
+    int rv;
+
+    if (!root) {
+        return 0;
+    }
+    if (root->value && (rv = fn(root, arg)) < 0) {
+        return rv;
+    }
+    if ((rv = persist_walk(root->l, fn, arg)) < 0) {
+        return rv;
+    }
+    return persist_walk(root->r, fn, arg);
+}
@@ -0,0 +1,88 @@
+/*
+ * This file is part of Pytricia.
+ * Joel Sommers <jsommers@colgate.edu>
+ *
+ * Pytricia is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pytricia is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Pytricia.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A persistent (versioned) binary trie of prefixes.  Nodes are never
+ * changed once built: an insert or delete copies the nodes on the path to
+ * its prefix and shares everything else with the trie it started from, so
+ * any number of versions can be kept side by side at the cost of one path
+ * per change.  Nodes are reference counted; a version holds a reference to
+ * its root, and a node frees its children and value with its last one.
+ *
+ * Like a patricia tree, the trie is path compressed: every node is either
+ * an entry or a branch point with two children.  Keys are bit strings of up
+ * to 128 bits, one family per trie.
+ */
+
+#ifndef _PERSIST_H
+#define _PERSIST_H
+
+#include <sys/types.h>
+
+typedef struct _persist_node_t {
+    struct _persist_node_t *l, *r;
+    void *value;                /* NULL at a branch point with no entry */
+    int refs;
+    u_short bitlen;
+    u_char addr[16];            /* zeroed past bitlen */
+} persist_node_t;
+
+/* what to do with a value when a node takes or lets go of it */
+typedef void (*persist_value_fn) (void *value);
+
+typedef struct {
+    persist_value_fn retain, release;
+} persist_ops_t;
+
+void persist_retain (persist_node_t *node);
+void persist_release (persist_node_t *node, const persist_ops_t *ops);
+
+/*
+ * Map prefix (addr, bitlen) to value in the trie at root, which is left as
+ * it is.  Hands back a reference to the new root in *out and returns 1 if
+ * the prefix is new and 0 if it replaced a value, or -1 if memory runs out.
+ */
+int persist_insert (persist_node_t *root, const u_char *addr, u_int bitlen,
+                    void *value, const persist_ops_t *ops,
+                    persist_node_t **out);
+
+/*
+ * Remove prefix (addr, bitlen) from the trie at root, which is left as it
+ * is.  Hands back a reference to the new root in *out and returns 1, or 0
+ * if the prefix isn't there (and *out is root itself), or -1 if memory
+ * runs out.
+ */
+int persist_delete (persist_node_t *root, const u_char *addr, u_int bitlen,
+                    const persist_ops_t *ops, persist_node_t **out);
+
+/* the longest entry containing (addr, bitlen), or NULL */
+persist_node_t *persist_search_best (persist_node_t *root, const u_char *addr,
+                                     u_int bitlen);
+
+/* the entry for exactly (addr, bitlen), or NULL */
+persist_node_t *persist_search_exact (persist_node_t *root,
+                                      const u_char *addr, u_int bitlen);
+
+/*
+ * Call fn on every entry, in address order and then by length, stopping
+ * early and returning fn's result if it's negative.
+ */
+typedef int (*persist_walk_fn) (persist_node_t *node, void *arg);
+int persist_walk (persist_node_t *root, persist_walk_fn fn, void *arg);
+
+#endif /* _PERSIST_H */
@@ -18,6 +18,15 @@
 
 #include <Python.h>
 #include "patricia.h"
+#include "frozen.h"
+#include "hhh.h"
+#include "rules2d.h"
+#include "ternary.h"
+#include "wheel.h"
+#include "persist.h"
+
+#include <float.h>
+#include <time.h>
 
 #if defined(_WIN32) || defined(_WIN64)
 #include <winsock2.h>
@@ -27,12 +36,69 @@
 #include <arpa/inet.h>
 #endif
 
+// one version of a table's history: what it held after some change
+typedef struct {
+    unsigned long long version;
+    double time;                // when the change was made
+    persist_node_t *roots[2];   // IPv4 and IPv6 entries
+    Py_ssize_t count;
+} pytricia_version_t;
+
 typedef struct {
     PyObject_HEAD
     patricia_tree_t *m_tree;
     int m_family;
+    int m_engine;               // frozen engine kind; 0 if not frozen
+    frozen_t *m_frozen;         // compiled view of m_tree, may be stale
+    unsigned long m_gen;        // bumped on every structural change
+    unsigned long m_frozen_gen; // m_gen at the time m_frozen was built
+    int m_auto;                 // m_engine is re-picked as the table changes
+    unsigned long m_auto_gen;   // m_gen when m_engine was last picked
+    size_t m_auto_size;         // tree nodes at that time
+    prefix_t *m_samples;        // ring of recently looked-up addresses
+    size_t m_nsamples;          // lookups offered to the ring so far
+    prefix_t *m_pending;        // prefixes changed since m_frozen was built
+    size_t m_npending;
+    int m_busy;                 // batches running with the GIL released
+    wheel_t *m_wheel;           // expiry times of nodes with a ttl
+    int m_hide_expired;         // lookups skip entries past their expiry
+    size_t m_max_entries;       // evict past this many entries; 0 if unbounded
+    patricia_node_t **m_clock;  // every entry, when bounded: the CLOCK ring
+    size_t m_nclock;
+    size_t m_hand;
+    size_t m_evictions;
+    int m_track_free;           // nodes' free_bit is kept up to date
+    PyObject *m_index;          // value -> set of its nodes; NULL if not kept
+    int m_track_hash;           // nodes' hash is kept up to date
+    size_t m_history;           // versions kept; 0 if history isn't kept
+    pytricia_version_t *m_versions; // ring of the last m_history versions
+    size_t m_vfirst, m_nversions;
+    pytricia_version_t m_work;  // the version being made by the current change
+    int m_work_dirty;           // m_work differs from the newest version
 } PyTricia;
 
+static PyTypeObject PyTriciaType;
+
+// per-node bookkeeping, kept in user1 for nodes that expire or are on the
+// clock, and for every node, glue included, while free space or hashes are
+// tracked
+typedef struct {
+    wheel_timer_t *timer;       // NULL if the node doesn't expire
+    size_t clock;               // slot on the ring, or PYTRICIA_OFF_CLOCK
+    int referenced;             // looked up since the hand last passed
+    u_int free_bit;             // shortest free block below, if m_track_free
+    uint64_t hash;              // sum of the entry digests below, if m_track_hash
+} pytricia_ext_t;
+
+#define PYTRICIA_OFF_CLOCK ((size_t)-1)
+
+#define PYTRICIA_SAMPLES 1024
+#define PYTRICIA_SAMPLE_EVERY 16
+#define PYTRICIA_AUTO_SLACK 64
+#define PYTRICIA_AUTO -1            // engine="auto"; never a frozen_t kind
+#define PYTRICIA_PENDING 256        // changes worth patching rather than rebuilding
+#define PYTRICIA_CHUNK 256          // batch lookups handed to an engine at once
+
 typedef struct {
     PyObject_HEAD
     patricia_tree_t *m_tree;
@@ -44,6 +110,14 @@ typedef struct {
     PyTricia *m_parent;
 } PyTriciaIter;
 
+// a table as it was at one version; see PyTricia.at()
+typedef struct {
+    PyObject_HEAD
+    pytricia_version_t m_version;   // holds a reference to each root
+} PyTriciaSnapshot;
+
+static PyTypeObject PyTriciaSnapshotType;
+
 #if PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION >= 4
 static PyObject *ipaddr_module = NULL;
 static PyObject *ipaddr_base = NULL;
@@ -246,9 +320,89 @@ pytricia_xdecref(void *data) {
     Py_XDECREF((PyObject*)data);
 }
 
+// wall-clock time in seconds, as time.time() gives it
+static double
+_pytricia_now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * History.  A table created with history=N mirrors its entries into a
+ * persistent trie, so every version shares all but the changed paths with
+ * the one before.  Changes go to m_work, which becomes a version of its
+ * own when the next change starts or someone asks for history; so each
+ * call that changes the table makes one version, however many entries it
+ * touches.  The last N versions are kept.
+ */
+
+static void
+_pytricia_persist_retain(void *value) {
+    Py_INCREF((PyObject *)value);
+}
+
+static const persist_ops_t pytricia_persist_ops = {_pytricia_persist_retain, pytricia_xdecref};
+
+static void
+_pytricia_version_release(pytricia_version_t *version) {
+    persist_release(version->roots[0], &pytricia_persist_ops);
+    persist_release(version->roots[1], &pytricia_persist_ops);
+    version->roots[0] = version->roots[1] = NULL;
+}
+
+static pytricia_version_t *
+_pytricia_version_at(PyTricia *self, size_t i) {
+    return &self->m_versions[(self->m_vfirst + i) % self->m_history];
+}
+
+// turn the pending changes into the newest version, dropping the oldest
+// one if the ring is full
+static void
+_pytricia_history_commit(PyTricia *self) {
+    pytricia_version_t *version;
+
+    if (!self->m_history || !self->m_work_dirty) {
+        return;
+    }
+    if (self->m_nversions == self->m_history) {
+        _pytricia_version_release(_pytricia_version_at(self, 0));
+        self->m_vfirst = (self->m_vfirst + 1) % self->m_history;
+        self->m_nversions--;
+    }
+    version = _pytricia_version_at(self, self->m_nversions++);
+    *version = self->m_work;
+    persist_retain(version->roots[0]);
+    persist_retain(version->roots[1]);
+    self->m_work.version++;
+    self->m_work_dirty = 0;
+}
+
+static void
+_pytricia_history_free(PyTricia *self) {
+    size_t i;
+
+    for (i = 0; i < self->m_nversions; i++) {
+        _pytricia_version_release(_pytricia_version_at(self, i));
+    }
+    _pytricia_version_release(&self->m_work);
+    PyMem_Free(self->m_versions);
+}
+
 static void
 pytricia_dealloc(PyTricia* self) {
     if (self) {
+        frozen_free(self->m_frozen);
+        PyMem_Free(self->m_samples);
+        PyMem_Free(self->m_pending);
+        patricia_node_t *node;
+        PATRICIA_WALK_ALL(self->m_tree->head, node) {
+            PyMem_Free(node->user1);
+        } PATRICIA_WALK_END;
+        wheel_free(self->m_wheel);
+        PyMem_Free(self->m_clock);
+        Py_XDECREF(self->m_index);
+        _pytricia_history_free(self);
         Destroy_Patricia(self->m_tree, pytricia_xdecref);
         Py_TYPE(self)->tp_free((PyObject*)self);
     }
@@ -261,15 +415,44 @@ pytricia_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
     self = (PyTricia*)type->tp_alloc(type, 0);
     if (self != NULL) {
         self->m_tree = NULL;
+        self->m_engine = 0;
+        self->m_frozen = NULL;
+        self->m_gen = self->m_frozen_gen = 0;
+        self->m_auto = 0;
+        self->m_auto_gen = self->m_auto_size = 0;
+        self->m_samples = NULL;
+        self->m_nsamples = 0;
+        self->m_pending = NULL;
+        self->m_npending = 0;
+        self->m_busy = 0;
+        self->m_wheel = NULL;
+        self->m_hide_expired = 0;
+        self->m_max_entries = 0;
+        self->m_clock = NULL;
+        self->m_nclock = self->m_hand = self->m_evictions = 0;
+        self->m_track_free = 0;
+        self->m_index = NULL;
+        self->m_track_hash = 0;
+        self->m_history = 0;
+        self->m_versions = NULL;
+        self->m_vfirst = self->m_nversions = 0;
+        memset(&self->m_work, 0, sizeof(self->m_work));
+        self->m_work_dirty = 0;
     }
     return (PyObject *)self;
 }
 
 static int
 pytricia_init(PyTricia *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"prefixlen", "family", "hide_expired", "max_entries", "eviction", "index_values", "history", NULL};
     int prefixlen = 32;
     int family = AF_INET;
-    if (!PyArg_ParseTuple(args, "|ii", &prefixlen, &family)) {
+    int hide_expired = 0;
+    Py_ssize_t max_entries = 0;
+    const char *eviction = "clock";
+    int index_values = 0;
+    Py_ssize_t history = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiinsin", kwlist, &prefixlen, &family, &hide_expired, &max_entries, &eviction, &index_values, &history)) {
         self->m_tree = New_Patricia(1); // need to have *something* to dealloc
         PyErr_SetString(PyExc_ValueError, "Error parsing prefix length or address family");
         return -1;
@@ -287,11 +470,47 @@ pytricia_init(PyTricia *self, PyObject *args, PyObject *kwds) {
         return -1;
     }
     
+    if (max_entries < 0 || strcmp(eviction, "clock") != 0) {
+        self->m_tree = New_Patricia(1); // need to have *something* to dealloc
+        PyErr_SetString(PyExc_ValueError, "max_entries must be 0 (unbounded) or more, and eviction must be 'clock'");
+        return -1;
+    }
+
+    if (history < 0) {
+        self->m_tree = New_Patricia(1); // need to have *something* to dealloc
+        PyErr_SetString(PyExc_ValueError, "history must be 0 (not kept) or more");
+        return -1;
+    }
+
     self->m_tree = New_Patricia(prefixlen);
     self->m_family = family;
+    self->m_hide_expired = hide_expired;
     if (self->m_tree == NULL) {
         return -1;
     }
+    if (max_entries > 0) {
+        self->m_max_entries = (size_t)max_entries;
+        self->m_clock = PyMem_Malloc((max_entries + 1) * sizeof(*self->m_clock));
+        if (!self->m_clock) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    if (index_values && !(self->m_index = PyDict_New())) {
+        return -1;
+    }
+    if (history > 0) {
+        // version 0 is the empty table as it was created
+        self->m_versions = PyMem_Malloc(history * sizeof(*self->m_versions));
+        if (!self->m_versions) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->m_history = (size_t)history;
+        self->m_work.time = _pytricia_now();
+        self->m_work_dirty = 1;
+        _pytricia_history_commit(self);
+    }
     return 0;
 }
 
@@ -307,539 +526,5341 @@ pytricia_length(PyTricia *self)
     return count;
 }
 
-static PyObject* 
-pytricia_subscript(PyTricia *self, PyObject *key) {
-    prefix_t *subnet = _key_object_to_prefix(key);
-    if (subnet == NULL) {
-        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
-        return NULL;
-    }
-    patricia_node_t* node = patricia_search_best(self->m_tree, subnet);
-    Deref_Prefix(subnet);
+/*
+ * engine="auto" times every engine on recently looked-up addresses and keeps
+ * the fastest.  The pick is revisited on the next rebuild once the table has
+ * seen structural changes amounting to half its size.
+ */
+static frozen_t *
+_pytricia_build_best(PyTricia *self) {
+    int family = frozen_tree_family(self->m_tree);
+    size_t width = family == AF_INET6 ? 16 : 4;
+    size_t have = self->m_nsamples / PYTRICIA_SAMPLE_EVERY;
+    size_t i, n = 0;
+    u_char *addrs;
+    frozen_t *frozen;
 
-    if (!node) {
-        PyErr_SetString(PyExc_KeyError, "Prefix not found.");
+    if (have > PYTRICIA_SAMPLES) {
+        have = PYTRICIA_SAMPLES;
+    }
+    addrs = PyMem_Malloc(have * width + 1);
+    if (!addrs) {
         return NULL;
     }
+    for (i = 0; i < have; i++) {
+        if (self->m_samples[i].family == family) {
+            memcpy(addrs + width * n++, prefix_touchar(&self->m_samples[i]), width);
+        }
+    }
+    frozen = frozen_build_best(self->m_tree, addrs, n);
+    PyMem_Free(addrs);
+    if (frozen) {
+        self->m_engine = frozen_kind(frozen);
+    }
+    self->m_auto_gen = self->m_gen;
+    self->m_auto_size = self->m_tree->num_active_node;
+    return frozen;
+}
 
-    PyObject* data = (PyObject*)node->data;
+/*
+ * Return the compiled view of the tree if the table is frozen, rebuilding
+ * it first if the tree has changed shape since it was last built.  NULL
+ * means "use the tree" (not frozen, or the tree can't currently be frozen).
+ */
+static frozen_t *
+_pytricia_frozen(PyTricia *self) {
+    if (!self->m_engine || self->m_frozen_gen == self->m_gen) {
+        return self->m_frozen;
+    }
+    if (!self->m_frozen || self->m_npending > PYTRICIA_PENDING ||
+        frozen_patch(self->m_frozen, self->m_tree, self->m_pending, self->m_npending) < 0) {
+        frozen_free(self->m_frozen);
+        self->m_frozen = frozen_build(self->m_tree, self->m_engine);
+    }
+    self->m_frozen_gen = self->m_gen;
+    self->m_npending = 0;
+    return self->m_frozen;
+}
 
-    Py_INCREF(data);
-    return data;
+/*
+ * engine="auto" picks again once the table has seen enough churn.  Timing
+ * every engine takes milliseconds on a large table, so it's done as the
+ * next change starts rather than in whichever lookup happens to come next.
+ */
+static void
+_pytricia_auto_repick(PyTricia *self) {
+    if (self->m_auto && self->m_gen - self->m_auto_gen > self->m_auto_size / 2 + PYTRICIA_AUTO_SLACK) {
+        frozen_free(self->m_frozen);
+        self->m_frozen = _pytricia_build_best(self);
+        self->m_frozen_gen = self->m_gen;
+        self->m_npending = 0;
+    }
 }
 
+// the tree and its frozen view are read without the GIL while a batch runs;
+// every change starts here, so this is also where the last one becomes a
+// version of its own and where engine="auto" picks again
 static int
-pytricia_internal_delete(PyTricia *self, PyObject *key) {
-    prefix_t *prefix = _key_object_to_prefix(key);
-    if (prefix == NULL) {
-        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+_pytricia_check_busy(PyTricia *self) {
+    if (self->m_busy) {
+        PyErr_SetString(PyExc_RuntimeError, "Table can't be changed while a batch operation is running");
         return -1;
     }
-    patricia_node_t* node = patricia_search_exact(self->m_tree, prefix);
-    Deref_Prefix(prefix);
+    _pytricia_history_commit(self);
+    _pytricia_auto_repick(self);
+    return 0;
+}
 
-    if (!node) {
-        PyErr_SetString(PyExc_KeyError, "Prefix doesn't exist.");
-        return -1;
+// note a structural change; a frozen view patches itself from m_pending.
+// An IPv4 node's prefix is only a prefix4_t, so it's copied field by field
+static void
+_pytricia_changed(PyTricia *self, prefix_t *prefix) {
+    self->m_gen++;
+    if (self->m_pending && self->m_npending < PYTRICIA_PENDING) {
+        New_Prefix2(prefix->family, &prefix->add, prefix->bitlen, &self->m_pending[self->m_npending]);
     }
+    self->m_npending++;
+}
 
-    // decrement ref count on data referred to by key, if it exists
-    PyObject* data = (PyObject*)node->data;
-    Py_XDECREF(data);
+// 1 in PYTRICIA_SAMPLE_EVERY served lookups is kept for engine="auto";
+// an IPv4 key may only be a prefix4_t, so it's copied field by field
+static void
+_pytricia_observe(PyTricia *self, prefix_t *prefix) {
+    if (self->m_samples && self->m_nsamples++ % PYTRICIA_SAMPLE_EVERY == 0) {
+        prefix_t *slot = &self->m_samples[(self->m_nsamples / PYTRICIA_SAMPLE_EVERY) % PYTRICIA_SAMPLES];
+        New_Prefix2(prefix->family, &prefix->add, prefix->bitlen, slot);
+    }
+}
 
-    patricia_remove(self->m_tree, node);
-    return 0;
+// the frozen engines only answer full-length host lookups of their family
+static int
+_pytricia_frozen_serves(frozen_t *frozen, prefix_t *prefix) {
+    return prefix->family == frozen_family(frozen) &&
+           prefix->bitlen == (prefix->family == AF_INET ? 32 : 128);
 }
 
-static int 
-_pytricia_assign_subscript_internal(PyTricia *self, PyObject *key, PyObject *value, long prefixlen) {
-    if (!value) {
-        return pytricia_internal_delete(self, key);
-    }
-    
-    prefix_t *prefix = _key_object_to_prefix(key);
-    if (!prefix) {
-        return -1;
-    }
+static void
+_pytricia_history_set(PyTricia *self, int v6, persist_node_t *root, int added) {
+    persist_release(self->m_work.roots[v6], &pytricia_persist_ops);
+    self->m_work.roots[v6] = root;
+    self->m_work.count += added;
+    self->m_work.time = _pytricia_now();
+    self->m_work_dirty = 1;
+}
 
-    // if prefixlen > -1, it should override (possibly) parsed prefix len in key
-    if (prefixlen != -1) {
-        prefix->bitlen = prefixlen;
-    }
-    patricia_node_t *node = patricia_lookup(self->m_tree, prefix);
-    Deref_Prefix(prefix);
-    
-    if (!node) {
-        PyErr_SetString(PyExc_ValueError, "Error inserting into patricia tree");
+static int
+_pytricia_history_insert(PyTricia *self, prefix_t *prefix, PyObject *value) {
+    int v6 = prefix->family == AF_INET6;
+    persist_node_t *root;
+    int added = persist_insert(self->m_work.roots[v6], prefix_touchar(prefix), prefix->bitlen, value,
+                               &pytricia_persist_ops, &root);
+    if (added < 0) {
+        PyErr_NoMemory();
         return -1;
     }
+    _pytricia_history_set(self, v6, root, added);
+    return 0;
+}
 
-    // node already existed, lower ref count on old data 
-    if (node->data) {
-        PyObject* data = (PyObject*)node->data;
-        Py_DECREF(data);
+// can't fail: removals have no way to report it, so running out of memory
+// is only printed, and the history keeps the entry
+static void
+_pytricia_history_delete(PyTricia *self, prefix_t *prefix) {
+    int v6 = prefix->family == AF_INET6;
+    persist_node_t *root;
+    int removed = persist_delete(self->m_work.roots[v6], prefix_touchar(prefix), prefix->bitlen,
+                                 &pytricia_persist_ops, &root);
+    if (removed < 0) {
+        PyObject *type, *exc, *tb;
+        PyErr_Fetch(&type, &exc, &tb);
+        PyErr_NoMemory();
+        PyErr_WriteUnraisable((PyObject *)self);
+        PyErr_Restore(type, exc, tb);
+        return;
     }
-
-    Py_INCREF(value);
-    node->data = value;
-
-    return 0;
+    _pytricia_history_set(self, v6, root, -removed);
 }
 
-static int 
-pytricia_assign_subscript(PyTricia *self, PyObject *key, PyObject *value) {
-    return _pytricia_assign_subscript_internal(self, key, value, -1);
+static pytricia_ext_t *
+_pytricia_ext(patricia_node_t *node) {
+    pytricia_ext_t *ext = node->user1;
+    if (!ext && (ext = PyMem_Malloc(sizeof(*ext)))) {
+        ext->timer = NULL;
+        ext->clock = PYTRICIA_OFF_CLOCK;
+        ext->referenced = 0;
+        ext->free_bit = 0;
+        ext->hash = 0;
+        node->user1 = ext;
+    }
+    return ext;
 }
 
-static PyObject*
-pytricia_insert(PyTricia *self, PyObject *args) {
-    PyObject *key = NULL;
-    PyObject *value1 = NULL;
-    PyObject *value2 = NULL;
-    PyObject *rhs = NULL;
+static int
+_pytricia_tracking(PyTricia *self) {
+    return self->m_track_free || self->m_track_hash;
+}
 
-    if (!PyArg_ParseTuple(args, "O|OO", &key, &value1, &value2)) { 
-        PyErr_SetString(PyExc_ValueError, "Invalid argument(s) to insert");
-        return NULL;
+// free the node's bookkeeping once nothing is left in it
+static void
+_pytricia_ext_release(PyTricia *self, patricia_node_t *node) {
+    pytricia_ext_t *ext = node->user1;
+    if (ext && !ext->timer && ext->clock == PYTRICIA_OFF_CLOCK && !_pytricia_tracking(self)) {
+        PyMem_Free(ext);
+        node->user1 = NULL;
     }
+}
 
-    if (value1) {
-        long prefixlen = -1;
-        if (value2 == NULL) {
-            rhs = value1;
-        } else {
-            rhs = value2;
-#if PY_MAJOR_VERSION == 3
-            if (PyLong_Check(value1)) {
-                prefixlen = PyLong_AsLong(value1);
-            }
-#else // python2
-            if (PyLong_Check(value1) || PyInt_Check(value1)) {
-                prefixlen  = PyInt_AsLong(value1);
-            }
-#endif
-        }
-        int rv = _pytricia_assign_subscript_internal(self, key, rhs, prefixlen); 
-        if (rv == -1) {
-            PyErr_SetString(PyExc_ValueError, "Invalid key.");
-            return NULL;
+// give every node bookkeeping, as tracking needs; on failure, what was
+// handed out is left for removal or dealloc to free
+static int
+_pytricia_ext_all(PyTricia *self) {
+    patricia_node_t *node;
+    int rv = 0;
+    PATRICIA_WALK_ALL(self->m_tree->head, node) {
+        if (!_pytricia_ext(node)) {
+            rv = -1;
         }
-    } else {
-        PyErr_SetString(PyExc_ValueError, "Missing argument(s) to insert");
-        return NULL;
+    } PATRICIA_WALK_END;
+    if (rv < 0) {
+        PyErr_NoMemory();
     }
+    return rv;
+}
 
-    Py_RETURN_NONE;
+/*
+ * patricia_remove(), along with the bookkeeping of whatever it frees: the
+ * node, unless it has two children and stays on as glue, and its glue
+ * parent if the node was a leaf.
+ */
+static void
+_pytricia_tree_remove(PyTricia *self, patricia_node_t *node) {
+    patricia_node_t *parent = node->parent;
+    if (node->l && node->r) {
+        _pytricia_ext_release(self, node);
+    } else {
+        if (!node->l && !node->r && parent && !parent->prefix) {
+            PyMem_Free(parent->user1);
+            parent->user1 = NULL;
+        }
+        PyMem_Free(node->user1);
+        node->user1 = NULL;
+    }
+    patricia_remove(self->m_tree, node);
 }
 
-static PyObject*
-pytricia_delitem(PyTricia *self, PyObject *args) {
-    PyObject *key = NULL;
-    if (!PyArg_ParseTuple(args, "O", &key)) {
-        return NULL;
+static void
+_pytricia_clear_ttl(PyTricia *self, patricia_node_t *node) {
+    pytricia_ext_t *ext = node->user1;
+    if (ext && ext->timer) {
+        wheel_cancel(self->m_wheel, ext->timer);
+        ext->timer = NULL;
+        _pytricia_ext_release(self, node);
     }
-    
-    int rv = pytricia_internal_delete(self, key);
-    if (rv < 0) {
-        return NULL;
-    } 
-    Py_RETURN_NONE;
 }
 
-static PyObject *
-pytricia_get(register PyTricia *obj, PyObject *args) {
-    PyObject *key = NULL;
-    PyObject *defvalue = NULL;
+// node expires ttl seconds from now, replacing any expiry it had
+static int
+_pytricia_set_ttl(PyTricia *self, patricia_node_t *node, double ttl) {
+    double now = _pytricia_now();
+    pytricia_ext_t *ext;
 
-    if (!PyArg_ParseTuple(args, "O|O:get", &key, &defvalue)) {
-        return NULL;
-    }
-    prefix_t *prefix = _key_object_to_prefix(key);
-    if (!prefix) {
-        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
-        return NULL;
+    _pytricia_clear_ttl(self, node);
+    if (!self->m_wheel && !(self->m_wheel = wheel_new(now))) {
+        PyErr_NoMemory();
+        return -1;
     }
-    patricia_node_t* node = patricia_search_best(obj->m_tree, prefix);
-    Deref_Prefix(prefix);
-
-    if (!node) {
-        if (defvalue) {
-            Py_INCREF(defvalue);
-            return defvalue;
+    if (!(ext = _pytricia_ext(node)) || !(ext->timer = wheel_add(self->m_wheel, now + ttl, node))) {
+        if (ext) {
+            _pytricia_ext_release(self, node);
         }
-        Py_RETURN_NONE;
+        PyErr_NoMemory();
+        return -1;
     }
-
-    PyObject* data = (PyObject*)node->data;
-    Py_INCREF(data);
-    return data;
+    return 0;
 }
 
-static PyObject *
-pytricia_get_key(register PyTricia *obj, PyObject *args) {
-    PyObject *key = NULL;
-
-    if (!PyArg_ParseTuple(args, "O", &key)) {
-        return NULL;
+static int
+_pytricia_clock_add(PyTricia *self, patricia_node_t *node) {
+    pytricia_ext_t *ext = _pytricia_ext(node);
+    if (!ext) {
+        PyErr_NoMemory();
+        return -1;
     }
+    ext->clock = self->m_nclock;
+    ext->referenced = 1;
+    self->m_clock[self->m_nclock++] = node;
+    return 0;
+}
 
-    prefix_t *prefix = _key_object_to_prefix(key);
-    if (!prefix) {
-        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
-        return NULL;
+// fill the node's slot on the ring with the last one
+static void
+_pytricia_clock_drop(PyTricia *self, patricia_node_t *node) {
+    pytricia_ext_t *ext = node->user1;
+    if (!ext || ext->clock == PYTRICIA_OFF_CLOCK) {
+        return;
     }
-    patricia_node_t* node = patricia_search_best(obj->m_tree, prefix);
-    Deref_Prefix(prefix);
-
-    if (!node) {
-        Py_RETURN_NONE;
+    patricia_node_t *last = self->m_clock[--self->m_nclock];
+    if (last != node) {
+        self->m_clock[ext->clock] = last;
+        ((pytricia_ext_t *)last->user1)->clock = ext->clock;
     }
-
-    char buffer[64];
-    prefix_toa2x(node->prefix, buffer, 1);
-    return Py_BuildValue("s", buffer);
+    if (self->m_hand >= self->m_nclock) {
+        self->m_hand = 0;
+    }
+    ext->clock = PYTRICIA_OFF_CLOCK;
+    _pytricia_ext_release(self, node);
 }
 
-static int
-pytricia_contains(PyTricia *self, PyObject *key) {
-    prefix_t *prefix = _key_object_to_prefix(key);
-    if (!prefix) {
-        return 0;        
-    }
-    patricia_node_t* node = patricia_search_best(self->m_tree, prefix);
-    Deref_Prefix(prefix);
-    if (node) {
-        return 1;
+static void
+_pytricia_touch(PyTricia *self, patricia_node_t *node) {
+    if (self->m_clock && node) {
+        ((pytricia_ext_t *)node->user1)->referenced = 1;
     }
-    return 0;
+}
+
+/*
+ * Free-space tracking for find_free().  A node's free_bit is the length of
+ * the largest aligned block under it that no prefix overlaps, or
+ * PATRICIA_MAXBITS + 1 if there is none, which is longer than any length
+ * find_free() takes, whatever the table's prefixlen.  A prefix node has
+ * none; a glue node has its
+ * children's, plus a block one bit below its own wherever a child sits
+ * more than one bit further down.  So a change only moves free_bit on the
+ * path to the root.
+ */
+static u_int
+_pytricia_free_bit(patricia_node_t *node) {
+    return ((pytricia_ext_t *)node->user1)->free_bit;
+}
+
+static void
+_pytricia_free_set(PyTricia *self, patricia_node_t *node) {
+    u_int f = PATRICIA_MAXBITS + 1;
+    if (!node->prefix) {
+        u_int l = _pytricia_free_bit(node->l), r = _pytricia_free_bit(node->r);
+        f = l < r ? l : r;
+        if ((node->l->bit > node->bit + 1 || node->r->bit > node->bit + 1) && node->bit + 2 < f) {
+            f = node->bit + 2;
+        }
+    }
+    ((pytricia_ext_t *)node->user1)->free_bit = f;
+}
+
+static void
+_pytricia_free_update(PyTricia *self, patricia_node_t *node) {
+    for (; node; node = node->parent) {
+        _pytricia_free_set(self, node);
+    }
+}
+
+// the lowest node whose free_bit may change once node is removed
+static patricia_node_t *
+_pytricia_free_survivor(patricia_node_t *node) {
+    patricia_node_t *parent = node->parent;
+
+    if (node->l && node->r) {
+        return node;
+    }
+    if (node->l || node->r || !parent || parent->prefix) {
+        return parent;
+    }
+    return parent->parent;
+}
+/*
+ * Content hashes for root_hash() and diff().  Every entry gets a 64-bit
+ * digest of its prefix and value, worked out from their contents alone so
+ * that it is the same in any process, and a node's hash is the sum of the
+ * digests below it.  A subtree's hash is then fixed by what it holds, not
+ * by how it was built, and a change only adds its difference to the path
+ * to the root.
+ */
+
+#define PYTRICIA_FNV_OFFSET 0xcbf29ce484222325ULL
+#define PYTRICIA_FNV_PRIME 0x100000001b3ULL
+
+static uint64_t
+_pytricia_fnv(uint64_t h, const void *bytes, size_t n) {
+    const u_char *p = bytes;
+    while (n--) {
+        h = (h ^ *p++) * PYTRICIA_FNV_PRIME;
+    }
+    return h;
+}
+
+// n as a fixed-width little-endian integer, so digests don't depend on the
+// host's word size or byte order
+static uint64_t
+_pytricia_fnv_le(uint64_t h, uint64_t n, size_t width) {
+    u_char bytes[8];
+    size_t i;
+    for (i = 0; i < width; i++) {
+        bytes[i] = (u_char)(n >> (8 * i));
+    }
+    return _pytricia_fnv(h, bytes, width);
+}
+
+static int
+_pytricia_digest_value(PyObject *value, uint64_t *h) {
+    char tag;
+
+    if (value == Py_None) {
+        tag = 'N';
+        *h = _pytricia_fnv(*h, &tag, 1);
+    } else if (PyBool_Check(value)) {
+        tag = value == Py_True ? 'T' : 'F';
+        *h = _pytricia_fnv(*h, &tag, 1);
+    } else if (PyLong_Check(value)) {
+        int overflow;
+        long long n = PyLong_AsLongLongAndOverflow(value, &overflow);
+        if (overflow) {
+            // only big ints need their digits spelled out
+            PyObject *digits = PyObject_Str(value);
+            int rv;
+            if (!digits) {
+                return -1;
+            }
+            tag = 'L';
+            *h = _pytricia_fnv(*h, &tag, 1);
+            rv = _pytricia_digest_value(digits, h);
+            Py_DECREF(digits);
+            return rv;
+        }
+        tag = 'I';
+        *h = _pytricia_fnv(*h, &tag, 1);
+        *h = _pytricia_fnv_le(*h, (uint64_t)n, 8);
+    } else if (PyFloat_Check(value)) {
+        double d = PyFloat_AS_DOUBLE(value);
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        tag = 'D';
+        *h = _pytricia_fnv(*h, &tag, 1);
+        *h = _pytricia_fnv_le(*h, bits, 8);
+    } else if (PyUnicode_Check(value)) {
+#if PY_MAJOR_VERSION == 3
+        Py_ssize_t n;
+        const char *s = PyUnicode_AsUTF8AndSize(value, &n);
+        if (!s) {
+            return -1;
+        }
+        tag = 'S';
+        *h = _pytricia_fnv(*h, &tag, 1);
+        *h = _pytricia_fnv_le(*h, (uint64_t)n, 8);
+        *h = _pytricia_fnv(*h, s, n);
+#else
+        PyObject *utf8 = PyUnicode_AsUTF8String(value);
+        int rv;
+        if (!utf8) {
+            return -1;
+        }
+        rv = _pytricia_digest_value(utf8, h);
+        Py_DECREF(utf8);
+        return rv;
+#endif
+    } else if (PyBytes_Check(value)) {
+        Py_ssize_t n = PyBytes_GET_SIZE(value);
+        tag = 'Y';
+        *h = _pytricia_fnv(*h, &tag, 1);
+        *h = _pytricia_fnv_le(*h, (uint64_t)n, 8);
+        *h = _pytricia_fnv(*h, PyBytes_AS_STRING(value), n);
+    } else if (PyTuple_Check(value)) {
+        Py_ssize_t i, n = PyTuple_GET_SIZE(value);
+        tag = '(';
+        *h = _pytricia_fnv(*h, &tag, 1);
+        *h = _pytricia_fnv_le(*h, (uint64_t)n, 8);
+        for (i = 0; i < n; i++) {
+            if (_pytricia_digest_value(PyTuple_GET_ITEM(value, i), h) < 0) {
+                return -1;
+            }
+        }
+    } else {
+        PyErr_Format(PyExc_TypeError, "Can't hash a %.200s value; only None, bools, ints, floats, strings, bytes and tuples of them can be",
+                     Py_TYPE(value)->tp_name);
+        return -1;
+    }
+    return 0;
+}
+
+// the digest of prefix mapped to a value that hashed to h; only the
+// prefix's first bitlen bits count
+static uint64_t
+_pytricia_entry_digest(prefix_t *prefix, uint64_t h) {
+    u_char addr[16] = {0};
+
+    memcpy(addr, prefix_touchar(prefix), (prefix->bitlen + 7) / 8);
+    if (prefix->bitlen % 8) {
+        addr[prefix->bitlen / 8] &= 0xff << (8 - prefix->bitlen % 8);
+    }
+    h = _pytricia_fnv_le(h, prefix->family == AF_INET6 ? 6 : 4, 2);
+    h = _pytricia_fnv_le(h, prefix->bitlen, 2);
+    h = _pytricia_fnv(h, addr, sizeof(addr));
+    // spread the bits (splitmix64's finalizer), since digests are summed
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static int
+_pytricia_digest(prefix_t *prefix, PyObject *value, uint64_t *digest) {
+    uint64_t h = PYTRICIA_FNV_OFFSET;
+
+    if (_pytricia_digest_value(value, &h) < 0) {
+        return -1;
+    }
+    *digest = _pytricia_entry_digest(prefix, h);
+    return 0;
+}
+
+static uint64_t
+_pytricia_hash_of(patricia_node_t *node) {
+    return node ? ((pytricia_ext_t *)node->user1)->hash : 0;
+}
+
+static void
+_pytricia_hash_set(patricia_node_t *node, uint64_t hash) {
+    ((pytricia_ext_t *)node->user1)->hash = hash;
+}
+
+// add delta to the hash of node and everything above it
+static void
+_pytricia_hash_add(patricia_node_t *node, uint64_t delta) {
+    for (; node; node = node->parent) {
+        ((pytricia_ext_t *)node->user1)->hash += delta;
+    }
+}
+
+/*
+ * The value index maps each value to the set of its nodes, as addresses.
+ * Hashing values can run Python code, so callers keep the table busy.
+ */
+
+static int
+_pytricia_index_add(PyObject *index, PyObject *value, patricia_node_t *node) {
+    PyObject *nodes = PyDict_GetItem(index, value);
+    PyObject *address;
+    int rv;
+
+    if (!nodes) {
+        if (!(nodes = PySet_New(NULL))) {
+            return -1;
+        }
+        rv = PyDict_SetItem(index, value, nodes);
+        Py_DECREF(nodes);
+        if (rv < 0) {
+            return -1;
+        }
+    }
+    if (!(address = PyLong_FromVoidPtr(node))) {
+        return -1;
+    }
+    rv = PySet_Add(nodes, address);
+    Py_DECREF(address);
+    return rv;
+}
+
+// can't fail: removals have no way to report it, so any error is only printed
+static void
+_pytricia_index_drop(PyTricia *self, PyObject *value, patricia_node_t *node) {
+    PyObject *type, *exc, *tb, *nodes, *address;
+
+    PyErr_Fetch(&type, &exc, &tb);
+    self->m_busy++;
+    nodes = PyDict_GetItem(self->m_index, value);
+    address = nodes ? PyLong_FromVoidPtr(node) : NULL;
+    if (address && PySet_Discard(nodes, address) >= 0 && PySet_GET_SIZE(nodes) == 0) {
+        PyDict_DelItem(self->m_index, value);
+    }
+    Py_XDECREF(address);
+    self->m_busy--;
+    if (PyErr_Occurred()) {
+        PyErr_WriteUnraisable(value);
+    }
+    PyErr_Restore(type, exc, tb);
+}
+
+
+/*
+ * Take node out of the tree, along with its expiry.  Hands back the
+ * reference to its value, which the caller must drop once the tree is
+ * consistent again.
+ */
+static PyObject *
+_pytricia_remove_node(PyTricia *self, patricia_node_t *node) {
+    PyObject *data = (PyObject *)node->data;
+
+    patricia_node_t *survivor = self->m_track_free ? _pytricia_free_survivor(node) : NULL;
+
+    _pytricia_clear_ttl(self, node);
+    _pytricia_clock_drop(self, node);
+    if (self->m_index) {
+        _pytricia_index_drop(self, data, node);
+    }
+    if (self->m_track_hash) {
+        PyObject *type, *exc, *tb;
+        uint64_t digest;
+        PyErr_Fetch(&type, &exc, &tb);
+        if (_pytricia_digest(node->prefix, data, &digest) < 0) {
+            PyErr_WriteUnraisable(data);
+        } else {
+            _pytricia_hash_add(node, 0 - digest);
+        }
+        PyErr_Restore(type, exc, tb);
+    }
+    if (self->m_history) {
+        _pytricia_history_delete(self, node->prefix);
+    }
+    _pytricia_changed(self, node->prefix);
+    _pytricia_tree_remove(self, node);
+    if (survivor) {
+        _pytricia_free_update(self, survivor);
+    }
+    return data;
+}
+
+// with hide_expired, a match that has expired gives way to the closest
+// unexpired prefix above it
+static patricia_node_t *
+_pytricia_unexpired(patricia_node_t *node, double now) {
+    pytricia_ext_t *ext;
+    while (node && (ext = node->user1) && ext->timer && ext->timer->deadline <= now) {
+        do {
+            node = node->parent;
+        } while (node && !node->prefix);
+    }
+    return node;
+}
+
+static int
+_pytricia_hiding(PyTricia *self) {
+    return self->m_hide_expired && self->m_wheel && wheel_count(self->m_wheel) > 0;
+}
+
+static patricia_node_t *
+_pytricia_search_best(PyTricia *self, prefix_t *prefix) {
+    frozen_t *frozen = _pytricia_frozen(self);
+    patricia_node_t *node;
+    if (frozen && _pytricia_frozen_serves(frozen, prefix)) {
+        _pytricia_observe(self, prefix);
+        node = frozen_search(frozen, prefix_touchar(prefix));
+    } else {
+        node = patricia_search_best(self->m_tree, prefix);
+    }
+    if (_pytricia_hiding(self)) {
+        node = _pytricia_unexpired(node, _pytricia_now());
+    }
+    _pytricia_touch(self, node);
+    return node;
+}
+
+/*
+ * Sweep the clock hand to the first entry not looked up since it last
+ * passed, preferring leaves so covering prefixes stay, and take it out.
+ * keep is never chosen.  Hands back the victim's value, as
+ * _pytricia_remove_node() does.
+ */
+static PyObject *
+_pytricia_evict(PyTricia *self, patricia_node_t *keep) {
+    size_t steps;
+
+    for (steps = 0;; steps++) {
+        patricia_node_t *node = self->m_clock[self->m_hand];
+        pytricia_ext_t *ext = node->user1;
+        // after two full sweeps, every entry but keep is unreferenced; take
+        // a covering prefix if no leaf is left
+        int leaf = (!node->l && !node->r) || steps > 2 * self->m_nclock;
+        if (node != keep && !ext->referenced && leaf) {
+            self->m_evictions++;
+            return _pytricia_remove_node(self, node);
+        }
+        ext->referenced = 0;
+        self->m_hand = (self->m_hand + 1) % self->m_nclock;
+    }
+}
+
+static PyObject* 
+pytricia_subscript(PyTricia *self, PyObject *key) {
+    prefix_t *subnet = _key_object_to_prefix(key);
+    if (subnet == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return NULL;
+    }
+    patricia_node_t* node = _pytricia_search_best(self, subnet);
+    Deref_Prefix(subnet);
+
+    if (!node) {
+        PyErr_SetString(PyExc_KeyError, "Prefix not found.");
+        return NULL;
+    }
+
+    PyObject* data = (PyObject*)node->data;
+
+    Py_INCREF(data);
+    return data;
+}
+
+static int
+pytricia_internal_delete(PyTricia *self, PyObject *key) {
+    if (_pytricia_check_busy(self) < 0) {
+        return -1;
+    }
+    prefix_t *prefix = _key_object_to_prefix(key);
+    if (prefix == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return -1;
+    }
+    patricia_node_t* node = patricia_search_exact(self->m_tree, prefix);
+    Deref_Prefix(prefix);
+
+    if (!node) {
+        PyErr_SetString(PyExc_KeyError, "Prefix doesn't exist.");
+        return -1;
+    }
+
+    // decrement ref count on data referred to by key, if it exists
+    PyObject* data = _pytricia_remove_node(self, node);
+    Py_XDECREF(data);
+    return 0;
+}
+
+static int _pytricia_insert_prefix(PyTricia *self, prefix_t *prefix, PyObject *value, double ttl);
+
+static int 
+_pytricia_assign_subscript_internal(PyTricia *self, PyObject *key, PyObject *value, long prefixlen, double ttl) {
+    if (!value) {
+        return pytricia_internal_delete(self, key);
+    }
+    if (_pytricia_check_busy(self) < 0) {
+        return -1;
+    }
+    
+    prefix_t *prefix = _key_object_to_prefix(key);
+    if (!prefix) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "Invalid key.");
+        }
+        return -1;
+    }
+
+    // if prefixlen > -1, it should override (possibly) parsed prefix len in key
+    if (prefixlen != -1) {
+        prefix->bitlen = prefixlen;
+    }
+    int rv = _pytricia_insert_prefix(self, prefix, value, ttl);
+    Deref_Prefix(prefix);
+    return rv;
+}
+
+// map prefix to value, expiring after ttl seconds unless ttl is negative;
+// the prefix may be static, and isn't consumed
+static int
+_pytricia_insert_prefix(PyTricia *self, prefix_t *prefix, PyObject *value, double ttl) {
+    PyObject *old, *evicted = NULL;
+    uint64_t hashed = PYTRICIA_FNV_OFFSET;
+    // an unhashable value can't go in the index, so it can't go in at all
+    if (self->m_index && PyObject_Hash(value) == -1) {
+        return -1;
+    }
+    if (self->m_track_hash && _pytricia_digest_value(value, &hashed) < 0) {
+        return -1;
+    }
+    patricia_node_t *node = patricia_lookup(self->m_tree, prefix);
+    if (!node) {
+        PyErr_SetString(PyExc_ValueError, "Error inserting into patricia tree");
+        return -1;
+    }
+    // tracking keeps bookkeeping on every node, so a new one and any glue
+    // made for it need theirs; the history is keyed by the node's own
+    // prefix, which a prefix of the other family may land on
+    if ((_pytricia_tracking(self) &&
+         (!_pytricia_ext(node) || (node->parent && !node->parent->prefix && !_pytricia_ext(node->parent)))) ||
+        (self->m_history && _pytricia_history_insert(self, node->prefix, value) < 0)) {
+        if (!PyErr_Occurred()) {
+            PyErr_NoMemory();
+        }
+        if (!node->data) {
+            _pytricia_tree_remove(self, node);
+        }
+        return -1;
+    }
+
+    // if the node already existed, its old data is let go of at the end,
+    // along with any entry evicted to make room, since that can run
+    // arbitrary code
+    old = (PyObject *)node->data;
+    Py_INCREF(value);
+    node->data = value;
+    if (self->m_track_hash) {
+        uint64_t undo = 0;
+        if (!old) {
+            // a new node, and maybe new glue above it, starts with the
+            // hashes of what it now holds
+            _pytricia_hash_set(node, _pytricia_hash_of(node->l) + _pytricia_hash_of(node->r));
+            if (node->parent && !node->parent->prefix) {
+                _pytricia_hash_set(node->parent, _pytricia_hash_of(node->parent->l) + _pytricia_hash_of(node->parent->r));
+            }
+        } else if (_pytricia_digest(node->prefix, old, &undo) < 0) {
+            PyErr_WriteUnraisable(old);
+        }
+        _pytricia_hash_add(node, _pytricia_entry_digest(node->prefix, hashed) - undo);
+    }
+    if (!old) {
+        _pytricia_changed(self, node->prefix);
+        if (self->m_track_free) {
+            _pytricia_free_update(self, node);
+        }
+        if (self->m_clock) {
+            if (_pytricia_clock_add(self, node) < 0) {
+                Py_DECREF(_pytricia_remove_node(self, node));
+                return -1;
+            }
+            if (self->m_nclock > self->m_max_entries) {
+                evicted = _pytricia_evict(self, node);
+            }
+        }
+    }
+
+    int rv = 0;
+    if (ttl >= 0) {
+        rv = _pytricia_set_ttl(self, node, ttl);
+    } else {
+        _pytricia_clear_ttl(self, node);
+    }
+    if (self->m_index && rv == 0 && old != value) {
+        if (old) {
+            _pytricia_index_drop(self, old, node);
+        }
+        self->m_busy++;
+        rv = _pytricia_index_add(self->m_index, value, node);
+        self->m_busy--;
+    }
+    Py_XDECREF(old);
+    Py_XDECREF(evicted);
+    return rv;
+}
+
+static int 
+pytricia_assign_subscript(PyTricia *self, PyObject *key, PyObject *value) {
+    return _pytricia_assign_subscript_internal(self, key, value, -1, -1.0);
 }
 
 static PyObject*
-pytricia_has_key(PyTricia *self, PyObject *args) {
+pytricia_insert(PyTricia *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"prefix", "value1", "value2", "ttl", NULL};
     PyObject *key = NULL;
-    if (!PyArg_ParseTuple(args, "O", &key))
+    PyObject *value1 = NULL;
+    PyObject *value2 = NULL;
+    PyObject *rhs = NULL;
+    PyObject *ttlobj = Py_None;
+    double ttl = -1.0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OOO", kwlist, &key, &value1, &value2, &ttlobj)) {
+        PyErr_SetString(PyExc_ValueError, "Invalid argument(s) to insert");
         return NULL;
-    
+    }
+    if (ttlobj != Py_None) {
+        ttl = PyFloat_AsDouble(ttlobj);
+        if (ttl == -1.0 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (!(ttl >= 0)) {
+            PyErr_SetString(PyExc_ValueError, "ttl must be a non-negative number of seconds");
+            return NULL;
+        }
+    }
+    if (_pytricia_check_busy(self) < 0) {
+        return NULL;
+    }
+
+    if (value1) {
+        long prefixlen = -1;
+        if (value2 == NULL) {
+            rhs = value1;
+        } else {
+            rhs = value2;
+#if PY_MAJOR_VERSION == 3
+            if (PyLong_Check(value1)) {
+                prefixlen = PyLong_AsLong(value1);
+            }
+#else // python2
+            if (PyLong_Check(value1) || PyInt_Check(value1)) {
+                prefixlen  = PyInt_AsLong(value1);
+            }
+#endif
+        }
+        // bad keys raise ValueError; anything else that goes wrong, such as
+        // a value that can't be hashed, raises as it is
+        if (_pytricia_assign_subscript_internal(self, key, rhs, prefixlen, ttl) < 0) {
+            return NULL;
+        }
+    } else {
+        PyErr_SetString(PyExc_ValueError, "Missing argument(s) to insert");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytricia_delitem(PyTricia *self, PyObject *args) {
+    PyObject *key = NULL;
+    if (!PyArg_ParseTuple(args, "O", &key)) {
+        return NULL;
+    }
+    
+    int rv = pytricia_internal_delete(self, key);
+    if (rv < 0) {
+        return NULL;
+    } 
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytricia_expire(PyTricia *self, PyObject *args) {
+    double now = 0;
+    void **nodes;
+    long i, n;
+
+    if (!PyArg_ParseTuple(args, "|d:expire", &now)) {
+        return NULL;
+    }
+    if (PyTuple_GET_SIZE(args) == 0) {
+        now = _pytricia_now();
+    }
+    if (!self->m_wheel) {
+        return PyLong_FromLong(0);
+    }
+    if (_pytricia_check_busy(self) < 0) {
+        return NULL;
+    }
+    n = wheel_expire(self->m_wheel, now, &nodes);
+    if (n < 0) {
+        return PyErr_NoMemory();
+    }
+    // the timers are gone already, and removal frees what's left of each
+    // node's bookkeeping; values are dropped only once every node is out,
+    // since that can run arbitrary code
+    for (i = 0; i < n; i++) {
+        patricia_node_t *node = nodes[i];
+        ((pytricia_ext_t *)node->user1)->timer = NULL;
+        nodes[i] = _pytricia_remove_node(self, node);
+    }
+    for (i = 0; i < n; i++) {
+        Py_XDECREF((PyObject *)nodes[i]);
+    }
+    free(nodes);
+    return PyLong_FromLong(n);
+}
+
+static PyObject *
+pytricia_get(register PyTricia *obj, PyObject *args) {
+    PyObject *key = NULL;
+    PyObject *defvalue = NULL;
+
+    if (!PyArg_ParseTuple(args, "O|O:get", &key, &defvalue)) {
+        return NULL;
+    }
+    prefix_t *prefix = _key_object_to_prefix(key);
+    if (!prefix) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return NULL;
+    }
+    patricia_node_t* node = _pytricia_search_best(obj, prefix);
+    Deref_Prefix(prefix);
+
+    if (!node) {
+        if (defvalue) {
+            Py_INCREF(defvalue);
+            return defvalue;
+        }
+        Py_RETURN_NONE;
+    }
+
+    PyObject* data = (PyObject*)node->data;
+    Py_INCREF(data);
+    return data;
+}
+
+static PyObject *
+pytricia_get_key(register PyTricia *obj, PyObject *args) {
+    PyObject *key = NULL;
+
+    if (!PyArg_ParseTuple(args, "O", &key)) {
+        return NULL;
+    }
+
+    prefix_t *prefix = _key_object_to_prefix(key);
+    if (!prefix) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return NULL;
+    }
+    patricia_node_t* node = _pytricia_search_best(obj, prefix);
+    Deref_Prefix(prefix);
+
+    if (!node) {
+        Py_RETURN_NONE;
+    }
+
+    char buffer[64];
+    prefix_toa2x(node->prefix, buffer, 1);
+    return Py_BuildValue("s", buffer);
+}
+
+static int
+pytricia_contains(PyTricia *self, PyObject *key) {
+    prefix_t *prefix = _key_object_to_prefix(key);
+    if (!prefix) {
+        return 0;        
+    }
+    patricia_node_t* node = _pytricia_search_best(self, prefix);
+    Deref_Prefix(prefix);
+    if (node) {
+        return 1;
+    }
+    return 0;
+}
+
+static PyObject*
+pytricia_has_key(PyTricia *self, PyObject *args) {
+    PyObject *key = NULL;
+    if (!PyArg_ParseTuple(args, "O", &key))
+        return NULL;
+    
+    prefix_t *prefix = _key_object_to_prefix(key);
+    if (!prefix) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return NULL;
+    }
+    patricia_node_t* node = patricia_search_exact(self->m_tree, prefix);
+    Deref_Prefix(prefix);
+    if (node) {
+        Py_RETURN_TRUE;
+    }
+    Py_RETURN_FALSE;
+}
+
+static PyObject* 
+pytricia_keys(register PyTricia *self, PyObject *unused) {
+    register PyObject *rvlist = PyList_New(0);
+    if (!rvlist) {
+        return NULL;
+    }
+    
+    patricia_node_t *node = NULL;
+    int err = 0;
+    
+    PATRICIA_WALK (self->m_tree->head, node) {
+        char buffer[64];
+        prefix_toa2x(node->prefix, buffer, 1);
+        PyObject *item = Py_BuildValue("s", buffer);
+        if (!item) {
+            Py_DECREF(rvlist);
+            return NULL;
+        }
+        err = PyList_Append(rvlist, item);
+        Py_DECREF(item);
+        if (err != 0) {
+            Py_DECREF(rvlist);
+            return NULL;
+        }
+    } PATRICIA_WALK_END;
+    return rvlist;
+}
+
+static PyObject*
+pytricia_children(register PyTricia *self, PyObject *args) {
+    PyObject *key = NULL;
+
+    if (!PyArg_ParseTuple(args, "O", &key)) {
+        return NULL;
+    }
+
+    prefix_t *prefix = _key_object_to_prefix(key);
+    if (!prefix) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return NULL;
+    }
+
+    register PyObject *rvlist = PyList_New(0);
+    if (!rvlist) {
+        return NULL;
+    }
+
+    patricia_node_t* base_node = patricia_search_exact(self->m_tree, prefix);
+    Deref_Prefix(prefix);
+    if (!base_node) {
+	   PyErr_SetString(PyExc_KeyError, "Prefix doesn't exist.");
+	   Py_DECREF(rvlist);
+	   return NULL;
+    }
+    patricia_node_t* node = NULL;
+    int err = 0;
+
+    PATRICIA_WALK (base_node, node) {
+    	/* Discard first prefix (we want strict children) */
+    	if (node != base_node) {
+    	    char buffer[64];
+    	    prefix_toa2x(node->prefix, buffer, 1);
+    	    PyObject *item = Py_BuildValue("s", buffer);
+    	    if (!item) {
+    		    Py_DECREF(rvlist);
+    		    return NULL;
+    	    }
+    	    err = PyList_Append(rvlist, item);
+    	    Py_DECREF(item);
+    	    if (err != 0) {
+    		    Py_DECREF(rvlist);
+    		    return NULL;
+    	    }
+	    }
+    } PATRICIA_WALK_END;
+    return rvlist;
+}
+
+static PyObject*
+pytricia_parent(register PyTricia *self, PyObject *args) {
+    PyObject *key = NULL;
+
+    if (!PyArg_ParseTuple(args, "O", &key)) {
+        return NULL;
+    }
+
+    prefix_t *prefix = _key_object_to_prefix(key);
+    if (!prefix) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return NULL;
+    }
+
+    patricia_node_t* node = patricia_search_exact(self->m_tree, prefix);
+    Deref_Prefix(prefix);
+    if (!node) {
+	   PyErr_SetString(PyExc_KeyError, "Prefix doesn't exist.");
+	   return NULL;
+    }
+    patricia_node_t* parent_node = patricia_search_best2(self->m_tree, node->prefix, 0);
+    if (!parent_node) {
+        Py_RETURN_NONE;
+    }
+
+    char buffer[64];
+    prefix_toa2x(parent_node->prefix, buffer, 1);
+    return Py_BuildValue("s", buffer);
+}
+
+/*
+ * Ordered navigation.  Prefixes are ordered by network address, then by
+ * length, which is the order of keys() (a pre-order walk), so neighbours
+ * are found by walking down to where a key would go and then along parent
+ * pointers, in time proportional to the tree's depth.
+ */
+
+// first prefix node of node's subtree in walk order
+static patricia_node_t *
+_pytricia_first_in(patricia_node_t *node) {
+    while (node && !node->prefix) {
+        node = node->l ? node->l : node->r;
+    }
+    return node;
+}
+
+// last prefix node of node's subtree in walk order; leaves are never glue
+static patricia_node_t *
+_pytricia_last_in(patricia_node_t *node) {
+    while (node && (node->l || node->r)) {
+        node = node->r ? node->r : node->l;
+    }
+    return node;
+}
+
+// first prefix node after node's whole subtree
+static patricia_node_t *
+_pytricia_after_subtree(patricia_node_t *node) {
+    for (; node->parent; node = node->parent) {
+        if (node == node->parent->l && node->parent->r) {
+            return _pytricia_first_in(node->parent->r);
+        }
+    }
+    return NULL;
+}
+
+// last prefix node before node in walk order
+static patricia_node_t *
+_pytricia_walk_prev(patricia_node_t *node) {
+    for (; node->parent; node = node->parent) {
+        patricia_node_t *parent = node->parent;
+        if (node == parent->r && parent->l) {
+            return _pytricia_last_in(parent->l);
+        }
+        if (parent->prefix) {
+            return parent;
+        }
+    }
+    return NULL;
+}
+
+// first prefix node after node itself in walk order
+static patricia_node_t *
+_pytricia_walk_next(patricia_node_t *node) {
+    if (node->l || node->r) {
+        return _pytricia_first_in(node->l ? node->l : node->r);
+    }
+    return _pytricia_after_subtree(node);
+}
+
+/*
+ * First prefix node at or after (strict: after) key in walk order.  key's
+ * address must be zero past its length.
+ */
+static patricia_node_t *
+_pytricia_lower_bound(patricia_tree_t *tree, prefix_t *key, int strict) {
+    patricia_node_t *node = tree->head;
+    const u_char *addr = prefix_touchar(key);
+    u_int bitlen = key->bitlen;
+
+    while (node) {
+        // every prefix under node shares node's first node->bit bits
+        const u_char *bits = prefix_touchar(_pytricia_first_in(node)->prefix);
+        u_int i;
+        for (i = 0; i < node->bit; i++) {
+            int mine = BIT_TEST(addr[i >> 3], 0x80 >> (i & 0x07)) != 0;
+            if (mine != (BIT_TEST(bits[i >> 3], 0x80 >> (i & 0x07)) != 0)) {
+                return mine ? _pytricia_after_subtree(node) : _pytricia_first_in(node);
+            }
+        }
+        if (bitlen < node->bit) {
+            return _pytricia_first_in(node);
+        }
+        if (bitlen == node->bit) {
+            return node->prefix && !strict ? node : _pytricia_walk_next(node);
+        }
+        if (BIT_TEST(addr[node->bit >> 3], 0x80 >> (node->bit & 0x07))) {
+            if (!node->r) {
+                return _pytricia_after_subtree(node);
+            }
+            node = node->r;
+        } else {
+            if (!node->l) {
+                return node->r ? _pytricia_first_in(node->r) : _pytricia_after_subtree(node);
+            }
+            node = node->l;
+        }
+    }
+    return NULL;
+}
+
+// last prefix node before (inclusive: at or before) key in walk order
+static patricia_node_t *
+_pytricia_upper_neighbour(patricia_tree_t *tree, prefix_t *key, int inclusive) {
+    patricia_node_t *next = _pytricia_lower_bound(tree, key, inclusive);
+    if (next) {
+        return _pytricia_walk_prev(next);
+    }
+    return _pytricia_last_in(tree->head);
+}
+
+// zero the address bits past the prefix length
+static void
+_pytricia_mask(prefix_t *prefix) {
+    u_char *addr = prefix_touchar(prefix);
+    int i;
+
+    for (i = prefix->bitlen; i < (prefix->family == AF_INET6 ? 128 : 32); i++) {
+        addr[i >> 3] &= ~(0x80 >> (i & 0x07));
+    }
+}
+
+// the key as a static prefix zeroed past its length; with host set, its
+// network address as a full-length host key instead
+static int
+_pytricia_nav_key(PyObject *key, int host, prefix_t *out) {
+    prefix_t *prefix = _key_object_to_prefix(key);
+
+    if (!prefix) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        }
+        return -1;
+    }
+    New_Prefix2(prefix->family, &prefix->add, prefix->bitlen, out);
+    Deref_Prefix(prefix);
+    _pytricia_mask(out);
+    if (host) {
+        out->bitlen = out->family == AF_INET6 ? 128 : 32;
+    }
+    return 0;
+}
+
+static PyObject *
+_pytricia_nav_result(patricia_node_t *node) {
+    char buffer[64];
+
+    if (!node) {
+        Py_RETURN_NONE;
+    }
+    prefix_toa2x(node->prefix, buffer, 1);
+    return Py_BuildValue("(sO)", buffer, (PyObject *)node->data);
+}
+
+static PyObject*
+pytricia_next_prefix(PyTricia *self, PyObject *args) {
+    PyObject *key = NULL;
+    prefix_t prefix;
+
+    if (!PyArg_ParseTuple(args, "O:next_prefix", &key) || _pytricia_nav_key(key, 0, &prefix) < 0) {
+        return NULL;
+    }
+    return _pytricia_nav_result(_pytricia_lower_bound(self->m_tree, &prefix, 1));
+}
+
+static PyObject*
+pytricia_prev_prefix(PyTricia *self, PyObject *args) {
+    PyObject *key = NULL;
+    prefix_t prefix;
+
+    if (!PyArg_ParseTuple(args, "O:prev_prefix", &key) || _pytricia_nav_key(key, 0, &prefix) < 0) {
+        return NULL;
+    }
+    return _pytricia_nav_result(_pytricia_upper_neighbour(self->m_tree, &prefix, 0));
+}
+
+static PyObject*
+pytricia_floor(PyTricia *self, PyObject *args) {
+    PyObject *key = NULL;
+    prefix_t prefix;
+
+    if (!PyArg_ParseTuple(args, "O:floor", &key) || _pytricia_nav_key(key, 1, &prefix) < 0) {
+        return NULL;
+    }
+    // a full-length key sorts after every prefix that starts at its address
+    return _pytricia_nav_result(_pytricia_upper_neighbour(self->m_tree, &prefix, 1));
+}
+
+static PyObject*
+pytricia_ceiling(PyTricia *self, PyObject *args) {
+    PyObject *key = NULL;
+    prefix_t prefix;
+
+    if (!PyArg_ParseTuple(args, "O:ceiling", &key) || _pytricia_nav_key(key, 1, &prefix) < 0) {
+        return NULL;
+    }
+    // a zero-length key at the address would sort first among those
+    // starting there, but only if the address is all zeros; otherwise
+    // step back one address and take what comes after it
+    u_char *addr = prefix_touchar(&prefix);
+    int i = prefix.bitlen / 8;
+    while (i-- > 0 && addr[i]-- == 0) {
+    }
+    if (i < 0) {
+        return _pytricia_nav_result(_pytricia_first_in(self->m_tree->head));
+    }
+    return _pytricia_nav_result(_pytricia_lower_bound(self->m_tree, &prefix, 1));
+}
+
+// the top of the subtree holding every prefix inside region, if there are any
+static patricia_node_t *
+_pytricia_subtree(patricia_tree_t *tree, prefix_t *region) {
+    u_char *addr = prefix_touchar(region);
+    patricia_node_t *x = tree->head;
+
+    while (x && x->bit < region->bitlen) {
+        x = BIT_TEST(addr[x->bit >> 3], 0x80 >> (x->bit & 0x07)) ? x->r : x->l;
+    }
+    if (x && !comp_with_mask(prefix_touchar(_pytricia_first_in(x)->prefix), addr, region->bitlen)) {
+        x = NULL;
+    }
+    return x;
+}
+
+// could region (length r) holding only the subtree x fit a free block of length len?
+static int
+_pytricia_region_fits(patricia_node_t *x, u_int r, u_int len) {
+    if (!x) {
+        return 1;
+    }
+    if (x->bit > r) {
+        return len > r;
+    }
+    return _pytricia_free_bit(x) <= len;
+}
+
+static PyObject*
+pytricia_find_free(PyTricia *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"length", "within", NULL};
+    PyObject *within = Py_None;
+    int length = 0;
+    u_int maxbits;
+    prefix_t region;
+    patricia_node_t *node, *x;
+    u_char *addr;
+    u_int r;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "i|O:find_free", kwlist, &length, &within)) {
+        return NULL;
+    }
+    if (within == Py_None) {
+        u_char zero[16] = {0};
+        New_Prefix2(self->m_family, zero, 0, &region);
+    } else if (_pytricia_nav_key(within, 0, &region) < 0) {
+        return NULL;
+    }
+    maxbits = region.family == AF_INET6 ? 128 : 32;
+    if (length < (int)region.bitlen || length > (int)maxbits) {
+        PyErr_Format(PyExc_ValueError, "length must be between %d and %u", region.bitlen, maxbits);
+        return NULL;
+    }
+
+    if (!self->m_track_free) {
+        // start tracking: fill in free_bit children first, i.e. in reverse walk order
+        Py_ssize_t i, n = 0;
+        patricia_node_t **nodes = PyMem_Malloc((self->m_tree->num_active_node + 1) * sizeof(*nodes));
+        if (!nodes) {
+            return PyErr_NoMemory();
+        }
+        if (_pytricia_ext_all(self) < 0) {
+            PyMem_Free(nodes);
+            return NULL;
+        }
+        PATRICIA_WALK_ALL(self->m_tree->head, node) {
+            nodes[n++] = node;
+        } PATRICIA_WALK_END;
+        for (i = n - 1; i >= 0; i--) {
+            _pytricia_free_set(self, nodes[i]);
+        }
+        PyMem_Free(nodes);
+        self->m_track_free = 1;
+    }
+
+    // a prefix covering the whole region leaves nothing free in it
+    if (patricia_search_best2(self->m_tree, &region, 1)) {
+        Py_RETURN_NONE;
+    }
+    addr = prefix_touchar(&region);
+    x = _pytricia_subtree(self->m_tree, &region);
+
+    // halve the region towards the lowest half that still fits, one bit at a time
+    if (!_pytricia_region_fits(x, region.bitlen, length)) {
+        Py_RETURN_NONE;
+    }
+    for (r = region.bitlen; r < (u_int)length; r++) {
+        patricia_node_t *lo = x, *hi = NULL;
+        if (!x) {
+            lo = NULL;
+        } else if (x->bit > r) {
+            const u_char *bits = prefix_touchar(_pytricia_first_in(x)->prefix);
+            if (BIT_TEST(bits[r >> 3], 0x80 >> (r & 0x07))) {
+                lo = NULL;
+                hi = x;
+            }
+        } else {
+            lo = x->l;
+            hi = x->r;
+        }
+        if (_pytricia_region_fits(lo, r + 1, length)) {
+            x = lo;
+        } else {
+            addr[r >> 3] |= 0x80 >> (r & 0x07);
+            x = hi;
+        }
+    }
+    region.bitlen = length;
+
+    char buffer[64];
+    prefix_toa2x(&region, buffer, 1);
+    return Py_BuildValue("s", buffer);
+}
+
+/*
+ * Bulk removal.  The doomed nodes are picked first and then removed
+ * children before parents, so most come out as leaves and the glue above
+ * them goes with them; values are dropped only once every node is out.
+ */
+
+static void
+_pytricia_post_order(patricia_node_t *node, patricia_node_t **out, Py_ssize_t *n) {
+    if (!node) {
+        return;
+    }
+    _pytricia_post_order(node->l, out, n);
+    _pytricia_post_order(node->r, out, n);
+    if (node->prefix) {
+        out[(*n)++] = node;
+    }
+}
+
+// remove the first n nodes, whose values no one else needs yet
+static PyObject *
+_pytricia_remove_all(PyTricia *self, patricia_node_t **nodes, Py_ssize_t n) {
+    Py_ssize_t i;
+
+    for (i = 0; i < n; i++) {
+        nodes[i] = (patricia_node_t *)_pytricia_remove_node(self, nodes[i]);
+    }
+    for (i = 0; i < n; i++) {
+        Py_XDECREF((PyObject *)nodes[i]);
+    }
+    PyMem_Free(nodes);
+    return PyLong_FromSsize_t(n);
+}
+
+// the prefix nodes at or below within (the whole tree if it's NULL), in post-order
+static patricia_node_t **
+_pytricia_doomed(PyTricia *self, PyObject *within, Py_ssize_t *n) {
+    patricia_node_t **nodes, *top = self->m_tree->head;
+
+    if (within) {
+        prefix_t region;
+        if (_pytricia_nav_key(within, 0, &region) < 0) {
+            return NULL;
+        }
+        top = _pytricia_subtree(self->m_tree, &region);
+    }
+    nodes = PyMem_Malloc((self->m_tree->num_active_node + 1) * sizeof(*nodes));
+    if (!nodes) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    *n = 0;
+    _pytricia_post_order(top, nodes, n);
+    return nodes;
+}
+
+static PyObject*
+pytricia_delete_subtree(PyTricia *self, PyObject *args) {
+    PyObject *key = NULL;
+    patricia_node_t **nodes;
+    Py_ssize_t n;
+
+    if (!PyArg_ParseTuple(args, "O:delete_subtree", &key)) {
+        return NULL;
+    }
+    if (_pytricia_check_busy(self) < 0 || !(nodes = _pytricia_doomed(self, key, &n))) {
+        return NULL;
+    }
+    return _pytricia_remove_all(self, nodes, n);
+}
+
+static PyObject*
+pytricia_prune(PyTricia *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"predicate", "values", "within", NULL};
+    PyObject *predicate = Py_None, *values = NULL, *within = NULL;
+    patricia_node_t **nodes;
+    Py_ssize_t i, n, kept = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOO:prune", kwlist, &predicate, &values, &within)) {
+        return NULL;
+    }
+    if ((predicate == Py_None) == (values == NULL)) {
+        PyErr_SetString(PyExc_TypeError, "prune needs either a predicate or values");
+        return NULL;
+    }
+    if (predicate != Py_None && !PyCallable_Check(predicate)) {
+        PyErr_SetString(PyExc_TypeError, "predicate must be callable");
+        return NULL;
+    }
+    if (within == Py_None) {
+        within = NULL;
+    }
+    if (_pytricia_check_busy(self) < 0 || !(nodes = _pytricia_doomed(self, within, &n))) {
+        return NULL;
+    }
+
+    // the tests run Python code, which mustn't change the tree under us
+    self->m_busy++;
+    for (i = 0; i < n; i++) {
+        PyObject *value = (PyObject *)nodes[i]->data;
+        int hit;
+        if (values) {
+            hit = PySequence_Contains(values, value);
+        } else {
+            PyObject *rv = PyObject_CallFunctionObjArgs(predicate, value, NULL);
+            hit = rv ? PyObject_IsTrue(rv) : -1;
+            Py_XDECREF(rv);
+        }
+        if (hit < 0) {
+            break;
+        }
+        if (hit) {
+            nodes[kept++] = nodes[i];
+        }
+    }
+    self->m_busy--;
+    if (i < n) {
+        PyMem_Free(nodes);
+        return NULL;
+    }
+    return _pytricia_remove_all(self, nodes, kept);
+}
+
+static PyObject*
+pytricia_first(PyTricia *self, PyObject *unused) {
+    return _pytricia_nav_result(_pytricia_first_in(self->m_tree->head));
+}
+
+static PyObject*
+pytricia_last(PyTricia *self, PyObject *unused) {
+    return _pytricia_nav_result(_pytricia_last_in(self->m_tree->head));
+}
+
+/*
+ * Containment pairs.  Sorted by address and then by length, every prefix
+ * comes right after all the prefixes that contain it, so one sweep with a
+ * stack of the open (nested) prefixes finds every pair.
+ */
+
+// sorted by family, then address, then length
+static int
+_pytricia_prefix_cmp(prefix_t *x, prefix_t *y) {
+    int c;
+
+    if (x->family != y->family) {
+        return x->family < y->family ? -1 : 1;
+    }
+    c = memcmp(prefix_touchar(x), prefix_touchar(y), x->family == AF_INET6 ? 16 : 4);
+    if (c) {
+        return c;
+    }
+    if (x->bitlen != y->bitlen) {
+        return x->bitlen < y->bitlen ? -1 : 1;
+    }
+    return 0;
+}
+
+static int
+_pytricia_contains(prefix_t *outer, prefix_t *inner) {
+    return outer->family == inner->family && outer->bitlen <= inner->bitlen &&
+        comp_with_mask(prefix_touchar(outer), prefix_touchar(inner), outer->bitlen);
+}
+
+typedef struct {
+    prefix_t *prefix;
+    Py_ssize_t id;
+} pytricia_ranked_t;
+
+// (outer ids, inner ids) for every pair of items where outer contains inner,
+// or with first set just the first such pair as a tuple, or None
+static PyObject *
+_pytricia_overlaps(pytricia_ranked_t *items, Py_ssize_t n, int first) {
+    PyObject *outer = NULL, *inner = NULL, *rv = NULL;
+    Py_ssize_t *stack, i, depth = 0, cap = 64;
+
+    stack = PyMem_Malloc(cap * sizeof(*stack));
+    if (!stack) {
+        return PyErr_NoMemory();
+    }
+    if (!first && (!(outer = PyList_New(0)) || !(inner = PyList_New(0)))) {
+        goto done;
+    }
+    for (i = 0; i < n; i++) {
+        prefix_t *prefix = items[i].prefix;
+        Py_ssize_t j;
+        while (depth > 0 && !_pytricia_contains(items[stack[depth - 1]].prefix, prefix)) {
+            depth--;
+        }
+        if (first && depth > 0) {
+            rv = Py_BuildValue("(nn)", items[stack[depth - 1]].id, items[i].id);
+            goto done;
+        }
+        for (j = 0; j < depth; j++) {
+            PyObject *o = PyLong_FromSsize_t(items[stack[j]].id);
+            PyObject *p = PyLong_FromSsize_t(items[i].id);
+            int err = !o || !p || PyList_Append(outer, o) < 0 || PyList_Append(inner, p) < 0;
+            Py_XDECREF(o);
+            Py_XDECREF(p);
+            if (err) {
+                goto done;
+            }
+        }
+        if (depth == cap) {
+            Py_ssize_t *grown = PyMem_Realloc(stack, 2 * cap * sizeof(*stack));
+            if (!grown) {
+                PyErr_NoMemory();
+                goto done;
+            }
+            stack = grown;
+            cap *= 2;
+        }
+        stack[depth++] = i;
+    }
+    if (first) {
+        rv = Py_None;
+        Py_INCREF(rv);
+    } else {
+        rv = Py_BuildValue("(OO)", outer, inner);
+    }
+
+done:
+    Py_XDECREF(outer);
+    Py_XDECREF(inner);
+    PyMem_Free(stack);
+    return rv;
+}
+
+static PyObject*
+pytricia_conflicts(PyTricia *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"first", NULL};
+    pytricia_ranked_t *items;
+    patricia_node_t *node;
+    PyObject *first = Py_False, *rv;
+    Py_ssize_t n = 0;
+    int family;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:conflicts", kwlist, &first)) {
+        return NULL;
+    }
+    // a tree walk visits each family's prefixes in sorted order, but IPv6
+    // ones may come in between IPv4 ones, so take one family at a time
+    items = PyMem_Malloc((self->m_tree->num_active_node + 1) * sizeof(*items));
+    if (!items) {
+        return PyErr_NoMemory();
+    }
+    for (family = AF_INET; family; family = family == AF_INET ? AF_INET6 : 0) {
+        Py_ssize_t id = 0;
+        PATRICIA_WALK (self->m_tree->head, node) {
+            if (node->prefix->family == family) {
+                items[n].prefix = node->prefix;
+                items[n].id = id;
+                n++;
+            }
+            id++;
+        } PATRICIA_WALK_END;
+    }
+    rv = _pytricia_overlaps(items, n, PyObject_IsTrue(first));
+    PyMem_Free(items);
+    return rv;
+}
+
+// the prefix nodes of tree, IPv4 ones first, each family in sorted order;
+// returns how many went into out, which has room for every node
+static Py_ssize_t
+_pytricia_sorted_nodes(patricia_tree_t *tree, patricia_node_t **out) {
+    patricia_node_t *node;
+    Py_ssize_t n = 0;
+    int family;
+
+    for (family = AF_INET; family; family = family == AF_INET ? AF_INET6 : 0) {
+        PATRICIA_WALK (tree->head, node) {
+            if (node->prefix->family == family) {
+                out[n++] = node;
+            }
+        } PATRICIA_WALK_END;
+    }
+    return n;
+}
+
+// a prefix of other that contains the current position, and its key string
+// once some row has needed it
+typedef struct {
+    patricia_node_t *node;
+    PyObject *key;
+} pytricia_cover_t;
+
+static int
+_pytricia_join_append(PyObject *columns, patricia_node_t *a, pytricia_cover_t *b) {
+    char buffer[64];
+    PyObject *item;
+    int rv;
+
+    prefix_toa2x(a->prefix, buffer, 1);
+    item = PyUnicode_FromString(buffer);
+    rv = item ? PyList_Append(PyTuple_GET_ITEM(columns, 0), item) : -1;
+    Py_XDECREF(item);
+    if (rv < 0) {
+        return -1;
+    }
+    if (b && !b->key) {
+        prefix_toa2x(b->node->prefix, buffer, 1);
+        if (!(b->key = PyUnicode_FromString(buffer))) {
+            return -1;
+        }
+    }
+    if (PyList_Append(PyTuple_GET_ITEM(columns, 1), b ? b->key : Py_None) < 0) {
+        return -1;
+    }
+    return PyList_Append(PyTuple_GET_ITEM(columns, 2), b ? (PyObject *)b->node->data : Py_None);
+}
+
+static PyObject*
+pytricia_join(PyTricia *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"other", "mode", NULL};
+    PyTricia *other = NULL;
+    const char *mode = "best";
+    patricia_node_t **anodes, **bnodes;
+    pytricia_cover_t stack[PATRICIA_MAXBITS + 1];
+    Py_ssize_t i, j = 0, na, nb, depth = 0;
+    PyObject *columns;
+    int all;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|s:join", kwlist, &PyTriciaType, &other, &mode)) {
+        return NULL;
+    }
+    if (strcmp(mode, "best") && strcmp(mode, "all")) {
+        PyErr_SetString(PyExc_ValueError, "mode must be 'best' or 'all'");
+        return NULL;
+    }
+    all = mode[0] == 'a';
+    columns = Py_BuildValue("(NNN)", PyList_New(0), PyList_New(0), PyList_New(0));
+    if (!columns) {
+        return NULL;
+    }
+    anodes = PyMem_Malloc((self->m_tree->num_active_node + 1) * sizeof(*anodes));
+    bnodes = PyMem_Malloc((other->m_tree->num_active_node + 1) * sizeof(*bnodes));
+    if (!anodes || !bnodes) {
+        PyMem_Free(anodes);
+        PyMem_Free(bnodes);
+        Py_DECREF(columns);
+        return PyErr_NoMemory();
+    }
+    na = _pytricia_sorted_nodes(self->m_tree, anodes);
+    nb = _pytricia_sorted_nodes(other->m_tree, bnodes);
+
+    /*
+     * Merge the two sorted lists.  The stack holds the nested prefixes of
+     * other that cover the current position, outermost first; by the time a
+     * prefix of self comes up, they are exactly the ones that contain it.
+     */
+    for (i = 0; i < na; i++) {
+        prefix_t *a = anodes[i]->prefix;
+        Py_ssize_t k;
+        for (; j < nb && _pytricia_prefix_cmp(bnodes[j]->prefix, a) <= 0; j++) {
+            while (depth > 0 && !_pytricia_contains(stack[depth - 1].node->prefix, bnodes[j]->prefix)) {
+                Py_XDECREF(stack[--depth].key);
+            }
+            stack[depth].node = bnodes[j];
+            stack[depth++].key = NULL;
+        }
+        while (depth > 0 && !_pytricia_contains(stack[depth - 1].node->prefix, a)) {
+            Py_XDECREF(stack[--depth].key);
+        }
+        if (!all) {
+            if (_pytricia_join_append(columns, anodes[i], depth ? &stack[depth - 1] : NULL) < 0) {
+                break;
+            }
+            continue;
+        }
+        for (k = 0; k < depth; k++) {
+            if (_pytricia_join_append(columns, anodes[i], &stack[k]) < 0) {
+                break;
+            }
+        }
+        if (k < depth) {
+            break;
+        }
+    }
+    while (depth > 0) {
+        Py_XDECREF(stack[--depth].key);
+    }
+    PyMem_Free(anodes);
+    PyMem_Free(bnodes);
+    if (i < na) {
+        Py_DECREF(columns);
+        return NULL;
+    }
+    return columns;
+}
+
+static int
+_pytricia_node_cmp(const void *a, const void *b) {
+    return _pytricia_prefix_cmp((*(patricia_node_t * const *)a)->prefix, (*(patricia_node_t * const *)b)->prefix);
+}
+
+// the value index if the table keeps one, or else a new one built in one walk
+static PyObject *
+_pytricia_value_index(PyTricia *self) {
+    PyObject *index;
+    patricia_node_t *node;
+
+    if (self->m_index) {
+        Py_INCREF(self->m_index);
+        return self->m_index;
+    }
+    if (!(index = PyDict_New())) {
+        return NULL;
+    }
+    self->m_busy++;
+    PATRICIA_WALK (self->m_tree->head, node) {
+        if (_pytricia_index_add(index, (PyObject *)node->data, node) < 0) {
+            Py_CLEAR(index);
+            break;
+        }
+    } PATRICIA_WALK_END;
+    self->m_busy--;
+    return index;
+}
+
+// value's set of nodes, borrowed; NULL with no error set if there are none
+static PyObject *
+_pytricia_index_get(PyTricia *self, PyObject *index, PyObject *value) {
+    PyObject *nodes = NULL;
+
+    self->m_busy++;
+    if (PyObject_Hash(value) != -1) {
+        nodes = PyDict_GetItem(index, value);
+    }
+    self->m_busy--;
+    return nodes;
+}
+
+// the prefixes holding value, in sorted order
+static PyObject *
+_pytricia_keys_for(PyTricia *self, PyObject *index, PyObject *value) {
+    PyObject *nodes, *address, *iter, *rvlist;
+    patricia_node_t **sorted;
+    Py_ssize_t i = 0, n;
+
+    if (!(nodes = _pytricia_index_get(self, index, value))) {
+        return PyErr_Occurred() ? NULL : PyList_New(0);
+    }
+    n = PySet_GET_SIZE(nodes);
+    if (!(iter = PyObject_GetIter(nodes))) {
+        return NULL;
+    }
+    if (!(sorted = PyMem_Malloc((n ? n : 1) * sizeof(*sorted)))) {
+        Py_DECREF(iter);
+        return PyErr_NoMemory();
+    }
+    while (i < n && (address = PyIter_Next(iter))) {
+        sorted[i++] = PyLong_AsVoidPtr(address);
+        Py_DECREF(address);
+    }
+    Py_DECREF(iter);
+    qsort(sorted, n, sizeof(*sorted), _pytricia_node_cmp);
+    rvlist = PyList_New(n);
+    for (i = 0; rvlist && i < n; i++) {
+        char buffer[64];
+        PyObject *key;
+        prefix_toa2x(sorted[i]->prefix, buffer, 1);
+        if (!(key = PyUnicode_FromString(buffer))) {
+            Py_CLEAR(rvlist);
+            break;
+        }
+        PyList_SET_ITEM(rvlist, i, key);
+    }
+    PyMem_Free(sorted);
+    return rvlist;
+}
+
+static Py_ssize_t
+_pytricia_count_for(PyTricia *self, PyObject *index, PyObject *value) {
+    PyObject *nodes = _pytricia_index_get(self, index, value);
+
+    if (!nodes) {
+        return PyErr_Occurred() ? -1 : 0;
+    }
+    return PySet_GET_SIZE(nodes);
+}
+
+static PyObject*
+pytricia_keys_for(PyTricia *self, PyObject *args) {
+    PyObject *value, *index, *rv;
+
+    if (!PyArg_ParseTuple(args, "O:keys_for", &value) || !(index = _pytricia_value_index(self))) {
+        return NULL;
+    }
+    rv = _pytricia_keys_for(self, index, value);
+    Py_DECREF(index);
+    return rv;
+}
+
+static PyObject*
+pytricia_count_for(PyTricia *self, PyObject *args) {
+    PyObject *value, *index;
+    Py_ssize_t n;
+
+    if (!PyArg_ParseTuple(args, "O:count_for", &value) || !(index = _pytricia_value_index(self))) {
+        return NULL;
+    }
+    n = _pytricia_count_for(self, index, value);
+    Py_DECREF(index);
+    return n < 0 ? NULL : PyLong_FromSsize_t(n);
+}
+
+// one result per value, looked up in a single index
+static PyObject *
+_pytricia_for_many(PyTricia *self, PyObject *args, const char *format, int keys) {
+    PyObject *values, *seq, *index, *rvlist = NULL;
+    Py_ssize_t i, n;
+
+    if (!PyArg_ParseTuple(args, format, &values)) {
+        return NULL;
+    }
+    if (!(seq = PySequence_Fast(values, "values must be iterable"))) {
+        return NULL;
+    }
+    n = PySequence_Fast_GET_SIZE(seq);
+    if ((index = _pytricia_value_index(self)) != NULL) {
+        rvlist = PyList_New(n);
+    }
+    for (i = 0; rvlist && i < n; i++) {
+        PyObject *value = PySequence_Fast_GET_ITEM(seq, i), *item;
+        if (keys) {
+            item = _pytricia_keys_for(self, index, value);
+        } else {
+            Py_ssize_t count = _pytricia_count_for(self, index, value);
+            item = count < 0 ? NULL : PyLong_FromSsize_t(count);
+        }
+        if (!item) {
+            Py_CLEAR(rvlist);
+            break;
+        }
+        PyList_SET_ITEM(rvlist, i, item);
+    }
+    Py_XDECREF(index);
+    Py_DECREF(seq);
+    return rvlist;
+}
+
+static PyObject*
+pytricia_keys_for_many(PyTricia *self, PyObject *args) {
+    return _pytricia_for_many(self, args, "O:keys_for_many", 1);
+}
+
+static PyObject*
+pytricia_count_for_many(PyTricia *self, PyObject *args) {
+    return _pytricia_for_many(self, args, "O:count_for_many", 0);
+}
+
+// start keeping hashes, working them out for the whole tree bottom-up
+static int
+_pytricia_hash_start(PyTricia *self) {
+    patricia_node_t **nodes, *node;
+    Py_ssize_t i, n = 0;
+
+    if (self->m_track_hash) {
+        return 0;
+    }
+    nodes = PyMem_Malloc((self->m_tree->num_active_node + 1) * sizeof(*nodes));
+    if (!nodes) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (_pytricia_ext_all(self) < 0) {
+        PyMem_Free(nodes);
+        return -1;
+    }
+    PATRICIA_WALK_ALL(self->m_tree->head, node) {
+        nodes[n++] = node;
+    } PATRICIA_WALK_END;
+    for (i = n - 1; i >= 0; i--) {
+        uint64_t digest = 0;
+        node = nodes[i];
+        if (node->prefix && _pytricia_digest(node->prefix, (PyObject *)node->data, &digest) < 0) {
+            PyMem_Free(nodes);
+            return -1;
+        }
+        _pytricia_hash_set(node, digest + _pytricia_hash_of(node->l) + _pytricia_hash_of(node->r));
+    }
+    PyMem_Free(nodes);
+    self->m_track_hash = 1;
+    return 0;
+}
+
+static PyObject*
+pytricia_root_hash(PyTricia *self, PyObject *unused) {
+    if (_pytricia_hash_start(self) < 0) {
+        return NULL;
+    }
+    return PyLong_FromUnsignedLongLong(_pytricia_hash_of(self->m_tree->head));
+}
+
+static PyObject*
+pytricia_subtree_hash(PyTricia *self, PyObject *args) {
+    PyObject *key = NULL;
+    prefix_t region;
+
+    if (!PyArg_ParseTuple(args, "O:subtree_hash", &key) || _pytricia_nav_key(key, 0, &region) < 0 ||
+        _pytricia_hash_start(self) < 0) {
+        return NULL;
+    }
+    return PyLong_FromUnsignedLongLong(_pytricia_hash_of(_pytricia_subtree(self->m_tree, &region)));
+}
+
+static int
+_pytricia_diff_append(PyObject *rvlist, patricia_node_t *node) {
+    char buffer[64];
+    PyObject *key;
+    int rv;
+
+    prefix_toa2x(node->prefix, buffer, 1);
+    if (!(key = PyUnicode_FromString(buffer))) {
+        return -1;
+    }
+    rv = PyList_Append(rvlist, key);
+    Py_DECREF(key);
+    return rv;
+}
+
+static int
+_pytricia_diff_all(PyObject *rvlist, patricia_node_t *top) {
+    patricia_node_t *node;
+    int rv = 0;
+
+    PATRICIA_WALK (top, node) {
+        if ((rv = _pytricia_diff_append(rvlist, node)) < 0) {
+            break;
+        }
+    } PATRICIA_WALK_END;
+    return rv;
+}
+
+// one side's top node for the half of its region at bit k
+static patricia_node_t *
+_pytricia_diff_half(patricia_node_t *x, u_int k, int right) {
+    if (!x) {
+        return NULL;
+    }
+    if (x->bit == k) {
+        return right ? x->r : x->l;
+    }
+    const u_char *addr = prefix_touchar(_pytricia_first_in(x)->prefix);
+    return !BIT_TEST(addr[k >> 3], 0x80 >> (k & 0x07)) == !right ? x : NULL;
+}
+
+/*
+ * a and b are the top nodes of the same region in two trees.  Equal hashes
+ * mean equal contents, so only regions that differ are ever split, at the
+ * first bit either tree branches on.
+ */
+static int
+_pytricia_diff(patricia_node_t *a, patricia_node_t *b, PyObject *only_a, PyObject *only_b, PyObject *changed) {
+    prefix_t *pa, *pb;
+    u_int k;
+
+    if (_pytricia_hash_of(a) == _pytricia_hash_of(b)) {
+        return 0;
+    }
+    if (!a || !b) {
+        return a ? _pytricia_diff_all(only_a, a) : _pytricia_diff_all(only_b, b);
+    }
+    k = a->bit < b->bit ? a->bit : b->bit;
+    pa = _pytricia_first_in(a)->prefix;
+    pb = _pytricia_first_in(b)->prefix;
+    if (!comp_with_mask(prefix_touchar(pa), prefix_touchar(pb), k)) {
+        // different regions after all, so nothing in them is shared
+        if (_pytricia_diff_all(only_a, a) < 0) {
+            return -1;
+        }
+        return _pytricia_diff_all(only_b, b);
+    }
+
+    patricia_node_t *ea = a->bit == k && a->prefix ? a : NULL;
+    patricia_node_t *eb = b->bit == k && b->prefix ? b : NULL;
+    if (ea && eb) {
+        uint64_t da, db;
+        if (_pytricia_digest(ea->prefix, (PyObject *)ea->data, &da) < 0 ||
+            _pytricia_digest(eb->prefix, (PyObject *)eb->data, &db) < 0) {
+            return -1;
+        }
+        if (da != db && _pytricia_diff_append(changed, ea) < 0) {
+            return -1;
+        }
+    } else if (ea || eb) {
+        if (_pytricia_diff_append(ea ? only_a : only_b, ea ? ea : eb) < 0) {
+            return -1;
+        }
+    }
+    if (k >= PATRICIA_MAXBITS) {
+        return 0;
+    }
+    if (_pytricia_diff(_pytricia_diff_half(a, k, 0), _pytricia_diff_half(b, k, 0), only_a, only_b, changed) < 0) {
+        return -1;
+    }
+    return _pytricia_diff(_pytricia_diff_half(a, k, 1), _pytricia_diff_half(b, k, 1), only_a, only_b, changed);
+}
+
+static PyObject*
+pytricia_diff(PyTricia *self, PyObject *args) {
+    PyTricia *other = NULL;
+    PyObject *only_a, *only_b, *changed, *rv = NULL;
+
+    if (!PyArg_ParseTuple(args, "O!:diff", &PyTriciaType, &other)) {
+        return NULL;
+    }
+    if (_pytricia_hash_start(self) < 0 || _pytricia_hash_start(other) < 0) {
+        return NULL;
+    }
+    only_a = PyList_New(0);
+    only_b = PyList_New(0);
+    changed = PyList_New(0);
+    if (only_a && only_b && changed &&
+        _pytricia_diff(self->m_tree->head, other->m_tree->head, only_a, only_b, changed) == 0) {
+        rv = Py_BuildValue("(OOO)", only_a, only_b, changed);
+    }
+    Py_XDECREF(only_a);
+    Py_XDECREF(only_b);
+    Py_XDECREF(changed);
+    return rv;
+}
+
+static PyObject *
+_pytricia_snapshot(pytricia_version_t *version) {
+    PyTriciaSnapshot *snapshot = PyObject_New(PyTriciaSnapshot, &PyTriciaSnapshotType);
+    if (!snapshot) {
+        return NULL;
+    }
+    snapshot->m_version = *version;
+    persist_retain(version->roots[0]);
+    persist_retain(version->roots[1]);
+    return (PyObject *)snapshot;
+}
+
+static PyObject*
+pytricia_at(PyTricia *self, PyObject *args) {
+    PyObject *when = Py_None;
+    size_t lo, hi;
+
+    if (!PyArg_ParseTuple(args, "|O:at", &when)) {
+        return NULL;
+    }
+    if (!self->m_history) {
+        PyErr_SetString(PyExc_ValueError, "History isn't kept; create the table with history=N");
+        return NULL;
+    }
+    _pytricia_history_commit(self);
+    if (when == Py_None) {
+        return _pytricia_snapshot(_pytricia_version_at(self, self->m_nversions - 1));
+    }
+    if (PyBool_Check(when) || !(PyLong_Check(when) || PyFloat_Check(when))) {
+        PyErr_SetString(PyExc_TypeError, "at() takes a version number (int) or a time (float)");
+        return NULL;
+    }
+
+    // the last version made by or at when
+    lo = 0;
+    hi = self->m_nversions;
+    if (PyFloat_Check(when)) {
+        double t = PyFloat_AsDouble(when);
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (_pytricia_version_at(self, mid)->time <= t) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == 0) {
+            PyErr_SetString(PyExc_KeyError, "No version kept is that old.");
+            return NULL;
+        }
+        return _pytricia_snapshot(_pytricia_version_at(self, lo - 1));
+    }
+
+    unsigned long long v = PyLong_AsUnsignedLongLong(when);
+    if (v == (unsigned long long)-1 && PyErr_Occurred()) {
+        PyErr_Clear();
+        v = 0;
+        lo = hi;
+    }
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (_pytricia_version_at(self, mid)->version < v) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == self->m_nversions || _pytricia_version_at(self, lo)->version != v) {
+        PyErr_SetString(PyExc_KeyError, "Version not kept.");
+        return NULL;
+    }
+    return _pytricia_snapshot(_pytricia_version_at(self, lo));
+}
+
+static PyObject*
+pytricia_versions(PyTricia *self, PyObject *unused) {
+    PyObject *rv;
+    size_t i;
+
+    _pytricia_history_commit(self);
+    if (!(rv = PyList_New(self->m_nversions))) {
+        return NULL;
+    }
+    for (i = 0; i < self->m_nversions; i++) {
+        pytricia_version_t *version = _pytricia_version_at(self, i);
+        PyObject *item = Py_BuildValue("(Kd)", version->version, version->time);
+        if (!item) {
+            Py_DECREF(rv);
+            return NULL;
+        }
+        PyList_SET_ITEM(rv, i, item);
+    }
+    return rv;
+}
+
+#if PY_MAJOR_VERSION == 3
+/*
+ * The type code of a buffer holding a single struct format character with
+ * an optional byte-order prefix, e.g. "I", "=L" or "<I"; 0 for any other
+ * format.  *swap is set if the items are in the other byte order.
+ */
+static char
+_pytricia_buffer_code(const char *fmt, int *swap) {
+    char order = '@';
+
+    if (!fmt) {
+        fmt = "B";
+    }
+    if (*fmt && strchr("@=<>!", *fmt)) {
+        order = *fmt++;
+    }
+    if (!fmt[0] || fmt[1]) {
+        return 0;
+    }
+#if PY_LITTLE_ENDIAN
+    *swap = order == '>' || order == '!';
+#else
+    *swap = order == '<';
+#endif
+    return fmt[0];
+}
+#endif
+
+/*
+ * Batch keys are either any iterable of the usual key objects, or a
+ * contiguous buffer: 32-bit integers (e.g., array('I')) are IPv4 addresses
+ * in host order, and raw bytes are packed network-order addresses, 4 bytes
+ * apiece for an AF_INET table and 16 for AF_INET6.  Every key is parsed
+ * once into a static prefix_t in one flat array.
+ */
+static prefix_t *
+_pytricia_parse_batch(int table_family, PyObject *keys, Py_ssize_t *count) {
+    prefix_t *prefixes = NULL;
+    Py_ssize_t i, n;
+
+#if PY_MAJOR_VERSION == 3
+    if (PyObject_CheckBuffer(keys)) {
+        Py_buffer view;
+        if (PyObject_GetBuffer(keys, &view, PyBUF_FORMAT | PyBUF_ND) < 0) {
+            return NULL;
+        }
+        int swap = 0;
+        char code = _pytricia_buffer_code(view.format, &swap);
+        if (code && view.itemsize == 4 && strchr("IiLl", code)) {
+            n = view.len / 4;
+            prefixes = PyMem_Malloc((n ? n : 1) * sizeof(prefix_t));
+            for (i = 0; prefixes && i < n; i++) {
+                uint32_t addr = ((uint32_t *)view.buf)[i];
+                if (swap) {
+                    addr = (addr >> 24) | ((addr >> 8) & 0xff00) | ((addr << 8) & 0xff0000) | (addr << 24);
+                }
+                uint32_t packed = htonl(addr);
+                New_Prefix2(AF_INET, &packed, 32, &prefixes[i]);
+            }
+        } else if (code && view.itemsize == 1 && strchr("Bbc", code)) {
+            int family = table_family == AF_INET6 ? AF_INET6 : AF_INET;
+            Py_ssize_t stride = family == AF_INET6 ? 16 : 4;
+            if (view.len % stride != 0) {
+                PyBuffer_Release(&view);
+                PyErr_Format(PyExc_ValueError, "Packed address buffer length must be a multiple of %zd", stride);
+                return NULL;
+            }
+            n = view.len / stride;
+            prefixes = PyMem_Malloc((n ? n : 1) * sizeof(prefix_t));
+            for (i = 0; prefixes && i < n; i++) {
+                New_Prefix2(family, (char *)view.buf + i * stride, -1, &prefixes[i]);
+            }
+        } else {
+            PyBuffer_Release(&view);
+            PyErr_SetString(PyExc_ValueError, "Address buffers must hold bytes or 32-bit integers");
+            return NULL;
+        }
+        PyBuffer_Release(&view);
+        if (!prefixes) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        *count = n;
+        return prefixes;
+    }
+#endif
+
+    PyObject *seq = PySequence_Fast(keys, "Keys must be an iterable or a buffer of packed addresses");
+    if (!seq) {
+        return NULL;
+    }
+    n = PySequence_Fast_GET_SIZE(seq);
+    prefixes = PyMem_Malloc((n ? n : 1) * sizeof(prefix_t));
+    if (!prefixes) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        prefix_t *prefix = _key_object_to_prefix(PySequence_Fast_GET_ITEM(seq, i));
+        if (!prefix) {
+            PyMem_Free(prefixes);
+            Py_DECREF(seq);
+            PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+            return NULL;
+        }
+        New_Prefix2(prefix->family, &prefix->add, prefix->bitlen, &prefixes[i]);
+        Deref_Prefix(prefix);
+    }
+    Py_DECREF(seq);
+    *count = n;
+    return prefixes;
+}
+
+/*
+ * Longest match for every prefix in a parsed batch.  If the table is frozen,
+ * the keys the engine can answer are handed to it a chunk at a time so that
+ * it can walk them side by side; the rest go through the tree one at a time.
+ * Touches no Python objects, so it can run with the GIL released.
+ */
+static void
+_pytricia_search_chunked(patricia_tree_t *tree, frozen_t *frozen, prefix_t *prefixes, Py_ssize_t n,
+                         patricia_node_t **out) {
+    u_char addrs[PYTRICIA_CHUNK * 16];
+    patricia_node_t *found[PYTRICIA_CHUNK];
+    Py_ssize_t where[PYTRICIA_CHUNK];
+    size_t width = frozen && frozen_family(frozen) == AF_INET6 ? 16 : 4;
+    Py_ssize_t i = 0, k, served;
+
+    while (i < n) {
+        for (served = 0; i < n && served < PYTRICIA_CHUNK; i++) {
+            if (frozen && _pytricia_frozen_serves(frozen, &prefixes[i])) {
+                memcpy(addrs + width * served, prefix_touchar(&prefixes[i]), width);
+                where[served++] = i;
+            } else {
+                out[i] = patricia_search_best(tree, &prefixes[i]);
+            }
+        }
+        if (served > 0) {
+            frozen_search_many(frozen, addrs, served, found);
+            for (k = 0; k < served; k++) {
+                out[where[k]] = found[k];
+            }
+        }
+    }
+}
+
+static void
+_pytricia_search_batch(PyTricia *self, prefix_t *prefixes, Py_ssize_t n, patricia_node_t **out) {
+    frozen_t *frozen = _pytricia_frozen(self);
+    Py_ssize_t i;
+
+    if (frozen) {
+        for (i = 0; i < n; i++) {
+            if (_pytricia_frozen_serves(frozen, &prefixes[i])) {
+                _pytricia_observe(self, &prefixes[i]);
+            }
+        }
+    }
+    _pytricia_search_chunked(self->m_tree, frozen, prefixes, n, out);
+    if (_pytricia_hiding(self)) {
+        double now = _pytricia_now();
+        for (i = 0; i < n; i++) {
+            out[i] = _pytricia_unexpired(out[i], now);
+        }
+    }
+    if (self->m_clock) {
+        for (i = 0; i < n; i++) {
+            _pytricia_touch(self, out[i]);
+        }
+    }
+}
+
+static PyObject *
+pytricia_get_many(register PyTricia *self, PyObject *args) {
+    PyObject *keys = NULL;
+    PyObject *defvalue = Py_None;
+    Py_ssize_t i, n = 0;
+
+    if (!PyArg_ParseTuple(args, "O|O:get_many", &keys, &defvalue)) {
+        return NULL;
+    }
+
+    prefix_t *prefixes = _pytricia_parse_batch(self->m_family, keys, &n);
+    if (!prefixes) {
+        return NULL;
+    }
+    patricia_node_t **nodes = PyMem_Malloc((n ? n : 1) * sizeof(*nodes));
+    if (!nodes) {
+        PyMem_Free(prefixes);
+        return PyErr_NoMemory();
+    }
+    _pytricia_search_batch(self, prefixes, n, nodes);
+    PyMem_Free(prefixes);
+
+    PyObject *rvlist = PyList_New(n);
+    if (rvlist) {
+        for (i = 0; i < n; i++) {
+            PyObject *data = nodes[i] ? (PyObject *)nodes[i]->data : defvalue;
+            Py_INCREF(data);
+            PyList_SET_ITEM(rvlist, i, data);
+        }
+    }
+    PyMem_Free(nodes);
+    return rvlist;
+}
+
+// the size of a weight buffer item with this type code, or 0 if it isn't one
+static size_t
+_pytricia_weight_size(char code) {
+    switch (code) {
+    case 'd': return sizeof(double);
+    case 'f': return sizeof(float);
+    case 'b': case 'B': return sizeof(char);
+    case 'h': case 'H': return sizeof(short);
+    case 'i': case 'I': return sizeof(int);
+    case 'l': case 'L': return sizeof(long);
+    case 'q': case 'Q': return sizeof(long long);
+    }
+    return 0;
+}
+
+// weights as doubles: a buffer of numbers in either byte order, an
+// iterable, or NULL (all 1)
+static double *
+_pytricia_parse_weights(PyObject *weights, Py_ssize_t n) {
+    double *rv = PyMem_Malloc((n ? n : 1) * sizeof(double));
+    Py_ssize_t i;
+
+    if (!rv) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    if (!weights || weights == Py_None) {
+        for (i = 0; i < n; i++) {
+            rv[i] = 1.0;
+        }
+        return rv;
+    }
+
+    if (PyObject_CheckBuffer(weights)) {
+        Py_buffer view;
+        int swap = 0;
+        char code;
+        if (PyObject_GetBuffer(weights, &view, PyBUF_FORMAT | PyBUF_ND) < 0) {
+            PyMem_Free(rv);
+            return NULL;
+        }
+        code = _pytricia_buffer_code(view.format, &swap);
+        if ((size_t)view.itemsize != _pytricia_weight_size(code)) {
+            PyErr_Format(PyExc_ValueError, "Unsupported weight buffer format '%s'", view.format ? view.format : "B");
+            PyBuffer_Release(&view);
+            PyMem_Free(rv);
+            return NULL;
+        }
+        if (view.len / view.itemsize != n) {
+            PyBuffer_Release(&view);
+            PyMem_Free(rv);
+            PyErr_SetString(PyExc_ValueError, "Need one weight per key");
+            return NULL;
+        }
+        for (i = 0; i < n; i++) {
+            const u_char *item = (const u_char *)view.buf + i * view.itemsize;
+            u_char raw[8];
+            Py_ssize_t j;
+            for (j = 0; j < view.itemsize; j++) {
+                raw[j] = item[swap ? view.itemsize - 1 - j : j];
+            }
+#define PYTRICIA_WEIGHT(code, type) \
+            case code: { type w; memcpy(&w, raw, sizeof(w)); rv[i] = (double)w; break; }
+            switch (code) {
+                PYTRICIA_WEIGHT('d', double)
+                PYTRICIA_WEIGHT('f', float)
+                PYTRICIA_WEIGHT('b', signed char)
+                PYTRICIA_WEIGHT('B', unsigned char)
+                PYTRICIA_WEIGHT('h', short)
+                PYTRICIA_WEIGHT('H', unsigned short)
+                PYTRICIA_WEIGHT('i', int)
+                PYTRICIA_WEIGHT('I', unsigned int)
+                PYTRICIA_WEIGHT('l', long)
+                PYTRICIA_WEIGHT('L', unsigned long)
+                PYTRICIA_WEIGHT('q', long long)
+                PYTRICIA_WEIGHT('Q', unsigned long long)
+            }
+#undef PYTRICIA_WEIGHT
+        }
+        PyBuffer_Release(&view);
+        return rv;
+    }
+
+    PyObject *seq = PySequence_Fast(weights, "Weights must be an iterable or a buffer of numbers");
+    if (!seq) {
+        PyMem_Free(rv);
+        return NULL;
+    }
+    if (PySequence_Fast_GET_SIZE(seq) != n) {
+        Py_DECREF(seq);
+        PyMem_Free(rv);
+        PyErr_SetString(PyExc_ValueError, "Need one weight per key");
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        rv[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+        if (rv[i] == -1.0 && PyErr_Occurred()) {
+            Py_DECREF(seq);
+            PyMem_Free(rv);
+            return NULL;
+        }
+    }
+    Py_DECREF(seq);
+    return rv;
+}
+
+/*
+ * Open-addressed map from a prefix-bearing node to its position in walk
+ * (keys()) order, so that accumulators can live in a flat array.
+ */
+typedef struct {
+    patricia_node_t **nodes;    /* walk order */
+    Py_ssize_t count;
+    patricia_node_t **slots;
+    Py_ssize_t *ids;
+    size_t mask;
+} pytricia_node_index_t;
+
+static size_t
+_pytricia_node_hash(patricia_node_t *node, size_t mask) {
+    return (size_t)(((uint64_t)(uintptr_t)node >> 4) * 0x9e3779b97f4a7c15ULL >> 20) & mask;
+}
+
+static void
+_pytricia_node_index_free(pytricia_node_index_t *index) {
+    PyMem_Free(index->nodes);
+    PyMem_Free(index->slots);
+    PyMem_Free(index->ids);
+}
+
+static int
+_pytricia_node_index(PyTricia *self, pytricia_node_index_t *index) {
+    patricia_node_t *node = NULL;
+    size_t size = 16;
+
+    index->count = 0;
+    while (size < 2 * (size_t)self->m_tree->num_active_node) {
+        size *= 2;
+    }
+    index->mask = size - 1;
+    index->nodes = PyMem_Malloc((self->m_tree->num_active_node + 1) * sizeof(*index->nodes));
+    index->slots = PyMem_Calloc(size, sizeof(*index->slots));
+    index->ids = PyMem_Malloc(size * sizeof(*index->ids));
+    if (!index->nodes || !index->slots || !index->ids) {
+        _pytricia_node_index_free(index);
+        PyErr_NoMemory();
+        return -1;
+    }
+    PATRICIA_WALK (self->m_tree->head, node) {
+        size_t h = _pytricia_node_hash(node, index->mask);
+        while (index->slots[h]) {
+            h = (h + 1) & index->mask;
+        }
+        index->slots[h] = node;
+        index->ids[h] = index->count;
+        index->nodes[index->count++] = node;
+    } PATRICIA_WALK_END;
+    return 0;
+}
+
+static Py_ssize_t
+_pytricia_node_id(const pytricia_node_index_t *index, patricia_node_t *node) {
+    size_t h = _pytricia_node_hash(node, index->mask);
+    while (index->slots[h] != node) {
+        h = (h + 1) & index->mask;
+    }
+    return index->ids[h];
+}
+
+#define PYTRICIA_ACCUMULATE_CHUNK 4096
+
+static PyObject*
+pytricia_accumulate(PyTricia *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"keys", "weights", "out", NULL};
+    PyObject *keys = NULL, *weights = NULL, *out = NULL;
+    pytricia_node_index_t index;
+    Py_buffer view = {0};
+    patricia_node_t **found = NULL;
+    unsigned char *hit = NULL;
+    double *totals = NULL, *w = NULL;
+    prefix_t *prefixes = NULL;
+    PyObject *rv = NULL;
+    Py_ssize_t i, n = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO:accumulate", kwlist, &keys, &weights, &out)) {
+        return NULL;
+    }
+    prefixes = _pytricia_parse_batch(self->m_family, keys, &n);
+    if (!prefixes) {
+        return NULL;
+    }
+    w = _pytricia_parse_weights(weights, n);
+    if (!w || _pytricia_node_index(self, &index) < 0) {
+        PyMem_Free(prefixes);
+        PyMem_Free(w);
+        return NULL;
+    }
+
+    if (out && out != Py_None) {
+        if (PyObject_GetBuffer(out, &view, PyBUF_WRITABLE | PyBUF_FORMAT | PyBUF_ND) < 0) {
+            goto done;
+        }
+        int swap = 0;
+        if (view.itemsize != sizeof(double) || _pytricia_buffer_code(view.format, &swap) != 'd' || swap ||
+            view.len / view.itemsize != index.count) {
+            PyErr_Format(PyExc_ValueError, "out must be a buffer of %zd doubles, one per prefix", index.count);
+            goto done;
+        }
+        totals = view.buf;
+    } else if (!(totals = PyMem_Calloc(index.count + 1, sizeof(double)))) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    hit = PyMem_Calloc(index.count + 1, 1);
+    found = PyMem_Malloc(PYTRICIA_ACCUMULATE_CHUNK * sizeof(*found));
+    if (!hit || !found) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    // matches are filtered as the other lookups filter them; expiry times
+    // are plain C data, so that can happen with the GIL released, but
+    // touching entries for CLOCK waits until it's taken back
+    frozen_t *frozen = _pytricia_frozen(self);
+    int hiding = _pytricia_hiding(self);
+    double now = hiding ? _pytricia_now() : 0;
+    self->m_busy++;
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < n; i += PYTRICIA_ACCUMULATE_CHUNK) {
+        Py_ssize_t j, len = n - i < PYTRICIA_ACCUMULATE_CHUNK ? n - i : PYTRICIA_ACCUMULATE_CHUNK;
+        _pytricia_search_chunked(self->m_tree, frozen, prefixes + i, len, found);
+        for (j = 0; j < len; j++) {
+            patricia_node_t *node = hiding ? _pytricia_unexpired(found[j], now) : found[j];
+            if (node) {
+                Py_ssize_t id = _pytricia_node_id(&index, node);
+                totals[id] += w[i + j];
+                hit[id] = 1;
+            }
+        }
+    }
+    Py_END_ALLOW_THREADS
+    self->m_busy--;
+    if (self->m_clock) {
+        for (i = 0; i < index.count; i++) {
+            if (hit[i]) {
+                _pytricia_touch(self, index.nodes[i]);
+            }
+        }
+    }
+
+    if (view.buf) {
+        Py_INCREF(out);
+        rv = out;
+        goto done;
+    }
+    rv = PyDict_New();
+    for (i = 0; rv && i < index.count; i++) {
+        if (hit[i]) {
+            char buffer[64];
+            prefix_toa2x(index.nodes[i]->prefix, buffer, 1);
+            PyObject *total = PyFloat_FromDouble(totals[i]);
+            if (!total || PyDict_SetItemString(rv, buffer, total) < 0) {
+                Py_XDECREF(total);
+                Py_CLEAR(rv);
+                break;
+            }
+            Py_DECREF(total);
+        }
+    }
+
+done:
+    if (view.buf) {
+        PyBuffer_Release(&view);
+    } else {
+        PyMem_Free(totals);
+    }
+    PyMem_Free(hit);
+    PyMem_Free(found);
+    PyMem_Free(prefixes);
+    PyMem_Free(w);
+    _pytricia_node_index_free(&index);
+    return rv;
+}
+
+/*
+ * Address ranges.  A range runs from the first address of its start key to
+ * the last address of its end key, so either end may be a prefix.
+ */
+
+static void
+_u128_to_bytes(int family, u128_t a, u_char *out) {
+    int i;
+    if (family == AF_INET) {
+        for (i = 0; i < 4; i++) {
+            out[i] = (u_char)(a.lo >> (24 - 8 * i));
+        }
+    } else {
+        for (i = 0; i < 8; i++) {
+            out[i] = (u_char)(a.hi >> (56 - 8 * i));
+            out[8 + i] = (u_char)(a.lo >> (56 - 8 * i));
+        }
+    }
+}
+
+static int
+_u128_trailing_zeros(u128_t a) {
+    int n = 0;
+    if (a.lo == 0) {
+        if (a.hi == 0) {
+            return 128;
+        }
+        n = 64;
+        a.lo = a.hi;
+    }
+    while (!(a.lo & 1)) {
+        a.lo >>= 1;
+        n++;
+    }
+    return n;
+}
+
+static int
+_pytricia_range_bounds(prefix_t *start, prefix_t *end, u128_t *first, u128_t *last) {
+    u128_t unused;
+
+    if (start->family != end->family) {
+        PyErr_SetString(PyExc_ValueError, "Range ends must be of the same address family");
+        return -1;
+    }
+    frozen_prefix_range(start, first, &unused);
+    frozen_prefix_range(end, &unused, last);
+    if (u128_cmp(*first, *last) > 0) {
+        PyErr_SetString(PyExc_ValueError, "Range start is after its end");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Cut [first, last] into the fewest CIDR blocks, in address order, filling
+ * in *block with the next one each call.  Returns 0 once the range is used
+ * up.
+ */
+static int
+_pytricia_next_block(int family, u128_t *first, u128_t *last, int *done, prefix_t *block) {
+    int width = family == AF_INET6 ? 128 : 32;
+    int host;
+    u_char addr[16];
+    u128_t end;
+
+    if (*done) {
+        return 0;
+    }
+    host = _u128_trailing_zeros(*first);
+    if (host > width) {
+        host = width;
+    }
+    for (;; host--) {
+        end = *first;
+        if (host >= 64) {
+            end.lo = ~0ULL;
+            end.hi |= host >= 128 ? ~0ULL : (1ULL << (host - 64)) - 1;
+        } else if (host > 0) {
+            end.lo |= (1ULL << host) - 1;
+        }
+        if (u128_cmp(end, *last) <= 0) {
+            break;
+        }
+    }
+    _u128_to_bytes(family, *first, addr);
+    New_Prefix2(family, addr, width - host, block);
+    if (u128_cmp(end, *last) == 0) {
+        *done = 1;
+    } else {
+        *first = u128_inc(end);
+    }
+    return 1;
+}
+
+static Py_ssize_t
+_pytricia_insert_range(PyTricia *self, prefix_t *start, prefix_t *end, PyObject *value) {
+    u128_t first, last;
+    prefix_t block;
+    Py_ssize_t count = 0;
+    int done = 0;
+
+    if (_pytricia_range_bounds(start, end, &first, &last) < 0) {
+        return -1;
+    }
+    while (_pytricia_next_block(start->family, &first, &last, &done, &block)) {
+        if (_pytricia_insert_prefix(self, &block, value, -1.0) < 0) {
+            return -1;
+        }
+        count++;
+    }
+    return count;
+}
+
+static PyObject*
+pytricia_insert_range(PyTricia *self, PyObject *args) {
+    PyObject *start = NULL, *end = NULL, *value = NULL;
+
+    if (!PyArg_ParseTuple(args, "OOO:insert_range", &start, &end, &value)) {
+        return NULL;
+    }
+    if (_pytricia_check_busy(self) < 0) {
+        return NULL;
+    }
+    prefix_t *first = _key_object_to_prefix(start);
+    prefix_t *last = first ? _key_object_to_prefix(end) : NULL;
+    if (!last) {
+        if (first) {
+            Deref_Prefix(first);
+        }
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        }
+        return NULL;
+    }
+    Py_ssize_t count = _pytricia_insert_range(self, first, last, value);
+    Deref_Prefix(first);
+    Deref_Prefix(last);
+    return count < 0 ? NULL : PyLong_FromSsize_t(count);
+}
+
+static PyObject*
+pytricia_load_ranges(PyTricia *self, PyObject *args) {
+    PyObject *starts = NULL, *ends = NULL, *values = NULL;
+    prefix_t *first = NULL, *last = NULL;
+    PyObject *seq = NULL, *rv = NULL;
+    Py_ssize_t i, n = 0, nends = 0, total = 0;
+
+    if (!PyArg_ParseTuple(args, "OOO:load_ranges", &starts, &ends, &values)) {
+        return NULL;
+    }
+    if (_pytricia_check_busy(self) < 0) {
+        return NULL;
+    }
+    first = _pytricia_parse_batch(self->m_family, starts, &n);
+    last = first ? _pytricia_parse_batch(self->m_family, ends, &nends) : NULL;
+    seq = last ? PySequence_Fast(values, "Values must be an iterable") : NULL;
+    if (!seq) {
+        goto done;
+    }
+    if (nends != n || PySequence_Fast_GET_SIZE(seq) != n) {
+        PyErr_SetString(PyExc_ValueError, "Need as many ends and values as starts");
+        goto done;
+    }
+    for (i = 0; i < n; i++) {
+        Py_ssize_t count = _pytricia_insert_range(self, &first[i], &last[i], PySequence_Fast_GET_ITEM(seq, i));
+        if (count < 0) {
+            goto done;
+        }
+        total += count;
+    }
+    rv = PyLong_FromSsize_t(total);
+
+done:
+    Py_XDECREF(seq);
+    PyMem_Free(first);
+    PyMem_Free(last);
+    return rv;
+}
+
+static PyObject *
+_pytricia_u128_to_str(int family, u128_t a);
+
+// (first, last, prefix or None)
+static int
+_pytricia_append_segment(PyObject *rvlist, int family, u128_t first, u128_t last, patricia_node_t *node) {
+    char buffer[64];
+    PyObject *match = Py_None;
+
+    if (node) {
+        prefix_toa2x(node->prefix, buffer, 1);
+        match = PyUnicode_FromString(buffer);
+    } else {
+        Py_INCREF(match);
+    }
+    PyObject *item = Py_BuildValue("(NNN)", _pytricia_u128_to_str(family, first),
+                                   _pytricia_u128_to_str(family, last), match);
+    int rv = item ? PyList_Append(rvlist, item) : -1;
+    Py_XDECREF(item);
+    return rv;
+}
+
+static PyObject *
+_pytricia_u128_to_str(int family, u128_t a) {
+    char buffer[64];
+    u_char addr[16];
+    prefix_t prefix;
+
+    _u128_to_bytes(family, a, addr);
+    New_Prefix2(family, addr, -1, &prefix);
+    prefix_toa2x(&prefix, buffer, 0);
+    return PyUnicode_FromString(buffer);
+}
+
+static PyObject*
+pytricia_segment(PyTricia *self, PyObject *args) {
+    PyObject *start = NULL, *end = NULL;
+    PyObject *rvlist = NULL;
+    patricia_node_t *current = NULL;
+    u128_t first, last, from;
+    prefix_t block;
+    int done = 0, family;
+
+    if (!PyArg_ParseTuple(args, "OO:segment", &start, &end)) {
+        return NULL;
+    }
+    prefix_t *pstart = _key_object_to_prefix(start);
+    prefix_t *pend = pstart ? _key_object_to_prefix(end) : NULL;
+    if (!pend) {
+        if (pstart) {
+            Deref_Prefix(pstart);
+        }
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        }
+        return NULL;
+    }
+    family = pstart->family;
+    int rv = _pytricia_range_bounds(pstart, pend, &first, &last);
+    Deref_Prefix(pstart);
+    Deref_Prefix(pend);
+    if (rv < 0 || !(rvlist = PyList_New(0))) {
+        return NULL;
+    }
+
+    /*
+     * The runs of each block of the range, concatenated, partition it; a
+     * segment ends where the next one with a different match starts.
+     */
+    u128_t end_all = last;
+    from = first;
+    while (_pytricia_next_block(family, &first, &last, &done, &block)) {
+        frozen_interval_t *runs = NULL;
+        long i, nruns = frozen_flatten(self->m_tree, family, &block, &runs);
+        if (nruns < 0) {
+            Py_DECREF(rvlist);
+            return PyErr_NoMemory();
+        }
+        for (i = 0; i < nruns; i++) {
+            if (u128_cmp(runs[i].start, from) == 0) {
+                current = runs[i].node;
+            } else if (runs[i].node != current) {
+                u128_t to = runs[i].start;
+                if (to.lo-- == 0) {
+                    to.hi--;
+                }
+                if (_pytricia_append_segment(rvlist, family, from, to, current) < 0) {
+                    free(runs);
+                    Py_DECREF(rvlist);
+                    return NULL;
+                }
+                from = runs[i].start;
+                current = runs[i].node;
+            }
+        }
+        free(runs);
+    }
+    if (_pytricia_append_segment(rvlist, family, from, end_all, current) < 0) {
+        Py_DECREF(rvlist);
+        return NULL;
+    }
+    return rvlist;
+}
+
+typedef struct {
+    u128_t first, last;
+    PyObject *value;
+} pytricia_range_t;
+
+static PyObject*
+pytricia_to_ranges(PyTricia *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"merge", "family", NULL};
+    PyObject *merge = Py_False, *rv = NULL;
+    PyObject *starts = NULL, *ends = NULL, *values = NULL;
+    frozen_interval_t *runs = NULL;
+    pytricia_range_t *ranges = NULL;
+    long i, nruns, n = 0;
+    int family = self->m_family;
+    u128_t top = {0, 0xffffffffULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Oi:to_ranges", kwlist, &merge, &family)) {
+        return NULL;
+    }
+    if (family != AF_INET && family != AF_INET6) {
+        PyErr_SetString(PyExc_ValueError, "Invalid address family");
+        return NULL;
+    }
+    if (family == AF_INET6) {
+        top.hi = top.lo = ~(uint64_t)0;
+    }
+    nruns = frozen_flatten(self->m_tree, family, NULL, &runs);
+    if (nruns < 0) {
+        return PyErr_NoMemory();
+    }
+
+    // hold on to every value before comparing any, since that runs Python code
+    ranges = PyMem_Malloc((nruns ? nruns : 1) * sizeof(*ranges));
+    if (!ranges) {
+        free(runs);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < nruns; i++) {
+        if (!runs[i].node) {
+            continue;
+        }
+        ranges[n].first = runs[i].start;
+        if (i + 1 < nruns) {
+            ranges[n].last = runs[i + 1].start;
+            if (ranges[n].last.lo-- == 0) {
+                ranges[n].last.hi--;
+            }
+        } else {
+            ranges[n].last = top;
+        }
+        ranges[n].value = (PyObject *)runs[i].node->data;
+        Py_INCREF(ranges[n].value);
+        n++;
+    }
+    free(runs);
+
+    if (PyObject_IsTrue(merge)) {
+        long kept = 0;
+        for (i = 0; i < n; i++) {
+            if (kept > 0 && u128_cmp(u128_inc(ranges[kept - 1].last), ranges[i].first) == 0) {
+                int same = PyObject_RichCompareBool(ranges[kept - 1].value, ranges[i].value, Py_EQ);
+                if (same < 0) {
+                    n = kept + (n - i);
+                    memmove(&ranges[kept], &ranges[i], (n - kept) * sizeof(*ranges));
+                    goto done;
+                }
+                if (same) {
+                    ranges[kept - 1].last = ranges[i].last;
+                    Py_DECREF(ranges[i].value);
+                    continue;
+                }
+            }
+            ranges[kept++] = ranges[i];
+        }
+        n = kept;
+    }
+
+    if (!(starts = PyList_New(n)) || !(ends = PyList_New(n)) || !(values = PyList_New(n))) {
+        goto done;
+    }
+    for (i = 0; i < n; i++) {
+        PyObject *first = _pytricia_u128_to_str(family, ranges[i].first);
+        PyObject *last = _pytricia_u128_to_str(family, ranges[i].last);
+        if (!first || !last) {
+            Py_XDECREF(first);
+            Py_XDECREF(last);
+            goto done;
+        }
+        PyList_SET_ITEM(starts, i, first);
+        PyList_SET_ITEM(ends, i, last);
+        Py_INCREF(ranges[i].value);
+        PyList_SET_ITEM(values, i, ranges[i].value);
+    }
+    rv = Py_BuildValue("(OOO)", starts, ends, values);
+
+done:
+    for (i = 0; i < n; i++) {
+        Py_DECREF(ranges[i].value);
+    }
+    PyMem_Free(ranges);
+    Py_XDECREF(starts);
+    Py_XDECREF(ends);
+    Py_XDECREF(values);
+    return rv;
+}
+
+/*
+ * Address counts.  These are u128_t's taken modulo 2^128, so the whole IPv6
+ * space wraps around to zero; callers tell it apart from an empty count.
+ */
+
+static u128_t
+_u128_add(u128_t a, u128_t b) {
+    a.lo += b.lo;
+    a.hi += b.hi + (a.lo < b.lo);
+    return a;
+}
+
+static u128_t
+_u128_sub(u128_t a, u128_t b) {
+    u128_t d;
+    d.lo = a.lo - b.lo;
+    d.hi = a.hi - b.hi - (a.lo < b.lo);
+    return d;
+}
+
+static PyObject *
+_u128_to_long(u128_t a, int wrapped) {
+    PyObject *hi, *shift, *lo, *rv = NULL;
+
+    if (wrapped) {
+        a.hi = 1;
+        a.lo = 0;
+        shift = PyLong_FromLong(128);
+    } else {
+        shift = PyLong_FromLong(64);
+    }
+    hi = PyLong_FromUnsignedLongLong(a.hi);
+    lo = PyLong_FromUnsignedLongLong(a.lo);
+    if (hi && lo && shift) {
+        PyObject *high = PyNumber_Lshift(hi, shift);
+        if (high) {
+            rv = wrapped ? high : PyNumber_Or(high, lo);
+            if (rv != high) {
+                Py_DECREF(high);
+            }
+        }
+    }
+    Py_XDECREF(hi);
+    Py_XDECREF(lo);
+    Py_XDECREF(shift);
+    return rv;
+}
+
+/*
+ * Post-order: the addresses covered by prefixes of family at or below node,
+ * in *covered.  Each prefix keeps what the prefixes below it don't take,
+ * which is added to its value's count if counts isn't NULL.  Returns 1 if
+ * there was any such prefix, 0 if not and -1 on error.
+ */
+static int
+_pytricia_cover(patricia_node_t *node, int family, PyObject *counts, u128_t *covered) {
+    u128_t below = {0, 0}, part;
+    int any = 0, rv;
+
+    covered->hi = covered->lo = 0;
+    if (!node) {
+        return 0;
+    }
+    if ((rv = _pytricia_cover(node->l, family, counts, &part)) < 0) {
+        return -1;
+    }
+    below = _u128_add(below, part);
+    any |= rv;
+    if ((rv = _pytricia_cover(node->r, family, counts, &part)) < 0) {
+        return -1;
+    }
+    below = _u128_add(below, part);
+    any |= rv;
+
+    // glue, or a prefix of the other family, only passes its children on
+    if (!node->prefix || node->prefix->family != family) {
+        *covered = below;
+        return any;
+    }
+    u_int host = (family == AF_INET6 ? 128 : 32) - node->prefix->bitlen;
+    u128_t size = {0, 0};
+    if (host < 64) {
+        size.lo = (uint64_t)1 << host;
+    } else if (host < 128) {
+        size.hi = (uint64_t)1 << (host - 64);
+    }
+    if (counts) {
+        u128_t own = _u128_sub(size, below);
+        PyObject *value = (PyObject *)node->data;
+        PyObject *add = _u128_to_long(own, host == 128 && !any);
+        PyObject *sum = NULL, *prev = add ? PyDict_GetItem(counts, value) : NULL;
+        if (add) {
+            sum = prev ? PyNumber_Add(prev, add) : add;
+            if (sum == add) {
+                Py_INCREF(sum);
+            }
+        }
+        rv = sum ? PyDict_SetItem(counts, value, sum) : -1;
+        Py_XDECREF(add);
+        Py_XDECREF(sum);
+        if (rv < 0) {
+            return -1;
+        }
+    }
+    *covered = size;
+    return 1;
+}
+
+static PyObject*
+pytricia_coverage(PyTricia *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"by_value", "family", NULL};
+    PyObject *by_value = Py_False, *counts = NULL, *total;
+    int family = self->m_family, any;
+    u128_t covered;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Oi:coverage", kwlist, &by_value, &family)) {
+        return NULL;
+    }
+    if (family != AF_INET && family != AF_INET6) {
+        PyErr_SetString(PyExc_ValueError, "Invalid address family");
+        return NULL;
+    }
+    if (PyObject_IsTrue(by_value) && !(counts = PyDict_New())) {
+        return NULL;
+    }
+    // the values' __hash__ and __eq__ may run Python code that changes the tree
+    self->m_busy++;
+    any = _pytricia_cover(self->m_tree->head, family, counts, &covered);
+    self->m_busy--;
+    if (any < 0) {
+        Py_XDECREF(counts);
+        return NULL;
+    }
+    total = _u128_to_long(covered, any && covered.hi == 0 && covered.lo == 0);
+    if (!counts || !total) {
+        Py_XDECREF(counts);
+        return total;
+    }
+    return Py_BuildValue("(NN)", total, counts);
+}
+
+static const struct {
+    const char *name;
+    int kind;
+} pytricia_engines[] = {
+    {"flat", FROZEN_FLAT},
+    {"interval", FROZEN_INTERVAL},
+    {"poptrie", FROZEN_POPTRIE},
+    {"native", FROZEN_NATIVE},
+    {"auto", PYTRICIA_AUTO},
+    {NULL, 0}
+};
+
+static void
+_pytricia_stop_auto(PyTricia *self) {
+    PyMem_Free(self->m_samples);
+    self->m_samples = NULL;
+    self->m_nsamples = 0;
+    self->m_auto = 0;
+}
+
+static PyObject*
+pytricia_freeze(PyTricia *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"engine", "lookup", "signature", NULL};
+    const char *engine = "flat";
+    PyObject *lookup = NULL, *signature = NULL;
+    frozen_t *frozen;
+    int i, kind = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|sOO:freeze", kwlist, &engine, &lookup, &signature)) {
+        return NULL;
+    }
+    if (_pytricia_check_busy(self) < 0) {
+        return NULL;
+    }
+    for (i = 0; pytricia_engines[i].name; i++) {
+        if (strcmp(engine, pytricia_engines[i].name) == 0) {
+            kind = pytricia_engines[i].kind;
+        }
+    }
+    if (!kind) {
+        PyErr_Format(PyExc_ValueError, "Unknown lookup engine '%s'", engine);
+        return NULL;
+    }
+    if (frozen_tree_family(self->m_tree) < 0) {
+        PyErr_SetString(PyExc_ValueError, "Can't freeze a table holding both IPv4 and IPv6 prefixes");
+        return NULL;
+    }
+    if ((kind == FROZEN_NATIVE) != (lookup != NULL) || (kind == FROZEN_NATIVE) != (signature != NULL)) {
+        PyErr_SetString(PyExc_ValueError, "The 'native' engine, and only it, needs a lookup function address and its signature");
+        return NULL;
+    }
+
+    if (kind == FROZEN_NATIVE) {
+        uint64_t expected;
+        unsigned long long given = PyLong_AsUnsignedLongLong(signature);
+        void *fn;
+        if (given == (unsigned long long)-1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (frozen_signature(self->m_tree, &expected) < 0) {
+            return PyErr_NoMemory();
+        }
+        if (given != expected) {
+            PyErr_SetString(PyExc_ValueError, "The lookup function was emitted for a different set of prefixes");
+            return NULL;
+        }
+        fn = PyLong_AsVoidPtr(lookup);
+        if (!fn) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_ValueError, "Lookup function address can't be 0");
+            }
+            return NULL;
+        }
+        frozen = frozen_native(self->m_tree, (frozen_lookup_fn)fn);
+    } else if (kind == PYTRICIA_AUTO) {
+        if (!self->m_samples) {
+            self->m_samples = PyMem_Malloc(PYTRICIA_SAMPLES * sizeof(prefix_t));
+            self->m_nsamples = 0;
+            if (!self->m_samples) {
+                return PyErr_NoMemory();
+            }
+        }
+        frozen = _pytricia_build_best(self);
+    } else {
+        frozen = frozen_build(self->m_tree, kind);
+    }
+    if (!frozen) {
+        return PyErr_NoMemory();
+    }
+    if (!self->m_pending) {
+        self->m_pending = PyMem_Malloc(PYTRICIA_PENDING * sizeof(prefix_t));
+        if (!self->m_pending) {
+            frozen_free(frozen);
+            return PyErr_NoMemory();
+        }
+    }
+    self->m_npending = 0;
+    if (kind != PYTRICIA_AUTO) {
+        _pytricia_stop_auto(self);
+    }
+    frozen_free(self->m_frozen);
+    self->m_frozen = frozen;
+    self->m_frozen_gen = self->m_gen;
+    self->m_engine = frozen_kind(frozen);
+    self->m_auto = kind == PYTRICIA_AUTO;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytricia_emit_c(PyTricia *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"name", NULL};
+    const char *name = "pytricia_lookup";
+    const char *p;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|s:emit_c", kwlist, &name)) {
+        return NULL;
+    }
+    for (p = name; *p; p++) {
+        if (!(Py_ISALPHA(*p) || *p == '_' || (p > name && Py_ISDIGIT(*p)))) {
+            break;
+        }
+    }
+    if (p == name || *p) {
+        PyErr_Format(PyExc_ValueError, "'%s' isn't a valid C identifier", name);
+        return NULL;
+    }
+    if (frozen_tree_family(self->m_tree) < 0) {
+        PyErr_SetString(PyExc_ValueError, "Can't compile a table holding both IPv4 and IPv6 prefixes");
+        return NULL;
+    }
+
+    char *source = frozen_emit_c(self->m_tree, name);
+    if (!source) {
+        return PyErr_NoMemory();
+    }
+    PyObject *rv = PyUnicode_FromString(source);
+    free(source);
+    return rv;
+}
+
+static PyObject*
+pytricia_thaw(PyTricia *self, PyObject *unused) {
+    if (_pytricia_check_busy(self) < 0) {
+        return NULL;
+    }
+    frozen_free(self->m_frozen);
+    self->m_frozen = NULL;
+    self->m_engine = 0;
+    _pytricia_stop_auto(self);
+    PyMem_Free(self->m_pending);
+    self->m_pending = NULL;
+    self->m_npending = 0;
+    Py_RETURN_NONE;
+}
+
+/*
+ * Shape of the table: prefix counts by family and length, glue nodes, the
+ * depth of the tree, the number of structural changes so far and the
+ * lookup engine in use.
+ */
+static PyObject*
+pytricia_stats(PyTricia *self, PyObject *unused) {
+    patricia_node_t *stack[PATRICIA_MAXBITS + 1];
+    int depths[PATRICIA_MAXBITS + 1];
+    Py_ssize_t counts[PATRICIA_MAXBITS + 1] = {0};
+    Py_ssize_t prefixes = 0, nodes = 0, ipv4 = 0, ipv6 = 0;
+    patricia_node_t *node = self->m_tree->head;
+    const char *engine = NULL;
+    int sp = 0, depth = 1, maxdepth = 0, i;
+
+    while (node) {
+        nodes++;
+        if (depth > maxdepth) {
+            maxdepth = depth;
+        }
+        if (node->prefix) {
+            prefixes++;
+            ipv4 += node->prefix->family == AF_INET;
+            ipv6 += node->prefix->family == AF_INET6;
+            counts[node->prefix->bitlen <= PATRICIA_MAXBITS ? node->prefix->bitlen : PATRICIA_MAXBITS]++;
+        }
+        if (node->l) {
+            if (node->r) {
+                stack[sp] = node->r;
+                depths[sp++] = depth + 1;
+            }
+            node = node->l;
+            depth++;
+        } else if (node->r) {
+            node = node->r;
+            depth++;
+        } else if (sp) {
+            node = stack[--sp];
+            depth = depths[sp];
+        } else {
+            node = NULL;
+        }
+    }
+
+    for (i = 0; pytricia_engines[i].name; i++) {
+        if (self->m_engine && pytricia_engines[i].kind == self->m_engine) {
+            engine = pytricia_engines[i].name;
+        }
+    }
+
+    PyObject *lengths = PyDict_New();
+    if (!lengths) {
+        return NULL;
+    }
+    for (i = 0; i <= PATRICIA_MAXBITS; i++) {
+        if (counts[i]) {
+            PyObject *key = PyLong_FromLong(i);
+            PyObject *value = PyLong_FromSsize_t(counts[i]);
+            int rv = key && value ? PyDict_SetItem(lengths, key, value) : -1;
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            if (rv < 0) {
+                Py_DECREF(lengths);
+                return NULL;
+            }
+        }
+    }
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:N,s:i,s:k,s:s,s:O,s:n,s:n}",
+                         "prefixes", prefixes, "nodes", nodes, "glue", nodes - prefixes,
+                         "ipv4", ipv4, "ipv6", ipv6, "lengths", lengths, "depth", maxdepth,
+                         "changes", self->m_gen, "engine", engine,
+                         "auto", self->m_auto ? Py_True : Py_False,
+                         "expiring", (Py_ssize_t)(self->m_wheel ? wheel_count(self->m_wheel) : 0),
+                         "evictions", (Py_ssize_t)self->m_evictions);
+}
+
+static PyMappingMethods pytricia_as_mapping = {
+    (lenfunc)pytricia_length,
+    (binaryfunc)pytricia_subscript,
+    (objobjargproc)pytricia_assign_subscript
+};
+
+static PySequenceMethods pytricia_as_sequence = {
+       (lenfunc)pytricia_length,               /*sq_length*/
+       0,              /*sq_concat*/
+       0,                      /*sq_repeat*/
+       0,                      /*sq_item*/
+       0,                      /*sq_slice*/
+       0,                      /*sq_ass_item*/
+       0,                  /*sq_ass_slice*/
+       (objobjproc)pytricia_contains,               /*sq_contains*/
+       0,                  /*sq_inplace_concat*/
+       0                   /*sq_inplace_repeat*/
+};
+
+// forward declaration
+static PyObject*
+pytricia_iter(register PyTricia *, PyObject *);
+
+
+static PyMethodDef pytricia_methods[] = {
+    {"has_key",   (PyCFunction)pytricia_has_key, METH_VARARGS, "has_key(prefix) -> boolean\nReturn true iff prefix is in tree.  Note that this method checks for an *exact* match with the prefix.\nUse the 'in' operator if you want to test whether a given address is contained within some prefix."},
+    {"keys",   (PyCFunction)pytricia_keys, METH_NOARGS, "keys() -> list\nReturn a list of all prefixes in the tree."},
+    {"get", (PyCFunction)pytricia_get, METH_VARARGS, "get(prefix, [default]) -> object\nReturn value associated with prefix."},
+    {"get_key", (PyCFunction)pytricia_get_key, METH_VARARGS, "get_key(prefix) -> prefix\nReturn key associated with prefix (longest matching prefix)."},
+    {"delete", (PyCFunction)pytricia_delitem, METH_VARARGS, "delete(prefix) -> \nDelete mapping associated with prefix.\n"},
+    {"delete_subtree", (PyCFunction)pytricia_delete_subtree, METH_VARARGS, "delete_subtree(prefix) -> int\nDelete the prefix, if it's in the tree, and every more specific prefix; returns how many were deleted."},
+    {"prune", (PyCFunction)pytricia_prune, METH_VARARGS | METH_KEYWORDS, "prune(predicate=None, values=None, within=None) -> int\nDelete every entry whose value satisfies predicate(value), or is in the container values, optionally only those inside the prefix within; returns how many were deleted."},
+    {"keys_for", (PyCFunction)pytricia_keys_for, METH_VARARGS, "keys_for(value) -> list\nReturn the prefixes mapped to value, in sorted order."},
+    {"count_for", (PyCFunction)pytricia_count_for, METH_VARARGS, "count_for(value) -> int\nReturn how many prefixes are mapped to value."},
+    {"keys_for_many", (PyCFunction)pytricia_keys_for_many, METH_VARARGS, "keys_for_many(values) -> list\nReturn keys_for(value) for each of the values."},
+    {"count_for_many", (PyCFunction)pytricia_count_for_many, METH_VARARGS, "count_for_many(values) -> list\nReturn count_for(value) for each of the values."},
+    {"root_hash", (PyCFunction)pytricia_root_hash, METH_NOARGS, "root_hash() -> int\nReturn a 64-bit hash of every (prefix, value) in the tree; trees with the same contents have the same hash, on any host."},
+    {"subtree_hash", (PyCFunction)pytricia_subtree_hash, METH_VARARGS, "subtree_hash(prefix) -> int\nReturn the hash of the entries inside prefix, as root_hash() does for the whole tree."},
+    {"diff", (PyCFunction)pytricia_diff, METH_VARARGS, "diff(other) -> (only_here, only_there, changed)\nCompare the tree with another by their subtree hashes, looking only into parts that differ.  Returns three lists of prefixes: those only in this tree, those only in other, and those in both with different values."},
+    {"at", (PyCFunction)pytricia_at, METH_VARARGS, "at([when]) -> snapshot\nReturn a read-only view of the table as it was at a version (an int) or a time (a float, as time.time() gives), or now if when isn't given.  Needs a table created with history=N; raises KeyError if the version is no longer kept."},
+    {"versions", (PyCFunction)pytricia_versions, METH_NOARGS, "versions() -> list\nReturn the (version, time) of every version kept, oldest first.  Each call that changes the table makes one version."},
+    {"insert", (PyCFunction)pytricia_insert, METH_VARARGS | METH_KEYWORDS, "insert(prefix, data, ttl=None) -> data\nCreate mapping between prefix and data in tree.  With a ttl, the mapping expires that many seconds from now."},
+    {"expire", (PyCFunction)pytricia_expire, METH_VARARGS, "expire([now]) -> int\nRemove every mapping whose ttl ran out by now (time.time() if not given), and return how many there were."},
+    {"insert_range", (PyCFunction)pytricia_insert_range, METH_VARARGS, "insert_range(start, end, data) -> int\nMap every address from start to end, inclusive, to data by inserting the fewest prefixes that cover exactly that range; returns how many."},
+    {"load_ranges", (PyCFunction)pytricia_load_ranges, METH_VARARGS, "load_ranges(starts, ends, values) -> int\ninsert_range for each (start, end, value); starts and ends take the same forms as get_many keys.  Returns the number of prefixes inserted."},
+    {"segment", (PyCFunction)pytricia_segment, METH_VARARGS, "segment(start, end) -> list\nPartition the addresses from start to end into runs that share a longest matching prefix, as (first, last, prefix) tuples; prefix is None where nothing matches."},
+    {"to_ranges", (PyCFunction)pytricia_to_ranges, METH_VARARGS | METH_KEYWORDS, "to_ranges(merge=False, family=None) -> (starts, ends, values)\nFlatten the tree into disjoint address ranges, each with the value of its longest matching prefix, as three parallel lists in address order; addresses nothing matches are left out.  With merge set, adjacent ranges with equal values are joined.  family defaults to the table's."},
+    {"coverage", (PyCFunction)pytricia_coverage, METH_VARARGS | METH_KEYWORDS, "coverage(by_value=False, family=None) -> int\nCount the addresses the tree's prefixes cover.  With by_value set, return (total, counts), where counts maps each value to the addresses whose longest match has that value.  family defaults to the table's."},
+    {"children", (PyCFunction)pytricia_children, METH_VARARGS, "children(prefix) -> list\nReturn a list of all prefixes that are more specific than the given prefix (the prefix must be present as an exact match)."},
+    {"parent", (PyCFunction)pytricia_parent, METH_VARARGS, "parent(prefix) -> prefix\nReturn the immediate parent of the given prefix (the prefix must be present as an exact match)."},
+    {"next_prefix", (PyCFunction)pytricia_next_prefix, METH_VARARGS, "next_prefix(prefix) -> (prefix, data)\nReturn the stored prefix that follows the given one in keys() order (by address, then length), or None.  The given prefix need not be in the tree."},
+    {"prev_prefix", (PyCFunction)pytricia_prev_prefix, METH_VARARGS, "prev_prefix(prefix) -> (prefix, data)\nReturn the stored prefix that precedes the given one in keys() order, or None."},
+    {"floor", (PyCFunction)pytricia_floor, METH_VARARGS, "floor(addr) -> (prefix, data)\nReturn the stored prefix with the highest network address at or below addr (the longest, if several start there), or None."},
+    {"ceiling", (PyCFunction)pytricia_ceiling, METH_VARARGS, "ceiling(addr) -> (prefix, data)\nReturn the stored prefix with the lowest network address at or above addr (the shortest, if several start there), or None."},
+    {"first", (PyCFunction)pytricia_first, METH_NOARGS, "first() -> (prefix, data)\nReturn the first prefix in keys() order, or None if the tree is empty."},
+    {"last", (PyCFunction)pytricia_last, METH_NOARGS, "last() -> (prefix, data)\nReturn the last prefix in keys() order, or None if the tree is empty."},
+    {"find_free", (PyCFunction)pytricia_find_free, METH_VARARGS | METH_KEYWORDS, "find_free(length, within=None) -> prefix\nReturn the lowest-addressed block of the given prefix length inside within (default: the whole address space) that overlaps no prefix in the tree, or None."},
+    {"conflicts", (PyCFunction)pytricia_conflicts, METH_VARARGS | METH_KEYWORDS, "conflicts(first=False) -> (outer, inner)\nFind every pair of prefixes in the tree where one contains the other, as two parallel lists of indices into keys(); with first set, return only the first pair as a tuple, or None."},
+    {"join", (PyCFunction)pytricia_join, METH_VARARGS | METH_KEYWORDS, "join(other, mode='best') -> (prefixes, matches, values)\nFor every prefix in the tree, find the longest prefix of other that contains it, or with mode 'all' every one, in one merged walk of both trees.  Returns three parallel lists: the prefix, the matching prefix of other and its value; in 'best' mode, prefixes nothing in other contains get None for both."},
+    {"get_many", (PyCFunction)pytricia_get_many, METH_VARARGS, "get_many(keys, [default]) -> list\nReturn the value associated with the longest matching prefix of each key.\nkeys may be an iterable of keys, a buffer of 32-bit integers (IPv4), or a buffer of packed addresses (4 bytes each, or 16 for an AF_INET6 table)."},
+    {"accumulate", (PyCFunction)pytricia_accumulate, METH_VARARGS | METH_KEYWORDS, "accumulate(keys, weights=None, out=None) -> dict\nSum a weight (default 1) for each key into its longest matching prefix, releasing the GIL while it runs.\nReturns a dict of totals by prefix, or adds into out, a writable buffer of doubles indexed like keys(), and returns it.\nThe table can't be changed until the call returns."},
+    {"freeze", (PyCFunction)pytricia_freeze, METH_VARARGS | METH_KEYWORDS, "freeze(engine='flat') -> \nCompile the tree into a read-optimized lookup structure used by get, get_key, [], in and get_many.\nThe structure is brought up to date on the next lookup after the set of prefixes changes; poptrie patches only the blocks that changed.\nengine='auto' builds and times each engine on recently looked-up addresses and keeps the fastest, which takes milliseconds on a large table; after churn of about half the table, the next change to it pays that cost again to re-pick.\nengine='native' uses a compiled emit_c() function whose address is given as lookup, along with the value of its name_signature; it is dropped once the set of prefixes changes."},
+    {"emit_c", (PyCFunction)pytricia_emit_c, METH_VARARGS | METH_KEYWORDS, "emit_c(name='pytricia_lookup') -> str\nReturn C source for a function int name(const unsigned char *addr) that maps a packed host address to the position of its longest matching prefix in keys(), or -1, and a uint64_t name_signature identifying the prefixes it was emitted for."},
+    {"thaw", (PyCFunction)pytricia_thaw, METH_NOARGS, "thaw() -> \nDrop the compiled lookup structure built by freeze()."},
+    {"stats", (PyCFunction)pytricia_stats, METH_NOARGS, "stats() -> dict\nReturn the shape of the table: prefix counts by family and length, nodes, glue nodes, tree depth, structural changes so far, the lookup engine in use, entries with a ttl and entries evicted so far."},
+    {NULL,              NULL}           /* sentinel */
+};
+
+static PyObject*
+pytriciaiter_iter(PyTricia *self)
+{
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject*
+pytriciaiter_next(PyTriciaIter *iter)
+{
+    while (1) {
+        iter->m_Xnode = iter->m_Xrn;
+        if (iter->m_Xnode) {
+            // advance the iterator; copied from patricia.h macros
+            if (iter->m_Xrn->l) { 
+                if (iter->m_Xrn->r) { 
+                    *(iter->m_Xsp)++ = iter->m_Xrn->r; 
+                } 
+                iter->m_Xrn = iter->m_Xrn->l; 
+            } else if (iter->m_Xrn->r) { 
+                iter->m_Xrn = iter->m_Xrn->r; 
+            } else if (iter->m_Xsp != iter->m_Xstack) { 
+                iter->m_Xrn = *(--iter->m_Xsp); 
+            } else { 
+                iter->m_Xrn = (patricia_node_t *) 0; 
+            } 
+
+            if (iter->m_Xnode->prefix) {
+                /* build Python value to hand back */
+                char buffer[64];
+                prefix_toa2x(iter->m_Xnode->prefix, buffer, 1);
+                PyObject *rv = Py_BuildValue("s", buffer);
+                return rv;
+            } 
+        } else {
+            PyErr_SetNone(PyExc_StopIteration);
+            return NULL;
+        }
+    }
+    // should NEVER get here...
+    assert(NULL);
+    return NULL;
+}
+
+static void
+pytriciaiter_dealloc(PyTriciaIter *iterobj)
+{
+    if (iterobj->m_Xstack) {
+        free(iterobj->m_Xstack);
+    }
+    Py_DECREF(iterobj->m_parent);
+    Py_TYPE(iterobj)->tp_free((PyObject*)iterobj);    
+}
+
+static PyTypeObject PyTriciaType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pytricia.PyTricia",       /*tp_name*/
+    sizeof(PyTricia),          /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)pytricia_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    &pytricia_as_sequence,     /*tp_as_sequence*/
+    &pytricia_as_mapping,      /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
+    "PyTricia objects",        /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    0,		               /* tp_weaklistoffset */
+    (getiterfunc)pytricia_iter,	/* tp_iter */
+    0,		               /* tp_iternext */
+    pytricia_methods,          /* tp_methods */
+    0,                         /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)pytricia_init,   /* tp_init */
+    0,                         /* tp_alloc */
+    pytricia_new,              /* tp_new */
+};
+
+static PyTypeObject PyTriciaIterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pytricia.PyTriciaIter",                /* tp_name */
+    sizeof(PyTriciaIter),                   /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    /* methods */
+    (destructor)pytriciaiter_dealloc,       /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+#if PY_MAJOR_VERSION >= 3
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+#else
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_ITER, /* tp_flags */
+#endif
+    "Internal PyTricia iter object",        /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    (getiterfunc)pytriciaiter_iter,         /* tp_iter */
+    (iternextfunc)pytriciaiter_next,        /* tp_iternext */
+    0,                                      /* tp_methods */
+};
+
+static PyObject*
+pytricia_iter(register PyTricia *self, PyObject *unused)
+{
+    PyTriciaIter *iterobj = PyObject_New(PyTriciaIter, &PyTriciaIterType);
+    if (!iterobj) {
+        return NULL;
+    }
+
+    if (!PyObject_Init((PyObject*)iterobj, &PyTriciaIterType)) {
+        Py_XDECREF(iterobj);
+        return NULL;
+    }
+
+    Py_INCREF(self);
+    iterobj->m_parent = self;
+
+    iterobj->m_tree = self->m_tree;
+    iterobj->m_Xnode = NULL;
+    iterobj->m_Xhead = iterobj->m_tree->head;
+    iterobj->m_Xstack = (patricia_node_t**) malloc(sizeof(patricia_node_t*)*(PATRICIA_MAXBITS+1));
+    if (!iterobj->m_Xstack) {
+        Py_DECREF(iterobj->m_parent);
+        Py_TYPE(iterobj)->tp_free((PyObject*)iterobj);
+        return PyErr_NoMemory();
+    }
+ 
+    iterobj->m_Xsp = iterobj->m_Xstack;
+    iterobj->m_Xrn = iterobj->m_Xhead;
+    return (PyObject*)iterobj;
+}
+
+/*
+ * PyTriciaHHH: streaming hierarchical heavy hitters (see hhh.h).
+ */
+
+typedef struct {
+    PyObject_HEAD
+    hhh_t *m_hhh;
+} PyTriciaHHH;
+
+static void
+pytriciahhh_dealloc(PyTriciaHHH *self) {
+    hhh_free(self->m_hhh);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+#define PYTRICIA_HHH_EPSILON 0.001
+#define PYTRICIA_HHH_STEP 8
+
+// a tracker with checked parameters; max_nodes 0 picks a default
+static hhh_t *
+_pytriciahhh_make(int family, double epsilon, int step, Py_ssize_t max_nodes) {
+    if (max_nodes == 0) {
+        // room for 1/epsilon heavy prefixes at every level
+        int levels = ((family == AF_INET6 ? 128 : 32) + step - 1) / step + 1;
+        max_nodes = (Py_ssize_t)(levels / epsilon) + 1;
+    }
+    return hhh_new(family, step, epsilon, (size_t)max_nodes);
+}
+
+// the tracker is usable from here on, even if a subclass skips __init__
+static PyObject *
+pytriciahhh_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    PyTriciaHHH *self = (PyTriciaHHH*)type->tp_alloc(type, 0);
+
+    if (self != NULL) {
+        self->m_hhh = _pytriciahhh_make(AF_INET, PYTRICIA_HHH_EPSILON, PYTRICIA_HHH_STEP, 0);
+        if (!self->m_hhh) {
+            Py_DECREF(self);
+            return PyErr_NoMemory();
+        }
+    }
+    return (PyObject *)self;
+}
+
+static int
+pytriciahhh_init(PyTriciaHHH *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"family", "epsilon", "step", "max_nodes", NULL};
+    int family = AF_INET;
+    double epsilon = PYTRICIA_HHH_EPSILON;
+    int step = PYTRICIA_HHH_STEP;
+    Py_ssize_t max_nodes = 0;
+    hhh_t *hhh;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|idin:PyTriciaHHH", kwlist,
+                                     &family, &epsilon, &step, &max_nodes)) {
+        return -1;
+    }
+    if (!(family == AF_INET || family == AF_INET6)) {
+        PyErr_SetString(PyExc_ValueError, "Invalid address family; must be AF_INET (2) or AF_INET6 (30)");
+        return -1;
+    }
+    if (!(epsilon > 0 && epsilon < 1)) {
+        PyErr_SetString(PyExc_ValueError, "epsilon must be between 0 and 1");
+        return -1;
+    }
+    if (step < 1 || step > (family == AF_INET6 ? 128 : 32)) {
+        PyErr_SetString(PyExc_ValueError, "Invalid step");
+        return -1;
+    }
+    if (max_nodes < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_nodes can't be negative");
+        return -1;
+    }
+
+    if (!(hhh = _pytriciahhh_make(family, epsilon, step, max_nodes))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    hhh_free(self->m_hhh);
+    self->m_hhh = hhh;
+    return 0;
+}
+
+static Py_ssize_t
+pytriciahhh_length(PyTriciaHHH *self) {
+    return (Py_ssize_t)hhh_size(self->m_hhh);
+}
+
+static PyObject*
+pytriciahhh_update(PyTriciaHHH *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"keys", "weights", NULL};
+    PyObject *keys = NULL, *weights = NULL;
+    Py_ssize_t i, n = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:update", kwlist, &keys, &weights)) {
+        return NULL;
+    }
+    int family = hhh_family(self->m_hhh);
+    prefix_t *prefixes = _pytricia_parse_batch(family, keys, &n);
+    if (!prefixes) {
+        return NULL;
+    }
+    double *w = _pytricia_parse_weights(weights, n);
+    if (!w) {
+        PyMem_Free(prefixes);
+        return NULL;
+    }
+    // check the whole batch first, so a bad item leaves the tracker as it was
+    double sum = 0;
+    for (i = 0; i < n; i++) {
+        if (prefixes[i].family != family) {
+            PyErr_SetString(PyExc_ValueError, "Address family doesn't match the tracker's");
+            break;
+        }
+        if (!(w[i] >= 0 && w[i] <= DBL_MAX)) {
+            PyErr_SetString(PyExc_ValueError, "Weights must be finite and not negative");
+            break;
+        }
+        sum += w[i];
+    }
+    if (i == n && !hhh_room(self->m_hhh, sum)) {
+        PyErr_SetString(PyExc_ValueError, "Weights would overflow the tracker's total");
+        i = 0;
+    }
+    if (i < n) {
+        PyMem_Free(prefixes);
+        PyMem_Free(w);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        if (hhh_update(self->m_hhh, prefix_touchar(&prefixes[i]), w[i]) < 0) {
+            PyErr_NoMemory();
+            break;
+        }
+    }
+    PyMem_Free(prefixes);
+    PyMem_Free(w);
+    if (i < n) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytriciahhh_decay(PyTriciaHHH *self, PyObject *args) {
+    double factor;
+
+    if (!PyArg_ParseTuple(args, "d:decay", &factor)) {
+        return NULL;
+    }
+    if (!(factor > 0 && factor <= 1)) {
+        PyErr_SetString(PyExc_ValueError, "Decay factor must be greater than 0 and at most 1");
+        return NULL;
+    }
+    hhh_decay(self->m_hhh, factor);
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytriciahhh_total(PyTriciaHHH *self, PyObject *unused) {
+    return PyFloat_FromDouble(hhh_total(self->m_hhh));
+}
+
+static PyObject*
+pytriciahhh_heavy_hitters(PyTriciaHHH *self, PyObject *args) {
+    hhh_result_t *results = NULL;
+    double phi;
+    long i, n;
+
+    if (!PyArg_ParseTuple(args, "d:heavy_hitters", &phi)) {
+        return NULL;
+    }
+    if (!(phi > 0 && phi <= 1)) {
+        PyErr_SetString(PyExc_ValueError, "phi must be greater than 0 and at most 1");
+        return NULL;
+    }
+    n = hhh_heavy_hitters(self->m_hhh, phi, &results);
+    if (n < 0) {
+        return PyErr_NoMemory();
+    }
+
+    PyObject *rv = PyDict_New();
+    for (i = 0; rv && i < n; i++) {
+        char buffer[64];
+        prefix_toa2x(results[i].node->prefix, buffer, 1);
+        PyObject *count = PyFloat_FromDouble(results[i].count);
+        if (!count || PyDict_SetItemString(rv, buffer, count) < 0) {
+            Py_XDECREF(count);
+            Py_CLEAR(rv);
+        } else {
+            Py_DECREF(count);
+        }
+    }
+    free(results);
+    return rv;
+}
+
+static PyMethodDef pytriciahhh_methods[] = {
+    {"update", (PyCFunction)pytriciahhh_update, METH_VARARGS | METH_KEYWORDS, "update(keys, weights=None) -> \nCount a weight (default 1) for each address; keys take the same forms as PyTricia.get_many."},
+    {"decay", (PyCFunction)pytriciahhh_decay, METH_VARARGS, "decay(factor) -> \nMultiply every count by factor (0 < factor <= 1)."},
+    {"total", (PyCFunction)pytriciahhh_total, METH_NOARGS, "total() -> float\nReturn the decayed total of all weights counted."},
+    {"heavy_hitters", (PyCFunction)pytriciahhh_heavy_hitters, METH_VARARGS, "heavy_hitters(phi) -> dict\nReturn the prefixes whose traffic, less that of heavy hitters below them, is at least phi of the total, with that traffic."},
+    {NULL,              NULL}           /* sentinel */
+};
+
+static PySequenceMethods pytriciahhh_as_sequence = {
+    (lenfunc)pytriciahhh_length,        /*sq_length*/
+};
+
+static PyTypeObject PyTriciaHHHType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pytricia.PyTriciaHHH",                 /* tp_name */
+    sizeof(PyTriciaHHH),                    /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)pytriciahhh_dealloc,        /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    &pytriciahhh_as_sequence,               /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+    "PyTriciaHHH(family=AF_INET, epsilon=0.001, step=8, max_nodes=0)\nStreaming hierarchical heavy hitter tracker.", /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    pytriciahhh_methods,                    /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    (initproc)pytriciahhh_init,             /* tp_init */
+    0,                                      /* tp_alloc */
+    pytriciahhh_new,                        /* tp_new */
+};
+
+/*
+ * PyTricia2D: (source, destination) prefix-pair rules (see rules2d.h).
+ */
+
+typedef struct {
+    PyObject_HEAD
+    rules2d_t *m_rules;
+    int m_family;
+} PyTricia2D;
+
+static void
+pytricia2d_dealloc(PyTricia2D *self) {
+    rules2d_free(self->m_rules);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+// the classifier is usable from here on, even if a subclass skips __init__
+static PyObject *
+pytricia2d_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    PyTricia2D *self = (PyTricia2D*)type->tp_alloc(type, 0);
+
+    if (self != NULL) {
+        self->m_family = AF_INET;
+        self->m_rules = rules2d_new(32, pytricia_xdecref);
+        if (!self->m_rules) {
+            Py_DECREF(self);
+            return PyErr_NoMemory();
+        }
+    }
+    return (PyObject *)self;
+}
+
+static int
+pytricia2d_init(PyTricia2D *self, PyObject *args, PyObject *kwds) {
+    int prefixlen = 32;
+    int family = AF_INET;
+    rules2d_t *rules;
+
+    if (!PyArg_ParseTuple(args, "|ii", &prefixlen, &family)) {
+        PyErr_SetString(PyExc_ValueError, "Error parsing prefix length or address family");
+        return -1;
+    }
+    if (prefixlen < 0 || prefixlen > PATRICIA_MAXBITS) {
+        PyErr_SetString(PyExc_ValueError, "Invalid number of maximum bits; must be between 0 and 128, inclusive");
+        return -1;
+    }
+    if (!(family == AF_INET || family == AF_INET6)) {
+        PyErr_SetString(PyExc_ValueError, "Invalid address family; must be AF_INET (2) or AF_INET6 (30)");
+        return -1;
+    }
+    if (!(rules = rules2d_new(prefixlen, pytricia_xdecref))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    rules2d_free(self->m_rules);
+    self->m_rules = rules;
+    self->m_family = family;
+    return 0;
+}
+
+static Py_ssize_t
+pytricia2d_length(PyTricia2D *self) {
+    return (Py_ssize_t)rules2d_count(self->m_rules);
+}
+
+// both keys as prefixes, or NULL with an exception set
+static int
+_pytricia2d_keys(PyObject *src, PyObject *dst, prefix_t **psrc, prefix_t **pdst) {
+    *psrc = _key_object_to_prefix(src);
+    *pdst = *psrc ? _key_object_to_prefix(dst) : NULL;
+    if (!*pdst) {
+        if (*psrc) {
+            Deref_Prefix(*psrc);
+        }
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject*
+pytricia2d_insert(PyTricia2D *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"src", "dst", "value", "priority", NULL};
+    PyObject *src = NULL, *dst = NULL, *value = NULL;
+    prefix_t *psrc, *pdst;
+    long priority = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOO|l:insert", kwlist, &src, &dst, &value, &priority)) {
+        return NULL;
+    }
+    if (_pytricia2d_keys(src, dst, &psrc, &pdst) < 0) {
+        return NULL;
+    }
+    Py_INCREF(value);
+    int rv = rules2d_add(self->m_rules, psrc, pdst, priority, value);
+    Deref_Prefix(psrc);
+    Deref_Prefix(pdst);
+    if (rv < 0) {
+        Py_DECREF(value);
+        return PyErr_NoMemory();
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytricia2d_delete(PyTricia2D *self, PyObject *args) {
+    PyObject *src = NULL, *dst = NULL;
+    prefix_t *psrc, *pdst;
+
+    if (!PyArg_ParseTuple(args, "OO:delete", &src, &dst)) {
+        return NULL;
+    }
+    if (_pytricia2d_keys(src, dst, &psrc, &pdst) < 0) {
+        return NULL;
+    }
+    int rv = rules2d_remove(self->m_rules, psrc, pdst);
+    Deref_Prefix(psrc);
+    Deref_Prefix(pdst);
+    if (rv < 0) {
+        PyErr_SetString(PyExc_KeyError, "Rule doesn't exist.");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytricia2d_classify(PyTricia2D *self, PyObject *args) {
+    PyObject *src = NULL, *dst = NULL, *defvalue = Py_None;
+    prefix_t *psrc, *pdst;
+
+    if (!PyArg_ParseTuple(args, "OO|O:classify", &src, &dst, &defvalue)) {
+        return NULL;
+    }
+    if (_pytricia2d_keys(src, dst, &psrc, &pdst) < 0) {
+        return NULL;
+    }
+    PyObject *value = rules2d_match(self->m_rules, psrc, pdst);
+    Deref_Prefix(psrc);
+    Deref_Prefix(pdst);
+    if (!value) {
+        value = defvalue;
+    }
+    Py_INCREF(value);
+    return value;
+}
+
+static PyObject*
+pytricia2d_classify_many(PyTricia2D *self, PyObject *args) {
+    PyObject *srcs = NULL, *dsts = NULL, *defvalue = Py_None;
+    prefix_t *psrcs = NULL, *pdsts = NULL;
+    Py_ssize_t i, n = 0, ndsts = 0;
+    PyObject *rvlist = NULL;
+
+    if (!PyArg_ParseTuple(args, "OO|O:classify_many", &srcs, &dsts, &defvalue)) {
+        return NULL;
+    }
+    psrcs = _pytricia_parse_batch(self->m_family, srcs, &n);
+    pdsts = psrcs ? _pytricia_parse_batch(self->m_family, dsts, &ndsts) : NULL;
+    if (pdsts && ndsts != n) {
+        PyErr_SetString(PyExc_ValueError, "Need as many destinations as sources");
+    } else if (pdsts) {
+        rvlist = PyList_New(n);
+        for (i = 0; rvlist && i < n; i++) {
+            PyObject *value = rules2d_match(self->m_rules, &psrcs[i], &pdsts[i]);
+            if (!value) {
+                value = defvalue;
+            }
+            Py_INCREF(value);
+            PyList_SET_ITEM(rvlist, i, value);
+        }
+    }
+    PyMem_Free(psrcs);
+    PyMem_Free(pdsts);
+    return rvlist;
+}
+
+static void
+_pytricia2d_collect(prefix_t *src, prefix_t *dst, long priority, void *value, void *arg) {
+    PyObject *rvlist = arg;
+    char sbuf[64], dbuf[64];
+
+    if (PyErr_Occurred()) {
+        return;
+    }
+    prefix_toa2x(src, sbuf, 1);
+    prefix_toa2x(dst, dbuf, 1);
+    PyObject *item = Py_BuildValue("(sslO)", sbuf, dbuf, priority, (PyObject *)value);
+    if (item) {
+        PyList_Append(rvlist, item);
+        Py_DECREF(item);
+    }
+}
+
+static PyObject*
+pytricia2d_rules(PyTricia2D *self, PyObject *unused) {
+    PyObject *rvlist = PyList_New(0);
+    if (!rvlist) {
+        return NULL;
+    }
+    rules2d_walk(self->m_rules, _pytricia2d_collect, rvlist);
+    if (PyErr_Occurred()) {
+        Py_DECREF(rvlist);
+        return NULL;
+    }
+    return rvlist;
+}
+
+static PyMethodDef pytricia2d_methods[] = {
+    {"insert", (PyCFunction)pytricia2d_insert, METH_VARARGS | METH_KEYWORDS, "insert(src, dst, value, priority=0) -> \nAdd or replace the rule for the (src, dst) prefix pair."},
+    {"delete", (PyCFunction)pytricia2d_delete, METH_VARARGS, "delete(src, dst) -> \nRemove the rule for the (src, dst) prefix pair."},
+    {"classify", (PyCFunction)pytricia2d_classify, METH_VARARGS, "classify(src, dst, [default]) -> object\nReturn the value of the highest-priority rule matching both addresses; ties go to the more specific source, then destination."},
+    {"classify_many", (PyCFunction)pytricia2d_classify_many, METH_VARARGS, "classify_many(srcs, dsts, [default]) -> list\nclassify each (src, dst) pair; srcs and dsts take the same forms as PyTricia.get_many keys."},
+    {"rules", (PyCFunction)pytricia2d_rules, METH_NOARGS, "rules() -> list\nReturn every rule as a (src, dst, priority, value) tuple."},
+    {NULL,              NULL}           /* sentinel */
+};
+
+static PySequenceMethods pytricia2d_as_sequence = {
+    (lenfunc)pytricia2d_length,         /*sq_length*/
+};
+
+static PyTypeObject PyTricia2DType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pytricia.PyTricia2D",                  /* tp_name */
+    sizeof(PyTricia2D),                     /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)pytricia2d_dealloc,         /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    &pytricia2d_as_sequence,                /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+    "PyTricia2D(prefixlen=32, family=AF_INET)\nPriority rules over (source prefix, destination prefix) pairs.", /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    pytricia2d_methods,                     /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    (initproc)pytricia2d_init,              /* tp_init */
+    0,                                      /* tp_alloc */
+    pytricia2d_new,                         /* tp_new */
+};
+
+/*
+ * PyTriciaTernary: value/mask rules with arbitrary masks (see ternary.h).
+ */
+
+typedef struct {
+    PyObject_HEAD
+    ternary_t *m_ternary;
+    int m_family;
+} PyTriciaTernary;
+
+static void
+pytriciaternary_dealloc(PyTriciaTernary *self) {
+    ternary_free(self->m_ternary);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int
+pytriciaternary_init(PyTriciaTernary *self, PyObject *args, PyObject *kwds) {
+    int family = AF_INET;
+
+    if (!PyArg_ParseTuple(args, "|i", &family)) {
+        PyErr_SetString(PyExc_ValueError, "Error parsing address family");
+        return -1;
+    }
+    if (!(family == AF_INET || family == AF_INET6)) {
+        PyErr_SetString(PyExc_ValueError, "Invalid address family; must be AF_INET (2) or AF_INET6 (30)");
+        return -1;
+    }
+    ternary_free(self->m_ternary);
+    self->m_ternary = ternary_new(family, pytricia_xdecref);
+    self->m_family = family;
+    if (!self->m_ternary) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+static Py_ssize_t
+pytriciaternary_length(PyTriciaTernary *self) {
+    return self->m_ternary ? (Py_ssize_t)ternary_count(self->m_ternary) : 0;
+}
+
+// value and mask as packed bytes; a missing mask comes from the value's
+// prefix length, and a wildcard mask has its bits flipped
+static int
+_pytriciaternary_rule(PyTriciaTernary *self, PyObject *value, PyObject *mask, int wildcard, u_char *vbytes, u_char *mbytes) {
+    int width = self->m_family == AF_INET6 ? 16 : 4;
+    prefix_t *pvalue = _key_object_to_prefix(value);
+    prefix_t *pmask = NULL;
+    int i;
+
+    if (pvalue && mask != Py_None) {
+        pmask = _key_object_to_prefix(mask);
+        if (!pmask) {
+            Deref_Prefix(pvalue);
+            pvalue = NULL;
+        }
+    }
+    if (!pvalue) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "Invalid address.");
+        }
+        return -1;
+    }
+    if (pvalue->family != self->m_family || (pmask && pmask->family != self->m_family)) {
+        PyErr_SetString(PyExc_ValueError, "Address family doesn't match the table's");
+        Deref_Prefix(pvalue);
+        if (pmask) {
+            Deref_Prefix(pmask);
+        }
+        return -1;
+    }
+    memcpy(vbytes, prefix_touchar(pvalue), width);
+    if (pmask) {
+        memcpy(mbytes, prefix_touchar(pmask), width);
+        Deref_Prefix(pmask);
+    } else {
+        for (i = 0; i < width; i++) {
+            int bits = pvalue->bitlen - 8 * i;
+            mbytes[i] = bits >= 8 ? 0xff : bits <= 0 ? 0 : (u_char)(0xff << (8 - bits));
+        }
+    }
+    Deref_Prefix(pvalue);
+    if (wildcard) {
+        for (i = 0; i < width; i++) {
+            mbytes[i] = ~mbytes[i];
+        }
+    }
+    return 0;
+}
+
+static PyObject*
+pytriciaternary_insert(PyTriciaTernary *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"value", "mask", "data", "priority", "wildcard", NULL};
+    PyObject *value = NULL, *mask = NULL, *data = NULL;
+    u_char vbytes[16], mbytes[16];
+    long priority = 0;
+    int wildcard = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOO|li:insert", kwlist, &value, &mask, &data, &priority, &wildcard)) {
+        return NULL;
+    }
+    if (_pytriciaternary_rule(self, value, mask, wildcard, vbytes, mbytes) < 0) {
+        return NULL;
+    }
+    Py_INCREF(data);
+    if (ternary_add(self->m_ternary, vbytes, mbytes, priority, data) < 0) {
+        Py_DECREF(data);
+        return PyErr_NoMemory();
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytriciaternary_delete(PyTriciaTernary *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"value", "mask", "wildcard", NULL};
+    PyObject *value = NULL, *mask = NULL;
+    u_char vbytes[16], mbytes[16];
+    int wildcard = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|i:delete", kwlist, &value, &mask, &wildcard)) {
+        return NULL;
+    }
+    if (_pytriciaternary_rule(self, value, mask, wildcard, vbytes, mbytes) < 0) {
+        return NULL;
+    }
+    if (ternary_remove(self->m_ternary, vbytes, mbytes) < 0) {
+        PyErr_SetString(PyExc_KeyError, "Rule doesn't exist.");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytriciaternary_match(PyTriciaTernary *self, PyObject *args) {
+    PyObject *key = NULL, *defvalue = Py_None;
+    Py_ssize_t n = 0;
+
+    if (!PyArg_ParseTuple(args, "O|O:match", &key, &defvalue)) {
+        return NULL;
+    }
+    PyObject *single = PyTuple_Pack(1, key);
+    if (!single) {
+        return NULL;
+    }
+    prefix_t *prefixes = _pytricia_parse_batch(self->m_family, single, &n);
+    Py_DECREF(single);
+    if (!prefixes) {
+        return NULL;
+    }
+    PyObject *value = ternary_match(self->m_ternary, prefix_touchar(&prefixes[0]));
+    PyMem_Free(prefixes);
+    if (!value) {
+        value = defvalue;
+    }
+    Py_INCREF(value);
+    return value;
+}
+
+static PyObject*
+pytriciaternary_match_many(PyTriciaTernary *self, PyObject *args) {
+    PyObject *keys = NULL, *defvalue = Py_None;
+    prefix_t *prefixes;
+    Py_ssize_t i, n = 0;
+
+    if (!PyArg_ParseTuple(args, "O|O:match_many", &keys, &defvalue)) {
+        return NULL;
+    }
+    prefixes = _pytricia_parse_batch(self->m_family, keys, &n);
+    if (!prefixes) {
+        return NULL;
+    }
+    PyObject *rvlist = PyList_New(n);
+    for (i = 0; rvlist && i < n; i++) {
+        PyObject *value = ternary_match(self->m_ternary, prefix_touchar(&prefixes[i]));
+        if (!value) {
+            value = defvalue;
+        }
+        Py_INCREF(value);
+        PyList_SET_ITEM(rvlist, i, value);
+    }
+    PyMem_Free(prefixes);
+    return rvlist;
+}
+
+typedef struct {
+    PyObject *rvlist;
+    int family;
+} pytriciaternary_collect_t;
+
+static void
+_pytriciaternary_collect(const u_char *value, const u_char *mask, long priority, void *data, void *arg) {
+    pytriciaternary_collect_t *collect = arg;
+    char vbuf[64], mbuf[64];
+
+    if (PyErr_Occurred()) {
+        return;
+    }
+    inet_ntop(collect->family, value, vbuf, sizeof(vbuf));
+    inet_ntop(collect->family, mask, mbuf, sizeof(mbuf));
+    PyObject *item = Py_BuildValue("(sslO)", vbuf, mbuf, priority, (PyObject *)data);
+    if (item) {
+        PyList_Append(collect->rvlist, item);
+        Py_DECREF(item);
+    }
+}
+
+static PyObject*
+pytriciaternary_rules(PyTriciaTernary *self, PyObject *unused) {
+    pytriciaternary_collect_t collect = { PyList_New(0), self->m_family };
+    if (!collect.rvlist) {
+        return NULL;
+    }
+    ternary_walk(self->m_ternary, _pytriciaternary_collect, &collect);
+    if (PyErr_Occurred()) {
+        Py_DECREF(collect.rvlist);
+        return NULL;
+    }
+    return collect.rvlist;
+}
+
+static PyObject*
+pytriciaternary_masks(PyTriciaTernary *self, PyObject *unused) {
+    return PyLong_FromSize_t(ternary_masks(self->m_ternary));
+}
+
+static PyMethodDef pytriciaternary_methods[] = {
+    {"insert", (PyCFunction)pytriciaternary_insert, METH_VARARGS | METH_KEYWORDS, "insert(value, mask, data, priority=0, wildcard=False) -> \nAdd or replace the rule matching addresses equal to value wherever mask has a 1 bit.  mask is an address such as '255.0.255.0', or None for value's prefix length; wildcard=True takes it ACL-style, 1 bits meaning don't care."},
+    {"delete", (PyCFunction)pytriciaternary_delete, METH_VARARGS | METH_KEYWORDS, "delete(value, mask, wildcard=False) -> \nRemove the rule for (value, mask)."},
+    {"match", (PyCFunction)pytriciaternary_match, METH_VARARGS, "match(addr, [default]) -> object\nReturn the data of the highest-priority rule matching addr; ties go to the rule added first."},
+    {"match_many", (PyCFunction)pytriciaternary_match_many, METH_VARARGS, "match_many(keys, [default]) -> list\nmatch each address; keys take the same forms as PyTricia.get_many."},
+    {"rules", (PyCFunction)pytriciaternary_rules, METH_NOARGS, "rules() -> list\nReturn every rule as a (value, mask, priority, data) tuple, grouped by mask."},
+    {"masks", (PyCFunction)pytriciaternary_masks, METH_NOARGS, "masks() -> int\nNumber of distinct masks, i.e. hash probes a lookup may take."},
+    {NULL,              NULL}           /* sentinel */
+};
+
+static PySequenceMethods pytriciaternary_as_sequence = {
+    (lenfunc)pytriciaternary_length,    /*sq_length*/
+};
+
+static PyTypeObject PyTriciaTernaryType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pytricia.PyTriciaTernary",             /* tp_name */
+    sizeof(PyTriciaTernary),                /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)pytriciaternary_dealloc,    /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    &pytriciaternary_as_sequence,           /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+    "PyTriciaTernary(family=AF_INET)\nPriority rules over (value, mask) pairs with arbitrary, non-contiguous masks.", /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    pytriciaternary_methods,                /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    (initproc)pytriciaternary_init,         /* tp_init */
+    0,                                      /* tp_alloc */
+    PyType_GenericNew,                      /* tp_new */
+};
+
+/*
+ * PyTriciaVRF: many routing tables of one family, keyed by table id.  Each
+ * distinct prefix is stored once, in an intern tree, and every table node
+ * holding it shares that prefix_t by reference count; a prefix leaves the
+ * intern tree when no table holds it any more.
+ */
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *m_tables;         /* table id -> capsule of patricia_tree_t */
+    patricia_tree_t *m_intern;
+    int m_family;
+} PyTriciaVRF;
+
+#define PYTRICIA_VRF_CAPSULE "pytricia.vrf_table"
+
+static patricia_tree_t *
+_pytriciavrf_table(PyTriciaVRF *self, PyObject *table_id, int create) {
+    PyObject *capsule = PyDict_GetItem(self->m_tables, table_id);
+    patricia_tree_t *tree;
+
+    if (capsule) {
+        return PyCapsule_GetPointer(capsule, PYTRICIA_VRF_CAPSULE);
+    }
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    if (!create) {
+        PyErr_SetObject(PyExc_KeyError, table_id);
+        return NULL;
+    }
+    tree = New_Patricia(self->m_intern->maxbits);
+    capsule = tree ? PyCapsule_New(tree, PYTRICIA_VRF_CAPSULE, NULL) : NULL;
+    if (!capsule) {
+        if (tree) {
+            Destroy_Patricia(tree, NULL);
+        }
+        return (patricia_tree_t *)PyErr_NoMemory();
+    }
+    if (PyDict_SetItem(self->m_tables, table_id, capsule) < 0) {
+        Destroy_Patricia(tree, NULL);
+        tree = NULL;
+    }
+    Py_DECREF(capsule);
+    return tree;
+}
+
+// a table let go of an interned prefix; drop it once only the intern tree has it
+static void
+_pytriciavrf_release(PyTriciaVRF *self, prefix_t *prefix) {
+    if (prefix->ref_count == 1) {
+        patricia_node_t *node = patricia_search_exact(self->m_intern, prefix);
+        if (node) {
+            patricia_remove(self->m_intern, node);
+        }
+    }
+}
+
+static void
+_pytriciavrf_destroy_table(PyTriciaVRF *self, patricia_tree_t *tree) {
+    patricia_node_t *node;
+    prefix_t **held;
+    size_t i, n = 0;
+
+    held = PyMem_Malloc((tree->num_active_node + 1) * sizeof(*held));
+    if (held) {
+        PATRICIA_WALK(tree->head, node) {
+            held[n++] = node->prefix;
+        } PATRICIA_WALK_END;
+    }
+    Destroy_Patricia(tree, pytricia_xdecref);
+    for (i = 0; i < n; i++) {
+        _pytriciavrf_release(self, held[i]);
+    }
+    PyMem_Free(held);
+}
+
+static void
+pytriciavrf_dealloc(PyTriciaVRF *self) {
+    if (self->m_tables) {
+        PyObject *table_id, *capsule;
+        Py_ssize_t pos = 0;
+        while (PyDict_Next(self->m_tables, &pos, &table_id, &capsule)) {
+            Destroy_Patricia(PyCapsule_GetPointer(capsule, PYTRICIA_VRF_CAPSULE), pytricia_xdecref);
+        }
+        Py_DECREF(self->m_tables);
+    }
+    if (self->m_intern) {
+        Destroy_Patricia(self->m_intern, NULL);
+    }
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+// the container is usable from here on, even if a subclass skips __init__
+static PyObject *
+pytriciavrf_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    PyTriciaVRF *self = (PyTriciaVRF*)type->tp_alloc(type, 0);
+
+    if (self != NULL) {
+        self->m_family = AF_INET;
+        self->m_tables = PyDict_New();
+        self->m_intern = New_Patricia(32);
+        if (!self->m_tables || !self->m_intern) {
+            Py_DECREF(self);
+            return PyErr_NoMemory();
+        }
+    }
+    return (PyObject *)self;
+}
+
+static int
+pytriciavrf_init(PyTriciaVRF *self, PyObject *args, PyObject *kwds) {
+    int family = AF_INET;
+
+    if (!PyArg_ParseTuple(args, "|i", &family)) {
+        PyErr_SetString(PyExc_ValueError, "Error parsing address family");
+        return -1;
+    }
+    if (!(family == AF_INET || family == AF_INET6)) {
+        PyErr_SetString(PyExc_ValueError, "Invalid address family; must be AF_INET (2) or AF_INET6 (30)");
+        return -1;
+    }
+    if (PyDict_Size(self->m_tables)) {
+        PyErr_SetString(PyExc_RuntimeError, "PyTriciaVRF is already initialized");
+        return -1;
+    }
+    if (family != self->m_family) {
+        patricia_tree_t *intern = New_Patricia(family == AF_INET6 ? 128 : 32);
+        if (!intern) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        Destroy_Patricia(self->m_intern, NULL);
+        self->m_intern = intern;
+        self->m_family = family;
+    }
+    return 0;
+}
+
+static Py_ssize_t
+pytriciavrf_length(PyTriciaVRF *self) {
+    return PyDict_Size(self->m_tables);
+}
+
+// the key as a prefix of the container's family, zeroed past its length so
+// every table spells it the same way; NULL with an exception set on error
+static prefix_t *
+_pytriciavrf_key(PyTriciaVRF *self, PyObject *key) {
     prefix_t *prefix = _key_object_to_prefix(key);
     if (!prefix) {
-        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        }
         return NULL;
     }
-    patricia_node_t* node = patricia_search_exact(self->m_tree, prefix);
+    if (prefix->family != self->m_family) {
+        Deref_Prefix(prefix);
+        PyErr_SetString(PyExc_ValueError, "Address family doesn't match the table's");
+        return NULL;
+    }
+    _pytricia_mask(prefix);
+    return prefix;
+}
+
+static PyObject*
+pytriciavrf_insert(PyTriciaVRF *self, PyObject *args) {
+    PyObject *table_id = NULL, *key = NULL, *value = NULL;
+    patricia_tree_t *tree;
+    patricia_node_t *interned, *node;
+    prefix_t *prefix;
+
+    if (!PyArg_ParseTuple(args, "OOO:insert", &table_id, &key, &value)) {
+        return NULL;
+    }
+    if (!(tree = _pytriciavrf_table(self, table_id, 1))) {
+        return NULL;
+    }
+    if (!(prefix = _pytriciavrf_key(self, key))) {
+        return NULL;
+    }
+    interned = patricia_lookup(self->m_intern, prefix);
     Deref_Prefix(prefix);
-    if (node) {
-        Py_RETURN_TRUE;
+    node = interned ? patricia_lookup(tree, interned->prefix) : NULL;
+    if (!node) {
+        if (interned) {
+            _pytriciavrf_release(self, interned->prefix);
+        }
+        PyErr_SetString(PyExc_ValueError, "Error inserting into patricia tree");
+        return NULL;
     }
-    Py_RETURN_FALSE;
+    Py_INCREF(value);
+    Py_XDECREF((PyObject *)node->data);
+    node->data = value;
+    Py_RETURN_NONE;
 }
 
-static PyObject* 
-pytricia_keys(register PyTricia *self, PyObject *unused) {
-    register PyObject *rvlist = PyList_New(0);
+static PyObject*
+pytriciavrf_delete(PyTriciaVRF *self, PyObject *args) {
+    PyObject *table_id = NULL, *key = NULL;
+    patricia_tree_t *tree;
+    patricia_node_t *node;
+    prefix_t *prefix;
+
+    if (!PyArg_ParseTuple(args, "OO:delete", &table_id, &key)) {
+        return NULL;
+    }
+    if (!(tree = _pytriciavrf_table(self, table_id, 0))) {
+        return NULL;
+    }
+    if (!(prefix = _pytriciavrf_key(self, key))) {
+        return NULL;
+    }
+    node = patricia_search_exact(tree, prefix);
+    Deref_Prefix(prefix);
+    if (!node) {
+        PyErr_SetString(PyExc_KeyError, "Prefix doesn't exist.");
+        return NULL;
+    }
+    prefix = node->prefix;
+    Py_XDECREF((PyObject *)node->data);
+    patricia_remove(tree, node);
+    _pytriciavrf_release(self, prefix);
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytriciavrf_drop(PyTriciaVRF *self, PyObject *args) {
+    PyObject *table_id = NULL;
+    patricia_tree_t *tree;
+
+    if (!PyArg_ParseTuple(args, "O:drop", &table_id)) {
+        return NULL;
+    }
+    if (!(tree = _pytriciavrf_table(self, table_id, 0))) {
+        return NULL;
+    }
+    Py_INCREF(table_id);
+    if (PyDict_DelItem(self->m_tables, table_id) < 0) {
+        Py_DECREF(table_id);
+        return NULL;
+    }
+    Py_DECREF(table_id);
+    _pytriciavrf_destroy_table(self, tree);
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pytriciavrf_get(PyTriciaVRF *self, PyObject *args) {
+    PyObject *table_id = NULL, *key = NULL, *defvalue = Py_None;
+    patricia_tree_t *tree;
+    patricia_node_t *node;
+    prefix_t *prefix;
+
+    if (!PyArg_ParseTuple(args, "OO|O:get", &table_id, &key, &defvalue)) {
+        return NULL;
+    }
+    if (!(tree = _pytriciavrf_table(self, table_id, 0))) {
+        return NULL;
+    }
+    if (!(prefix = _pytriciavrf_key(self, key))) {
+        return NULL;
+    }
+    node = patricia_search_best(tree, prefix);
+    Deref_Prefix(prefix);
+    PyObject *value = node ? (PyObject *)node->data : defvalue;
+    Py_INCREF(value);
+    return value;
+}
+
+static PyObject*
+pytriciavrf_get_many(PyTriciaVRF *self, PyObject *args) {
+    PyObject *table_ids = NULL, *keys = NULL, *defvalue = Py_None;
+    PyObject *rvlist = NULL, *last_id = NULL;
+    patricia_tree_t *tree = NULL;
+    prefix_t *prefixes;
+    Py_ssize_t i, n = 0;
+
+    if (!PyArg_ParseTuple(args, "OO|O:get_many", &table_ids, &keys, &defvalue)) {
+        return NULL;
+    }
+    PyObject *ids = PySequence_Fast(table_ids, "Table ids must be an iterable");
+    if (!ids) {
+        return NULL;
+    }
+    prefixes = _pytricia_parse_batch(self->m_family, keys, &n);
+    if (prefixes && PySequence_Fast_GET_SIZE(ids) != n) {
+        PyErr_SetString(PyExc_ValueError, "Need as many table ids as keys");
+    } else if (prefixes) {
+        rvlist = PyList_New(n);
+        for (i = 0; rvlist && i < n; i++) {
+            PyObject *table_id = PySequence_Fast_GET_ITEM(ids, i);
+            // runs of the same table skip the dict lookup
+            if (table_id != last_id) {
+                if (!(tree = _pytriciavrf_table(self, table_id, 0))) {
+                    Py_CLEAR(rvlist);
+                    break;
+                }
+                last_id = table_id;
+            }
+            patricia_node_t *node = prefixes[i].family == self->m_family ? patricia_search_best(tree, &prefixes[i]) : NULL;
+            PyObject *value = node ? (PyObject *)node->data : defvalue;
+            Py_INCREF(value);
+            PyList_SET_ITEM(rvlist, i, value);
+        }
+    }
+    PyMem_Free(prefixes);
+    Py_DECREF(ids);
+    return rvlist;
+}
+
+static PyObject*
+pytriciavrf_tables(PyTriciaVRF *self, PyObject *unused) {
+    return PyDict_Keys(self->m_tables);
+}
+
+static PyObject*
+pytriciavrf_keys(PyTriciaVRF *self, PyObject *args) {
+    PyObject *table_id = NULL;
+    patricia_tree_t *tree;
+    patricia_node_t *node;
+    char buffer[64];
+
+    if (!PyArg_ParseTuple(args, "O:keys", &table_id)) {
+        return NULL;
+    }
+    if (!(tree = _pytriciavrf_table(self, table_id, 0))) {
+        return NULL;
+    }
+    PyObject *rvlist = PyList_New(0);
     if (!rvlist) {
         return NULL;
     }
-    
-    patricia_node_t *node = NULL;
-    int err = 0;
-    
-    PATRICIA_WALK (self->m_tree->head, node) {
-        char buffer[64];
+    PATRICIA_WALK(tree->head, node) {
         prefix_toa2x(node->prefix, buffer, 1);
         PyObject *item = Py_BuildValue("s", buffer);
-        if (!item) {
+        if (!item || PyList_Append(rvlist, item) < 0) {
+            Py_XDECREF(item);
             Py_DECREF(rvlist);
             return NULL;
         }
-        err = PyList_Append(rvlist, item);
         Py_DECREF(item);
-        if (err != 0) {
-            Py_DECREF(rvlist);
-            return NULL;
-        }
     } PATRICIA_WALK_END;
     return rvlist;
 }
 
 static PyObject*
-pytricia_children(register PyTricia *self, PyObject *args) {
-    PyObject *key = NULL;
+pytriciavrf_stats(PyTriciaVRF *self, PyObject *unused) {
+    PyObject *table_id, *capsule;
+    patricia_node_t *node;
+    Py_ssize_t pos = 0;
+    long routes = 0, prefixes = 0;
 
-    if (!PyArg_ParseTuple(args, "O", &key)) {
-        return NULL;
+    while (PyDict_Next(self->m_tables, &pos, &table_id, &capsule)) {
+        patricia_tree_t *tree = PyCapsule_GetPointer(capsule, PYTRICIA_VRF_CAPSULE);
+        PATRICIA_WALK(tree->head, node) {
+            routes++;
+        } PATRICIA_WALK_END;
     }
+    PATRICIA_WALK(self->m_intern->head, node) {
+        prefixes++;
+    } PATRICIA_WALK_END;
+    return Py_BuildValue("{s:n,s:l,s:l}", "tables", PyDict_Size(self->m_tables),
+                         "routes", routes, "prefixes", prefixes);
+}
 
-    prefix_t *prefix = _key_object_to_prefix(key);
-    if (!prefix) {
-        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+static PyMethodDef pytriciavrf_methods[] = {
+    {"insert", (PyCFunction)pytriciavrf_insert, METH_VARARGS, "insert(table_id, prefix, value) -> \nMap prefix to value in the given table, creating the table if needed."},
+    {"delete", (PyCFunction)pytriciavrf_delete, METH_VARARGS, "delete(table_id, prefix) -> \nRemove prefix from the given table."},
+    {"drop", (PyCFunction)pytriciavrf_drop, METH_VARARGS, "drop(table_id) -> \nRemove a whole table."},
+    {"get", (PyCFunction)pytriciavrf_get, METH_VARARGS, "get(table_id, key, [default]) -> object\nReturn the value of the longest match for key in the given table."},
+    {"get_many", (PyCFunction)pytriciavrf_get_many, METH_VARARGS, "get_many(table_ids, keys, [default]) -> list\nget for each (table_id, key) pair, given as two columns; keys take the same forms as PyTricia.get_many."},
+    {"tables", (PyCFunction)pytriciavrf_tables, METH_NOARGS, "tables() -> list\nReturn the id of every table."},
+    {"keys", (PyCFunction)pytriciavrf_keys, METH_VARARGS, "keys(table_id) -> list\nReturn the prefixes held by the given table."},
+    {"stats", (PyCFunction)pytriciavrf_stats, METH_NOARGS, "stats() -> dict\nCount tables, routes across all tables, and distinct prefixes actually stored."},
+    {NULL,              NULL}           /* sentinel */
+};
+
+static PySequenceMethods pytriciavrf_as_sequence = {
+    (lenfunc)pytriciavrf_length,        /*sq_length*/
+};
+
+static PyTypeObject PyTriciaVRFType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pytricia.PyTriciaVRF",                 /* tp_name */
+    sizeof(PyTriciaVRF),                    /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)pytriciavrf_dealloc,        /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    &pytriciavrf_as_sequence,               /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+    "PyTriciaVRF(family=AF_INET)\nMany routing tables keyed by table id, sharing storage for common prefixes.", /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    pytriciavrf_methods,                    /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    (initproc)pytriciavrf_init,             /* tp_init */
+    0,                                      /* tp_alloc */
+    pytriciavrf_new,                        /* tp_new */
+};
+
+/*
+ * Module-level functions.
+ */
+
+static PyObject*
+pytricia_lookup_multi(PyObject *unused, PyObject *args) {
+    PyObject *trees = NULL, *keys = NULL, *defvalue = Py_None;
+    PyObject *seq, *rvlist = NULL;
+    PyTricia **tables = NULL;
+    frozen_t **frozen = NULL;
+    prefix_t *prefixes = NULL;
+    Py_ssize_t i, t, n = 0, ntrees;
+
+    if (!PyArg_ParseTuple(args, "OO|O:lookup_multi", &trees, &keys, &defvalue)) {
         return NULL;
     }
-
-    register PyObject *rvlist = PyList_New(0);
-    if (!rvlist) {
+    seq = PySequence_Fast(trees, "Trees must be an iterable of PyTricia objects");
+    if (!seq) {
         return NULL;
     }
+    ntrees = PySequence_Fast_GET_SIZE(seq);
+    tables = PyMem_Malloc((ntrees ? ntrees : 1) * sizeof(*tables));
+    frozen = PyMem_Malloc((ntrees ? ntrees : 1) * sizeof(*frozen));
+    if (!tables || !frozen) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (t = 0; t < ntrees; t++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, t);
+        if (!PyObject_TypeCheck(item, &PyTriciaType)) {
+            PyErr_SetString(PyExc_TypeError, "lookup_multi needs PyTricia objects");
+            goto done;
+        }
+        tables[t] = (PyTricia *)item;
+    }
 
-    patricia_node_t* base_node = patricia_search_exact(self->m_tree, prefix);
-    Deref_Prefix(prefix);
-    if (!base_node) {
-	   PyErr_SetString(PyExc_KeyError, "Prefix doesn't exist.");
-	   Py_DECREF(rvlist);
-	   return NULL;
+    // parse every key once; packed buffers are read in the first tree's family
+    prefixes = _pytricia_parse_batch(ntrees ? tables[0]->m_family : AF_INET, keys, &n);
+    if (!prefixes) {
+        goto done;
     }
-    patricia_node_t* node = NULL;
-    int err = 0;
+    for (t = 0; t < ntrees; t++) {
+        frozen[t] = _pytricia_frozen(tables[t]);
+    }
+    double now = _pytricia_now();
 
-    PATRICIA_WALK (base_node, node) {
-    	/* Discard first prefix (we want strict children) */
-    	if (node != base_node) {
-    	    char buffer[64];
-    	    prefix_toa2x(node->prefix, buffer, 1);
-    	    PyObject *item = Py_BuildValue("s", buffer);
-    	    if (!item) {
-    		    Py_DECREF(rvlist);
-    		    return NULL;
-    	    }
-    	    err = PyList_Append(rvlist, item);
-    	    Py_DECREF(item);
-    	    if (err != 0) {
-    		    Py_DECREF(rvlist);
-    		    return NULL;
-    	    }
-	    }
-    } PATRICIA_WALK_END;
+    rvlist = PyList_New(ntrees);
+    for (t = 0; rvlist && t < ntrees; t++) {
+        PyObject *column = PyList_New(n);
+        if (!column) {
+            Py_CLEAR(rvlist);
+            break;
+        }
+        PyList_SET_ITEM(rvlist, t, column);
+    }
+
+    // each key visits every tree back to back while it's still in cache
+    for (i = 0; rvlist && i < n; i++) {
+        for (t = 0; t < ntrees; t++) {
+            patricia_node_t *node;
+            if (frozen[t] && _pytricia_frozen_serves(frozen[t], &prefixes[i])) {
+                _pytricia_observe(tables[t], &prefixes[i]);
+                node = frozen_search(frozen[t], prefix_touchar(&prefixes[i]));
+            } else {
+                node = patricia_search_best(tables[t]->m_tree, &prefixes[i]);
+            }
+            if (_pytricia_hiding(tables[t])) {
+                node = _pytricia_unexpired(node, now);
+            }
+            _pytricia_touch(tables[t], node);
+            PyObject *value = node ? (PyObject *)node->data : defvalue;
+            Py_INCREF(value);
+            PyList_SET_ITEM(PyList_GET_ITEM(rvlist, t), i, value);
+        }
+    }
+
+done:
+    PyMem_Free(prefixes);
+    PyMem_Free(frozen);
+    PyMem_Free(tables);
+    Py_DECREF(seq);
     return rvlist;
 }
 
+static int
+_pytricia_ranked_cmp(const void *a, const void *b) {
+    const pytricia_ranked_t *x = a, *y = b;
+    int c = _pytricia_prefix_cmp(x->prefix, y->prefix);
+
+    if (c) {
+        return c;
+    }
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static PyObject*
+pytricia_find_overlaps(PyObject *unused, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"prefixes", "first", NULL};
+    PyObject *keys = NULL, *first = Py_False, *rv;
+    pytricia_ranked_t *items;
+    prefix_t *prefixes;
+    Py_ssize_t i, n = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:find_overlaps", kwlist, &keys, &first)) {
+        return NULL;
+    }
+    prefixes = _pytricia_parse_batch(AF_INET, keys, &n);
+    if (!prefixes) {
+        return NULL;
+    }
+    items = PyMem_Malloc((n ? n : 1) * sizeof(*items));
+    if (!items) {
+        PyMem_Free(prefixes);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < n; i++) {
+        _pytricia_mask(&prefixes[i]);
+        items[i].prefix = &prefixes[i];
+        items[i].id = i;
+    }
+    qsort(items, n, sizeof(*items), _pytricia_ranked_cmp);
+    rv = _pytricia_overlaps(items, n, PyObject_IsTrue(first));
+    PyMem_Free(items);
+    PyMem_Free(prefixes);
+    return rv;
+}
+
+static PyMethodDef pytricia_module_methods[] = {
+    {"lookup_multi", (PyCFunction)pytricia_lookup_multi, METH_VARARGS, "lookup_multi(trees, keys, [default]) -> list\nLook every key up in each of the PyTricia trees, parsing each key once; returns one list of values per tree.  keys take the same forms as PyTricia.get_many."},
+    {"find_overlaps", (PyCFunction)pytricia_find_overlaps, METH_VARARGS | METH_KEYWORDS, "find_overlaps(prefixes, first=False) -> (outer, inner)\nFind every pair of the given prefixes where one contains the other, as two parallel lists of indices into prefixes; with first set, return only the first pair as a tuple, or None.  prefixes take the same forms as PyTricia.get_many."},
+    {NULL,              NULL}           /* sentinel */
+};
+
+/*
+ * PyTriciaSnapshot: a table as it was at one version (see PyTricia.at()).
+ * It shares its nodes with the table's history, which it holds on to, so
+ * it stays valid after that version is dropped or the table is gone.
+ */
+
+static void
+pytriciasnapshot_dealloc(PyTriciaSnapshot *self) {
+    _pytricia_version_release(&self->m_version);
+    PyObject_Del(self);
+}
+
+static persist_node_t *
+_pytriciasnapshot_root(PyTriciaSnapshot *self, prefix_t *prefix) {
+    return self->m_version.roots[prefix->family == AF_INET6];
+}
+
+// the longest match for key; 0 if there is none, -1 if key isn't valid
+static int
+_pytriciasnapshot_best(PyTriciaSnapshot *self, PyObject *key, persist_node_t **out, int *family) {
+    prefix_t *prefix = _key_object_to_prefix(key);
+    if (!prefix) {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
+        return -1;
+    }
+    *out = persist_search_best(_pytriciasnapshot_root(self, prefix), prefix_touchar(prefix), prefix->bitlen);
+    *family = prefix->family;
+    Deref_Prefix(prefix);
+    return *out != NULL;
+}
+
+static PyObject *
+_pytriciasnapshot_key(persist_node_t *node, int family) {
+    prefix_t prefix;
+    char buffer[64];
+    New_Prefix2(family, node->addr, node->bitlen, &prefix);
+    prefix_toa2x(&prefix, buffer, 1);
+    return Py_BuildValue("s", buffer);
+}
+
+static PyObject*
+pytriciasnapshot_get(PyTriciaSnapshot *self, PyObject *args) {
+    PyObject *key = NULL, *defvalue = Py_None;
+    persist_node_t *node;
+    int family, found;
+
+    if (!PyArg_ParseTuple(args, "O|O:get", &key, &defvalue)) {
+        return NULL;
+    }
+    if ((found = _pytriciasnapshot_best(self, key, &node, &family)) < 0) {
+        return NULL;
+    }
+    PyObject *rv = found ? (PyObject *)node->value : defvalue;
+    Py_INCREF(rv);
+    return rv;
+}
+
 static PyObject*
-pytricia_parent(register PyTricia *self, PyObject *args) {
+pytriciasnapshot_get_key(PyTriciaSnapshot *self, PyObject *args) {
     PyObject *key = NULL;
+    persist_node_t *node;
+    int family, found;
 
-    if (!PyArg_ParseTuple(args, "O", &key)) {
+    if (!PyArg_ParseTuple(args, "O:get_key", &key)) {
         return NULL;
     }
+    if ((found = _pytriciasnapshot_best(self, key, &node, &family)) < 0) {
+        return NULL;
+    }
+    if (!found) {
+        Py_RETURN_NONE;
+    }
+    return _pytriciasnapshot_key(node, family);
+}
+
+static PyObject*
+pytriciasnapshot_has_key(PyTriciaSnapshot *self, PyObject *args) {
+    PyObject *key = NULL;
+    persist_node_t *node;
 
+    if (!PyArg_ParseTuple(args, "O:has_key", &key)) {
+        return NULL;
+    }
     prefix_t *prefix = _key_object_to_prefix(key);
     if (!prefix) {
         PyErr_SetString(PyExc_ValueError, "Invalid prefix.");
         return NULL;
     }
-
-    patricia_node_t* node = patricia_search_exact(self->m_tree, prefix);
+    node = persist_search_exact(_pytriciasnapshot_root(self, prefix), prefix_touchar(prefix), prefix->bitlen);
     Deref_Prefix(prefix);
-    if (!node) {
-	   PyErr_SetString(PyExc_KeyError, "Prefix doesn't exist.");
-	   return NULL;
-    }
-    patricia_node_t* parent_node = patricia_search_best2(self->m_tree, node->prefix, 0);
-    if (!parent_node) {
-        Py_RETURN_NONE;
+    if (node) {
+        Py_RETURN_TRUE;
     }
-
-    char buffer[64];
-    prefix_toa2x(parent_node->prefix, buffer, 1);
-    return Py_BuildValue("s", buffer);
+    Py_RETURN_FALSE;
 }
 
-static PyMappingMethods pytricia_as_mapping = {
-    (lenfunc)pytricia_length,
-    (binaryfunc)pytricia_subscript,
-    (objobjargproc)pytricia_assign_subscript
-};
+typedef struct {
+    PyObject *list;
+    int family;
+} pytriciasnapshot_keys_t;
 
-static PySequenceMethods pytricia_as_sequence = {
-       (lenfunc)pytricia_length,               /*sq_length*/
-       0,              /*sq_concat*/
-       0,                      /*sq_repeat*/
-       0,                      /*sq_item*/
-       0,                      /*sq_slice*/
-       0,                      /*sq_ass_item*/
-       0,                  /*sq_ass_slice*/
-       (objobjproc)pytricia_contains,               /*sq_contains*/
-       0,                  /*sq_inplace_concat*/
-       0                   /*sq_inplace_repeat*/
-};
+static int
+_pytriciasnapshot_add_key(persist_node_t *node, void *arg) {
+    pytriciasnapshot_keys_t *keys = arg;
+    PyObject *item = _pytriciasnapshot_key(node, keys->family);
+    int err;
+    if (!item) {
+        return -1;
+    }
+    err = PyList_Append(keys->list, item);
+    Py_DECREF(item);
+    return err;
+}
 
-// forward declaration
 static PyObject*
-pytricia_iter(register PyTricia *, PyObject *);
-
-
-static PyMethodDef pytricia_methods[] = {
-    {"has_key",   (PyCFunction)pytricia_has_key, METH_VARARGS, "has_key(prefix) -> boolean\nReturn true iff prefix is in tree.  Note that this method checks for an *exact* match with the prefix.\nUse the 'in' operator if you want to test whether a given address is contained within some prefix."},
-    {"keys",   (PyCFunction)pytricia_keys, METH_NOARGS, "keys() -> list\nReturn a list of all prefixes in the tree."},
-    {"get", (PyCFunction)pytricia_get, METH_VARARGS, "get(prefix, [default]) -> object\nReturn value associated with prefix."},
-    {"get_key", (PyCFunction)pytricia_get_key, METH_VARARGS, "get_key(prefix) -> prefix\nReturn key associated with prefix (longest matching prefix)."},
-    {"delete", (PyCFunction)pytricia_delitem, METH_VARARGS, "delete(prefix) -> \nDelete mapping associated with prefix.\n"},
-    {"insert", (PyCFunction)pytricia_insert, METH_VARARGS, "insert(prefix, data) -> data\nCreate mapping between prefix and data in tree."},
-    {"children", (PyCFunction)pytricia_children, METH_VARARGS, "children(prefix) -> list\nReturn a list of all prefixes that are more specific than the given prefix (the prefix must be present as an exact match)."},
-    {"parent", (PyCFunction)pytricia_parent, METH_VARARGS, "parent(prefix) -> prefix\nReturn the immediate parent of the given prefix (the prefix must be present as an exact match)."},
-    {NULL,              NULL}           /* sentinel */
-};
+pytriciasnapshot_keys(PyTriciaSnapshot *self, PyObject *unused) {
+    pytriciasnapshot_keys_t keys;
 
-static PyObject*
-pytriciaiter_iter(PyTricia *self)
-{
-    Py_INCREF(self);
-    return (PyObject*)self;
+    if (!(keys.list = PyList_New(0))) {
+        return NULL;
+    }
+    keys.family = AF_INET;
+    if (persist_walk(self->m_version.roots[0], _pytriciasnapshot_add_key, &keys) < 0) {
+        Py_DECREF(keys.list);
+        return NULL;
+    }
+    keys.family = AF_INET6;
+    if (persist_walk(self->m_version.roots[1], _pytriciasnapshot_add_key, &keys) < 0) {
+        Py_DECREF(keys.list);
+        return NULL;
+    }
+    return keys.list;
 }
 
 static PyObject*
-pytriciaiter_next(PyTriciaIter *iter)
-{
-    while (1) {
-        iter->m_Xnode = iter->m_Xrn;
-        if (iter->m_Xnode) {
-            // advance the iterator; copied from patricia.h macros
-            if (iter->m_Xrn->l) { 
-                if (iter->m_Xrn->r) { 
-                    *(iter->m_Xsp)++ = iter->m_Xrn->r; 
-                } 
-                iter->m_Xrn = iter->m_Xrn->l; 
-            } else if (iter->m_Xrn->r) { 
-                iter->m_Xrn = iter->m_Xrn->r; 
-            } else if (iter->m_Xsp != iter->m_Xstack) { 
-                iter->m_Xrn = *(--iter->m_Xsp); 
-            } else { 
-                iter->m_Xrn = (patricia_node_t *) 0; 
-            } 
+pytriciasnapshot_subscript(PyTriciaSnapshot *self, PyObject *key) {
+    persist_node_t *node;
+    int family, found;
 
-            if (iter->m_Xnode->prefix) {
-                /* build Python value to hand back */
-                char buffer[64];
-                prefix_toa2x(iter->m_Xnode->prefix, buffer, 1);
-                PyObject *rv = Py_BuildValue("s", buffer);
-                return rv;
-            } 
-        } else {
-            PyErr_SetNone(PyExc_StopIteration);
-            return NULL;
-        }
+    if ((found = _pytriciasnapshot_best(self, key, &node, &family)) < 0) {
+        return NULL;
     }
-    // should NEVER get here...
-    assert(NULL);
-    return NULL;
+    if (!found) {
+        PyErr_SetString(PyExc_KeyError, "Prefix not found.");
+        return NULL;
+    }
+    Py_INCREF((PyObject *)node->value);
+    return (PyObject *)node->value;
 }
 
-static void
-pytriciaiter_dealloc(PyTriciaIter *iterobj)
-{
-    if (iterobj->m_Xstack) {
-        free(iterobj->m_Xstack);
+static int
+pytriciasnapshot_contains(PyTriciaSnapshot *self, PyObject *key) {
+    persist_node_t *node;
+    int family;
+    int found = _pytriciasnapshot_best(self, key, &node, &family);
+    if (found < 0) {
+        PyErr_Clear();
+        return 0;
     }
-    Py_DECREF(iterobj->m_parent);
-    Py_TYPE(iterobj)->tp_free((PyObject*)iterobj);    
+    return found;
 }
 
-static PyTypeObject PyTriciaType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "pytricia.PyTricia",       /*tp_name*/
-    sizeof(PyTricia),          /*tp_basicsize*/
-    0,                         /*tp_itemsize*/
-    (destructor)pytricia_dealloc, /*tp_dealloc*/
-    0,                         /*tp_print*/
-    0,                         /*tp_getattr*/
-    0,                         /*tp_setattr*/
-    0,                         /*tp_compare*/
-    0,                         /*tp_repr*/
-    0,                         /*tp_as_number*/
-    &pytricia_as_sequence,     /*tp_as_sequence*/
-    &pytricia_as_mapping,      /*tp_as_mapping*/
-    0,                         /*tp_hash */
-    0,                         /*tp_call*/
-    0,                         /*tp_str*/
-    0,                         /*tp_getattro*/
-    0,                         /*tp_setattro*/
-    0,                         /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
-    "PyTricia objects",        /* tp_doc */
-    0,		               /* tp_traverse */
-    0,		               /* tp_clear */
-    0,		               /* tp_richcompare */
-    0,		               /* tp_weaklistoffset */
-    (getiterfunc)pytricia_iter,	/* tp_iter */
-    0,		               /* tp_iternext */
-    pytricia_methods,          /* tp_methods */
-    0,                         /* tp_members */
-    0,                         /* tp_getset */
-    0,                         /* tp_base */
-    0,                         /* tp_dict */
-    0,                         /* tp_descr_get */
-    0,                         /* tp_descr_set */
-    0,                         /* tp_dictoffset */
-    (initproc)pytricia_init,   /* tp_init */
-    0,                         /* tp_alloc */
-    pytricia_new,              /* tp_new */
+static Py_ssize_t
+pytriciasnapshot_length(PyTriciaSnapshot *self) {
+    return self->m_version.count;
+}
+
+static PyObject *
+pytriciasnapshot_get_version(PyTriciaSnapshot *self, void *closure) {
+    return PyLong_FromUnsignedLongLong(self->m_version.version);
+}
+
+static PyObject *
+pytriciasnapshot_get_time(PyTriciaSnapshot *self, void *closure) {
+    return PyFloat_FromDouble(self->m_version.time);
+}
+
+static PyGetSetDef pytriciasnapshot_getset[] = {
+    {"version", (getter)pytriciasnapshot_get_version, NULL, "The version number.", NULL},
+    {"time", (getter)pytriciasnapshot_get_time, NULL, "When the version was made, as time.time() gives it.", NULL},
+    {NULL}                  /* sentinel */
 };
 
-static PyTypeObject PyTriciaIterType = {
+static PyMethodDef pytriciasnapshot_methods[] = {
+    {"get", (PyCFunction)pytriciasnapshot_get, METH_VARARGS, "get(prefix, [default]) -> object\nReturn the value of the longest prefix matching prefix at this version."},
+    {"get_key", (PyCFunction)pytriciasnapshot_get_key, METH_VARARGS, "get_key(prefix) -> prefix\nReturn the longest prefix matching prefix at this version, or None."},
+    {"has_key", (PyCFunction)pytriciasnapshot_has_key, METH_VARARGS, "has_key(prefix) -> boolean\nReturn true iff prefix itself was in the table at this version."},
+    {"keys", (PyCFunction)pytriciasnapshot_keys, METH_NOARGS, "keys() -> list\nReturn the prefixes in the table at this version, IPv4 first."},
+    {NULL,              NULL}           /* sentinel */
+};
+
+static PyMappingMethods pytriciasnapshot_as_mapping = {
+    (lenfunc)pytriciasnapshot_length,       /* mp_length */
+    (binaryfunc)pytriciasnapshot_subscript, /* mp_subscript */
+    0,                                      /* mp_ass_subscript */
+};
+
+static PySequenceMethods pytriciasnapshot_as_sequence = {
+    (lenfunc)pytriciasnapshot_length,       /*sq_length*/
+    0,                                      /*sq_concat*/
+    0,                                      /*sq_repeat*/
+    0,                                      /*sq_item*/
+    0,                                      /*sq_slice*/
+    0,                                      /*sq_ass_item*/
+    0,                                      /*sq_ass_slice*/
+    (objobjproc)pytriciasnapshot_contains,  /*sq_contains*/
+};
+
+static PyTypeObject PyTriciaSnapshotType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    "pytricia.PyTriciaIter",                /* tp_name */
-    sizeof(PyTriciaIter),                   /* tp_basicsize */
+    "pytricia.PyTriciaSnapshot",            /* tp_name */
+    sizeof(PyTriciaSnapshot),               /* tp_basicsize */
     0,                                      /* tp_itemsize */
-    /* methods */
-    (destructor)pytriciaiter_dealloc,       /* tp_dealloc */
+    (destructor)pytriciasnapshot_dealloc,   /* tp_dealloc */
     0,                                      /* tp_print */
     0,                                      /* tp_getattr */
     0,                                      /* tp_setattr */
     0,                                      /* tp_compare */
     0,                                      /* tp_repr */
     0,                                      /* tp_as_number */
-    0,                                      /* tp_as_sequence */
-    0,                                      /* tp_as_mapping */
+    &pytriciasnapshot_as_sequence,          /* tp_as_sequence */
+    &pytriciasnapshot_as_mapping,           /* tp_as_mapping */
     0,                                      /* tp_hash */
     0,                                      /* tp_call */
     0,                                      /* tp_str */
     0,                                      /* tp_getattro */
     0,                                      /* tp_setattro */
     0,                                      /* tp_as_buffer */
-#if PY_MAJOR_VERSION >= 3
     Py_TPFLAGS_DEFAULT,                     /* tp_flags */
-#else
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_ITER, /* tp_flags */
-#endif
-    "Internal PyTricia iter object",        /* tp_doc */
+    "Read-only view of a PyTricia at one version of its history", /* tp_doc */
     0,                                      /* tp_traverse */
     0,                                      /* tp_clear */
     0,                                      /* tp_richcompare */
     0,                                      /* tp_weaklistoffset */
-    (getiterfunc)pytriciaiter_iter,         /* tp_iter */
-    (iternextfunc)pytriciaiter_next,        /* tp_iternext */
-    0,                                      /* tp_methods */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    pytriciasnapshot_methods,               /* tp_methods */
+    0,                                      /* tp_members */
+    pytriciasnapshot_getset,                /* tp_getset */
 };
 
-static PyObject*
-pytricia_iter(register PyTricia *self, PyObject *unused)
-{
-    PyTriciaIter *iterobj = PyObject_New(PyTriciaIter, &PyTriciaIterType);
-    if (!iterobj) {
-        return NULL;
-    }
-
-    if (!PyObject_Init((PyObject*)iterobj, &PyTriciaIterType)) {
-        Py_XDECREF(iterobj);
-        return NULL;
-    }
-
-    Py_INCREF(self);
-    iterobj->m_parent = self;
-
-    iterobj->m_tree = self->m_tree;
-    iterobj->m_Xnode = NULL;
-    iterobj->m_Xhead = iterobj->m_tree->head;
-    iterobj->m_Xstack = (patricia_node_t**) malloc(sizeof(patricia_node_t*)*(PATRICIA_MAXBITS+1));
-    if (!iterobj->m_Xstack) {
-        Py_DECREF(iterobj->m_parent);
-        Py_TYPE(iterobj)->tp_free((PyObject*)iterobj);
-        return PyErr_NoMemory();
-    }
- 
-    iterobj->m_Xsp = iterobj->m_Xstack;
-    iterobj->m_Xrn = iterobj->m_Xhead;
-    return (PyObject*)iterobj;
-}
-
-
 PyDoc_STRVAR(pytricia_doc,
 "Yet another patricia tree module in Python.  But this one's better.\n\
 ");
@@ -850,7 +5871,7 @@ static struct PyModuleDef pytricia_moduledef = {
     "pytricia",       /* m_name */
     pytricia_doc,     /* m_doc */
     -1,               /* m_size */
-    NULL,             /* m_methods */
+    pytricia_module_methods, /* m_methods */
     NULL,             /* m_reload */
     NULL,             /* m_traverse */
     NULL,             /* m_clear */
@@ -887,10 +5908,45 @@ initpytricia(void)
         return;
 #endif
 
+    if (PyType_Ready(&PyTriciaHHHType) < 0)
+#if PY_MAJOR_VERSION == 3
+        return NULL;
+#else
+        return;
+#endif
+
+    if (PyType_Ready(&PyTricia2DType) < 0)
+#if PY_MAJOR_VERSION == 3
+        return NULL;
+#else
+        return;
+#endif
+
+    if (PyType_Ready(&PyTriciaTernaryType) < 0)
+#if PY_MAJOR_VERSION == 3
+        return NULL;
+#else
+        return;
+#endif
+
+    if (PyType_Ready(&PyTriciaVRFType) < 0)
+#if PY_MAJOR_VERSION == 3
+        return NULL;
+#else
+        return;
+#endif
+
+    if (PyType_Ready(&PyTriciaSnapshotType) < 0)
+#if PY_MAJOR_VERSION == 3
+        return NULL;
+#else
+        return;
+#endif
+
 #if PY_MAJOR_VERSION == 3
     m = PyModule_Create(&pytricia_moduledef);
 #else
-    m = Py_InitModule3("pytricia", NULL, pytricia_doc);
+    m = Py_InitModule3("pytricia", pytricia_module_methods, pytricia_doc);
 #endif
     if (m == NULL)
 #if PY_MAJOR_VERSION == 3 
@@ -902,6 +5958,14 @@ initpytricia(void)
     Py_INCREF(&PyTriciaType);
     Py_INCREF(&PyTriciaIterType);
     PyModule_AddObject(m, "PyTricia", (PyObject *)&PyTriciaType);
+    Py_INCREF(&PyTriciaHHHType);
+    PyModule_AddObject(m, "PyTriciaHHH", (PyObject *)&PyTriciaHHHType);
+    Py_INCREF(&PyTricia2DType);
+    PyModule_AddObject(m, "PyTricia2D", (PyObject *)&PyTricia2DType);
+    Py_INCREF(&PyTriciaTernaryType);
+    PyModule_AddObject(m, "PyTriciaTernary", (PyObject *)&PyTriciaTernaryType);
+    Py_INCREF(&PyTriciaVRFType);
+    PyModule_AddObject(m, "PyTriciaVRF", (PyObject *)&PyTriciaVRFType);
 
     // JS: don't add the PyTriciaIter object to the public interface.  users shouldn't be
     // able to create iterator objects w/o calling __iter__ on a pytricia object.
@@ -0,0 +1,215 @@
+/*
+ * This file is part of Pytricia.
+ * Joel Sommers <jsommers@colgate.edu>
+ *
+ * Pytricia is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pytricia is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Pytricia.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "rules2d.h"
+
+typedef struct {
+    long priority;
+    void *value;
+    const void *best;           /* best rule here or above: a rule2d_t */
+} rule2d_t;
+
+struct _rules2d_t {
+    patricia_tree_t *src;       /* node data: patricia_tree_t of dst */
+    int maxbits;
+    size_t count;
+    void_fn1_t free_value;
+};
+
+rules2d_t *
+rules2d_new(int maxbits, void_fn1_t free_value) {
+    rules2d_t *rules = calloc(1, sizeof(*rules));
+
+    if (!rules) {
+        return NULL;
+    }
+    rules->maxbits = maxbits;
+    rules->free_value = free_value;
+    rules->src = New_Patricia(maxbits);
+    if (!rules->src) {
+        free(rules);
+        return NULL;
+    }
+    return rules;
+}
+
+static void
+_rules2d_free_rule(rules2d_t *rules, rule2d_t *rule) {
+    if (rules->free_value) {
+        rules->free_value(rule->value);
+    }
+    free(rule);
+}
+
+void
+rules2d_free(rules2d_t *rules) {
+    patricia_node_t *snode, *dnode;
+
+    if (!rules) {
+        return;
+    }
+    PATRICIA_WALK(rules->src->head, snode) {
+        patricia_tree_t *dst = snode->data;
+        PATRICIA_WALK(dst->head, dnode) {
+            _rules2d_free_rule(rules, dnode->data);
+        } PATRICIA_WALK_END;
+        Destroy_Patricia(dst, NULL);
+    } PATRICIA_WALK_END;
+    Destroy_Patricia(rules->src, NULL);
+    free(rules);
+}
+
+size_t
+rules2d_count(rules2d_t *rules) {
+    return rules->count;
+}
+
+/* nearest ancestor that holds a prefix */
+static patricia_node_t *
+_rules2d_parent(patricia_node_t *node) {
+    patricia_node_t *parent = node->parent;
+    while (parent && !parent->prefix) {
+        parent = parent->parent;
+    }
+    return parent;
+}
+
+/* recompute the best rule for every node under top, parents first */
+static void
+_rules2d_propagate(patricia_node_t *top) {
+    patricia_node_t *node;
+
+    PATRICIA_WALK(top, node) {
+        rule2d_t *rule = node->data;
+        patricia_node_t *parent = _rules2d_parent(node);
+        const rule2d_t *inherited = parent ? ((rule2d_t *)parent->data)->best : NULL;
+        rule->best = inherited && inherited->priority > rule->priority ? inherited : rule;
+    } PATRICIA_WALK_END;
+}
+
+int
+rules2d_add(rules2d_t *rules, prefix_t *src, prefix_t *dst, long priority, void *value) {
+    patricia_node_t *snode = patricia_lookup(rules->src, src);
+    patricia_node_t *dnode;
+    patricia_tree_t *dtree;
+    rule2d_t *rule;
+
+    if (!snode) {
+        return -1;
+    }
+    if (!snode->data) {
+        snode->data = New_Patricia(rules->maxbits);
+        if (!snode->data) {
+            patricia_remove(rules->src, snode);
+            return -1;
+        }
+    }
+    dtree = snode->data;
+    dnode = patricia_lookup(dtree, dst);
+    if (!dnode) {
+        if (!dtree->head) {
+            Destroy_Patricia(dtree, NULL);
+            patricia_remove(rules->src, snode);
+        }
+        return -1;
+    }
+    rule = dnode->data;
+    if (rule) {
+        if (rules->free_value) {
+            rules->free_value(rule->value);
+        }
+    } else {
+        rule = calloc(1, sizeof(*rule));
+        if (!rule) {
+            patricia_remove(dtree, dnode);
+            if (!dtree->head) {
+                Destroy_Patricia(dtree, NULL);
+                patricia_remove(rules->src, snode);
+            }
+            return -1;
+        }
+        dnode->data = rule;
+        rules->count++;
+    }
+    rule->priority = priority;
+    rule->value = value;
+    _rules2d_propagate(dnode);
+    return 0;
+}
+
+int
+rules2d_remove(rules2d_t *rules, prefix_t *src, prefix_t *dst) {
+    patricia_node_t *snode = patricia_search_exact(rules->src, src);
+    patricia_node_t *dnode;
+    patricia_tree_t *dtree;
+
+    if (!snode) {
+        return -1;
+    }
+    dtree = snode->data;
+    dnode = patricia_search_exact(dtree, dst);
+    if (!dnode) {
+        return -1;
+    }
+    _rules2d_free_rule(rules, dnode->data);
+    dnode->data = NULL;
+    patricia_remove(dtree, dnode);
+    rules->count--;
+
+    if (!dtree->head) {
+        Destroy_Patricia(dtree, NULL);
+        snode->data = NULL;
+        patricia_remove(rules->src, snode);
+    } else {
+        _rules2d_propagate(dtree->head);
+    }
+    return 0;
+}
+
+void *
+rules2d_match(rules2d_t *rules, prefix_t *src, prefix_t *dst) {
+    patricia_node_t *snode = patricia_search_best(rules->src, src);
+    const rule2d_t *best = NULL;
+
+    // every source prefix that matches is on the way up from the best one
+    for (; snode; snode = _rules2d_parent(snode)) {
+        patricia_node_t *dnode = patricia_search_best(snode->data, dst);
+        if (dnode) {
+            const rule2d_t *found = ((rule2d_t *)dnode->data)->best;
+            if (!best || found->priority > best->priority) {
+                best = found;
+            }
+        }
+    }
+    return best ? best->value : NULL;
+}
+
+void
+rules2d_walk(rules2d_t *rules, rules2d_fn_t fn, void *arg) {
+    patricia_node_t *snode, *dnode;
+
+    PATRICIA_WALK(rules->src->head, snode) {
+        patricia_tree_t *dst = snode->data;
+        PATRICIA_WALK(dst->head, dnode) {
+            rule2d_t *rule = dnode->data;
+            fn(snode->prefix, dnode->prefix, rule->priority, rule->value, arg);
+        } PATRICIA_WALK_END;
+    } PATRICIA_WALK_END;
+}
@@ -0,0 +1,60 @@
+/*
+ * This file is part of Pytricia.
+ * Joel Sommers <jsommers@colgate.edu>
+ *
+ * Pytricia is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pytricia is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Pytricia.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Two-dimensional (source, destination) prefix-pair rules, kept as
+ * hierarchical tries: a patricia tree of source prefixes, each holding a
+ * patricia tree of the destination prefixes paired with it.
+ *
+ * Every destination node also carries the best rule among itself and the
+ * destination prefixes above it, so one longest-match lookup per matching
+ * source prefix finds the best rule for that source.  The best rule has
+ * the highest priority; ties go to the more specific source, then the
+ * more specific destination.
+ */
+
+#ifndef _RULES2D_H
+#define _RULES2D_H
+
+#include <stddef.h>
+#include "patricia.h"
+
+typedef struct _rules2d_t rules2d_t;
+
+/* free_value is called on each value the table lets go of; may be NULL */
+rules2d_t *rules2d_new (int maxbits, void_fn1_t free_value);
+void rules2d_free (rules2d_t *rules);
+
+size_t rules2d_count (rules2d_t *rules);
+
+/* add or replace the rule for (src, dst); -1 if memory runs out */
+int rules2d_add (rules2d_t *rules, prefix_t *src, prefix_t *dst,
+                 long priority, void *value);
+
+/* 0 if removed, -1 if there's no such rule */
+int rules2d_remove (rules2d_t *rules, prefix_t *src, prefix_t *dst);
+
+/* value of the best rule matching a (src, dst) pair of addresses, or NULL */
+void *rules2d_match (rules2d_t *rules, prefix_t *src, prefix_t *dst);
+
+/* call fn for every rule, sources then destinations in walk order */
+typedef void (*rules2d_fn_t) (prefix_t *src, prefix_t *dst, long priority,
+                              void *value, void *arg);
+void rules2d_walk (rules2d_t *rules, rules2d_fn_t fn, void *arg);
+
+#endif /* _RULES2D_H */
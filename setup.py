@@ -36,7 +36,7 @@ setup(name="pytricia",
               "Topic :: Scientific/Engineering",
       ],
       ext_modules=[
-         Extension("pytricia", ["pytricia.c","patricia.c"]),
+         Extension("pytricia", ["pytricia.c","patricia.c","frozen.c","hhh.c","rules2d.c","ternary.c","wheel.c","persist.c"]),
          ],
       long_description='''
 Pytricia is a Python module to store IP prefixes in a
@@ -0,0 +1,394 @@
+/*
+ * This file is part of Pytricia.
+ * Joel Sommers <jsommers@colgate.edu>
+ *
+ * Pytricia is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pytricia is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Pytricia.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include "ternary.h"
+
+typedef struct {
+    uint64_t hi, lo;
+} key128_t;
+
+typedef struct {
+    key128_t value;             /* masked */
+    long priority;
+    unsigned long seq;          /* insertion order, for ties */
+    void *data;
+} trule_t;
+
+/* all rules sharing one mask, hashed by masked value (linear probing) */
+typedef struct {
+    key128_t mask;
+    long best;                  /* highest priority in the group */
+    size_t count, cap;
+    trule_t **slots;
+} tgroup_t;
+
+struct _ternary_t {
+    int width;
+    void_fn1_t free_value;
+    size_t count;
+    unsigned long seq;
+    size_t ngroups, groups_cap;
+    tgroup_t **groups;          /* by best priority, highest first */
+};
+
+static key128_t
+_tkey(const ternary_t *ternary, const u_char *bytes) {
+    key128_t k = {0, 0};
+    int i;
+
+    for (i = 0; i < ternary->width && i < 8; i++) {
+        k.hi = k.hi << 8 | bytes[i];
+    }
+    for (; i < ternary->width; i++) {
+        k.lo = k.lo << 8 | bytes[i];
+    }
+    return k;
+}
+
+static void
+_tbytes(const ternary_t *ternary, key128_t k, u_char *out) {
+    int i;
+
+    for (i = ternary->width; i-- > 8;) {
+        out[i] = (u_char)k.lo;
+        k.lo >>= 8;
+    }
+    for (i = (ternary->width < 8 ? ternary->width : 8); i-- > 0;) {
+        out[i] = (u_char)k.hi;
+        k.hi >>= 8;
+    }
+}
+
+static key128_t
+_tand(key128_t a, key128_t b) {
+    a.hi &= b.hi;
+    a.lo &= b.lo;
+    return a;
+}
+
+static int
+_teq(key128_t a, key128_t b) {
+    return a.hi == b.hi && a.lo == b.lo;
+}
+
+static size_t
+_thash(key128_t k, size_t mask) {
+    uint64_t h = k.hi * 0x9e3779b97f4a7c15ULL ^ k.lo;
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 29;
+    return (size_t)h & mask;
+}
+
+ternary_t *
+ternary_new(int family, void_fn1_t free_value) {
+    ternary_t *ternary = calloc(1, sizeof(*ternary));
+
+    if (ternary) {
+        ternary->width = family == AF_INET6 ? 16 : 4;
+        ternary->free_value = free_value;
+    }
+    return ternary;
+}
+
+static void
+_tgroup_free(ternary_t *ternary, tgroup_t *group) {
+    size_t i;
+
+    for (i = 0; i < group->cap; i++) {
+        if (group->slots[i]) {
+            if (ternary->free_value) {
+                ternary->free_value(group->slots[i]->data);
+            }
+            free(group->slots[i]);
+        }
+    }
+    free(group->slots);
+    free(group);
+}
+
+void
+ternary_free(ternary_t *ternary) {
+    size_t i;
+
+    if (!ternary) {
+        return;
+    }
+    for (i = 0; i < ternary->ngroups; i++) {
+        _tgroup_free(ternary, ternary->groups[i]);
+    }
+    free(ternary->groups);
+    free(ternary);
+}
+
+size_t
+ternary_count(ternary_t *ternary) {
+    return ternary->count;
+}
+
+size_t
+ternary_masks(ternary_t *ternary) {
+    return ternary->ngroups;
+}
+
+/* slot holding value, or the empty slot where it would go */
+static size_t
+_tgroup_slot(const tgroup_t *group, key128_t value) {
+    size_t h = _thash(value, group->cap - 1);
+    while (group->slots[h] && !_teq(group->slots[h]->value, value)) {
+        h = (h + 1) & (group->cap - 1);
+    }
+    return h;
+}
+
+static int
+_tgroup_grow(tgroup_t *group) {
+    size_t i, oldcap = group->cap;
+    trule_t **old = group->slots;
+
+    group->cap = oldcap ? oldcap * 2 : 8;
+    group->slots = calloc(group->cap, sizeof(*group->slots));
+    if (!group->slots) {
+        group->slots = old;
+        group->cap = oldcap;
+        return -1;
+    }
+    for (i = 0; i < oldcap; i++) {
+        if (old[i]) {
+            group->slots[_tgroup_slot(group, old[i]->value)] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/* keep groups ordered by best priority after group i changed */
+static void
+_tgroups_reorder(ternary_t *ternary, size_t i) {
+    tgroup_t **g = ternary->groups;
+    while (i > 0 && g[i - 1]->best < g[i]->best) {
+        tgroup_t *t = g[i - 1];
+        g[i - 1] = g[i];
+        g[i] = t;
+        i--;
+    }
+    while (i + 1 < ternary->ngroups && g[i + 1]->best > g[i]->best) {
+        tgroup_t *t = g[i + 1];
+        g[i + 1] = g[i];
+        g[i] = t;
+        i++;
+    }
+}
+
+/* the highest priority of any rule in the group, from scratch */
+static void
+_tgroup_rescan(tgroup_t *group) {
+    size_t slot;
+
+    group->best = LONG_MIN;
+    for (slot = 0; slot < group->cap; slot++) {
+        if (group->slots[slot] && group->slots[slot]->priority > group->best) {
+            group->best = group->slots[slot]->priority;
+        }
+    }
+}
+
+static long
+_tgroup_find(ternary_t *ternary, key128_t mask) {
+    size_t i;
+    for (i = 0; i < ternary->ngroups; i++) {
+        if (_teq(ternary->groups[i]->mask, mask)) {
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+int
+ternary_add(ternary_t *ternary, const u_char *value, const u_char *mask, long priority, void *data) {
+    key128_t m = _tkey(ternary, mask);
+    key128_t v = _tand(_tkey(ternary, value), m);
+    long gi = _tgroup_find(ternary, m);
+    tgroup_t *group;
+    size_t slot;
+    int lowered = 0, created = gi < 0;
+
+    if (gi < 0) {
+        if (ternary->ngroups == ternary->groups_cap) {
+            size_t cap = ternary->groups_cap ? ternary->groups_cap * 2 : 8;
+            tgroup_t **grown = realloc(ternary->groups, cap * sizeof(*grown));
+            if (!grown) {
+                return -1;
+            }
+            ternary->groups = grown;
+            ternary->groups_cap = cap;
+        }
+        group = calloc(1, sizeof(*group));
+        if (!group || _tgroup_grow(group) < 0) {
+            free(group);
+            return -1;
+        }
+        group->mask = m;
+        group->best = priority;
+        gi = (long)ternary->ngroups;
+        ternary->groups[ternary->ngroups++] = group;
+    }
+    group = ternary->groups[gi];
+
+    if ((group->count + 1) * 2 > group->cap && _tgroup_grow(group) < 0) {
+        return -1;
+    }
+    slot = _tgroup_slot(group, v);
+    if (group->slots[slot]) {
+        trule_t *rule = group->slots[slot];
+        if (ternary->free_value) {
+            ternary->free_value(rule->data);
+        }
+        rule->data = data;
+        lowered = rule->priority == group->best && priority < rule->priority;
+        rule->priority = priority;
+    } else {
+        trule_t *rule = malloc(sizeof(*rule));
+        if (!rule) {
+            // don't leave behind an empty group whose best no rule holds
+            if (created) {
+                _tgroup_free(ternary, group);
+                ternary->ngroups--;
+            }
+            return -1;
+        }
+        rule->value = v;
+        rule->priority = priority;
+        rule->seq = ternary->seq++;
+        rule->data = data;
+        group->slots[slot] = rule;
+        group->count++;
+        ternary->count++;
+    }
+
+    // only a replaced rule that held the group's best can lower it
+    if (lowered) {
+        _tgroup_rescan(group);
+    } else if (priority > group->best) {
+        group->best = priority;
+    }
+    _tgroups_reorder(ternary, (size_t)gi);
+    return 0;
+}
+
+int
+ternary_remove(ternary_t *ternary, const u_char *value, const u_char *mask) {
+    key128_t m = _tkey(ternary, mask);
+    key128_t v = _tand(_tkey(ternary, value), m);
+    long gi = _tgroup_find(ternary, m);
+    tgroup_t *group;
+    size_t slot, next;
+    long priority;
+
+    if (gi < 0) {
+        return -1;
+    }
+    group = ternary->groups[gi];
+    slot = _tgroup_slot(group, v);
+    if (!group->slots[slot]) {
+        return -1;
+    }
+    if (ternary->free_value) {
+        ternary->free_value(group->slots[slot]->data);
+    }
+    priority = group->slots[slot]->priority;
+    free(group->slots[slot]);
+    group->slots[slot] = NULL;
+    group->count--;
+    ternary->count--;
+
+    // shift later members of the probe run back over the hole
+    for (next = (slot + 1) & (group->cap - 1); group->slots[next]; next = (next + 1) & (group->cap - 1)) {
+        size_t home = _thash(group->slots[next]->value, group->cap - 1);
+        if (((next - home) & (group->cap - 1)) >= ((next - slot) & (group->cap - 1))) {
+            group->slots[slot] = group->slots[next];
+            group->slots[next] = NULL;
+            slot = next;
+        }
+    }
+
+    if (group->count == 0) {
+        _tgroup_free(ternary, group);
+        memmove(&ternary->groups[gi], &ternary->groups[gi + 1],
+                (ternary->ngroups - gi - 1) * sizeof(*ternary->groups));
+        ternary->ngroups--;
+        return 0;
+    }
+    // only removing a rule that held the group's best can lower it
+    if (priority == group->best) {
+        _tgroup_rescan(group);
+        _tgroups_reorder(ternary, (size_t)gi);
+    }
+    return 0;
+}
+
+void *
+ternary_match(ternary_t *ternary, const u_char *addr) {
+    key128_t a = _tkey(ternary, addr);
+    const trule_t *best = NULL;
+    size_t i;
+
+    for (i = 0; i < ternary->ngroups; i++) {
+        const tgroup_t *group = ternary->groups[i];
+        const trule_t *rule;
+        if (best && group->best < best->priority) {
+            break;
+        }
+        rule = group->slots[_tgroup_slot(group, _tand(a, group->mask))];
+        if (rule && (!best || rule->priority > best->priority ||
+                     (rule->priority == best->priority && rule->seq < best->seq))) {
+            best = rule;
+        }
+    }
+    return best ? best->data : NULL;
+}
+
+void
+ternary_walk(ternary_t *ternary, ternary_fn_t fn, void *arg) {
+    u_char value[16], mask[16];
+    size_t i, j;
+
+    for (i = 0; i < ternary->ngroups; i++) {
+        tgroup_t *group = ternary->groups[i];
+        _tbytes(ternary, group->mask, mask);
+        for (j = 0; j < group->cap; j++) {
+            trule_t *rule = group->slots[j];
+            if (rule) {
+                _tbytes(ternary, rule->value, value);
+                fn(value, mask, rule->priority, rule->data, arg);
+            }
+        }
+    }
+}
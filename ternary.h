@@ -0,0 +1,63 @@
+/*
+ * This file is part of Pytricia.
+ * Joel Sommers <jsommers@colgate.edu>
+ *
+ * Pytricia is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pytricia is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Pytricia.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Ternary (value, mask) rules with arbitrary, non-contiguous masks, matched
+ * by tuple space search: rules are grouped by mask, each group is a hash
+ * table keyed by the masked value, and a lookup probes one table per
+ * distinct mask.  Groups are probed in order of their best priority, so a
+ * lookup stops as soon as no remaining group can beat what it has found.
+ *
+ * The highest priority wins; ties go to the rule added first.
+ */
+
+#ifndef _TERNARY_H
+#define _TERNARY_H
+
+#include <stddef.h>
+#include "patricia.h"
+
+typedef struct _ternary_t ternary_t;
+
+/* family picks 4- or 16-byte keys; free_value is called on each value the
+ * table lets go of, and may be NULL */
+ternary_t *ternary_new (int family, void_fn1_t free_value);
+void ternary_free (ternary_t *ternary);
+
+size_t ternary_count (ternary_t *ternary);
+size_t ternary_masks (ternary_t *ternary);
+
+/* add or replace the rule for (value, mask), both network order; a mask
+ * bit of 1 means the address bit must equal the value's.  -1 if memory
+ * runs out */
+int ternary_add (ternary_t *ternary, const u_char *value, const u_char *mask,
+                 long priority, void *data);
+
+/* 0 if removed, -1 if there's no such rule */
+int ternary_remove (ternary_t *ternary, const u_char *value,
+                    const u_char *mask);
+
+/* data of the best rule matching addr, or NULL */
+void *ternary_match (ternary_t *ternary, const u_char *addr);
+
+/* call fn for every rule, grouped by mask; value is already masked */
+typedef void (*ternary_fn_t) (const u_char *value, const u_char *mask,
+                              long priority, void *data, void *arg);
+void ternary_walk (ternary_t *ternary, ternary_fn_t fn, void *arg);
+
+#endif /* _TERNARY_H */
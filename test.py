@@ -20,9 +20,17 @@ from __future__ import print_function
 
 import unittest
 import pytricia
+import random
+import array
 import socket
 import struct
 import sys
+import ctypes
+import os
+import shutil
+import subprocess
+import tempfile
+import time
 
 def dumppyt(t):
     print ("\nDumping Pytricia")
@@ -385,6 +393,807 @@ class PyTriciaTests(unittest.TestCase):
             pyt.parent("2001:db8:42:42::/64")
         self.assertIsInstance(cm.exception, KeyError)
 
+    def testRanges(self):
+        pyt = pytricia.PyTricia()
+        self.assertEqual(pyt.insert_range("10.0.0.5", "10.0.1.200", 'x'), 11)
+        self.assertIn("10.0.0.5/32", pyt.keys())
+        self.assertIn("10.0.1.0/25", pyt.keys())
+        self.assertEqual(pyt.get("10.0.0.4"), None)
+        self.assertEqual(pyt.get("10.0.1.200"), 'x')
+        self.assertEqual(pyt.get("10.0.1.201"), None)
+        with self.assertRaises(ValueError):
+            pyt.insert_range("10.0.0.5", "10.0.0.1", 'y')
+
+        pyt = pytricia.PyTricia()
+        self.assertEqual(pyt.load_ranges(array.array('I', [0x0a000000, 0x0b000001]),
+                                         array.array('I', [0x0a0000ff, 0x0b000002]), ['a', 'b']), 3)
+        self.assertListEqual(sorted(pyt.keys()), ['10.0.0.0/24', '11.0.0.1/32', '11.0.0.2/32'])
+
+        pyt = pytricia.PyTricia()
+        pyt["0.0.0.0/0"] = 'all'
+        pyt["10.0.0.0/8"] = 'a'
+        pyt["10.1.0.0/16"] = 'b'
+        self.assertListEqual(pyt.segment("9.0.0.0", "10.1.5.5"),
+                             [('9.0.0.0', '9.255.255.255', '0.0.0.0/0'),
+                              ('10.0.0.0', '10.0.255.255', '10.0.0.0/8'),
+                              ('10.1.0.0', '10.1.5.5', '10.1.0.0/16')])
+        del pyt["0.0.0.0/0"]
+        self.assertListEqual(pyt.segment("9.255.255.255", "10.0.0.0"),
+                             [('9.255.255.255', '9.255.255.255', None), ('10.0.0.0', '10.0.0.0', '10.0.0.0/8')])
+
+    def testGetMany(self):
+        pyt = pytricia.PyTricia()
+        pyt.insert("10.0.0.0/8", "a")
+        pyt.insert("10.1.0.0/16", "b")
+        self.assertListEqual(pyt.get_many(["10.1.2.3", "10.2.0.0", "11.0.0.0"]), ['b', 'a', None])
+        self.assertListEqual(pyt.get_many(["11.0.0.0"], "X"), ['X'])
+        packed = socket.inet_aton("10.1.2.3") + socket.inet_aton("10.2.0.0")
+        self.assertListEqual(pyt.get_many(packed), ['b', 'a'])
+        if sys.version_info.major == 3:
+            import array
+            addrs = array.array('I', [0x0a010203, 0x0b000000])
+            self.assertListEqual(pyt.get_many(addrs), ['b', None])
+            with self.assertRaises(ValueError) as cm:
+                pyt.get_many(b"\x0a\x00\x00")
+            # ctypes arrays carry a byte order in their format, e.g. "<I"
+            little = (ctypes.c_uint32 * 2)(0x0a010203, 0x0b000000)
+            big = (ctypes.c_uint32.__ctype_be__ * 2)(0x0a010203, 0x0b000000)
+            self.assertListEqual(pyt.get_many(little), ['b', None])
+            self.assertListEqual(pyt.get_many(big), ['b', None])
+            with self.assertRaises(ValueError):
+                pyt.get_many((ctypes.c_float * 2)(1.0, 2.0))
+        with self.assertRaises(ValueError) as cm:
+            pyt.get_many(["10.0.0.1", "apple"])
+
+    def testAccumulate(self):
+        pyt = pytricia.PyTricia()
+        pyt["10.0.0.0/8"] = 'a'
+        pyt["10.1.0.0/16"] = 'b'
+        pyt["192.168.0.0/16"] = 'c'
+        addrs = ["10.0.0.1", "10.1.1.1", "10.1.2.2", "1.1.1.1", "192.168.3.3"]
+        self.assertDictEqual(pyt.accumulate(addrs, [100, 200, 50, 7, 1]),
+                             {"10.0.0.0/8": 100.0, "10.1.0.0/16": 250.0, "192.168.0.0/16": 1.0})
+        self.assertDictEqual(pyt.accumulate(addrs), {"10.0.0.0/8": 1.0, "10.1.0.0/16": 2.0, "192.168.0.0/16": 1.0})
+
+        packed = array.array('I', [0x0a000001, 0x0a010101, 0x0a010102])
+        out = array.array('d', [0.0] * len(pyt))
+        pyt.freeze()
+        pyt.accumulate(packed, array.array('H', [1, 2, 3]), out=out)
+        pyt.accumulate(packed, array.array('H', [1, 2, 3]), out=out)
+        self.assertListEqual(list(out), [2.0, 10.0, 0.0])
+        with self.assertRaises(ValueError):
+            pyt.accumulate(addrs, [1, 2])
+        with self.assertRaises(ValueError):
+            pyt.accumulate(addrs, out=array.array('d', [0.0]))
+
+        # weight buffers in either byte order, e.g. ctypes arrays ('<d', '>H')
+        three = addrs[:3]
+        self.assertDictEqual(pyt.accumulate(three, (ctypes.c_double * 3)(1.5, 2, 3)),
+                             {"10.0.0.0/8": 1.5, "10.1.0.0/16": 5.0})
+        self.assertDictEqual(pyt.accumulate(three, (ctypes.c_int32 * 3)(-1, 2, 3)),
+                             {"10.0.0.0/8": -1.0, "10.1.0.0/16": 5.0})
+        self.assertDictEqual(pyt.accumulate(three, (ctypes.c_uint16.__ctype_be__ * 3)(1, 2, 0x100)),
+                             {"10.0.0.0/8": 1.0, "10.1.0.0/16": 258.0})
+        with self.assertRaises(ValueError):
+            pyt.accumulate(three, memoryview(bytes(6)).cast('e'))
+
+        pyt = pytricia.PyTricia(hide_expired=True)
+        pyt["10.0.0.0/8"] = 'a'
+        pyt.insert("10.1.0.0/16", 'gone', ttl=0)
+        self.assertDictEqual(pyt.accumulate(["10.1.2.3", "10.2.0.0"]), {"10.0.0.0/8": 2.0})
+
+    def testAccumulateReferences(self):
+        # entries only ever counted through accumulate are still in use
+        cache = pytricia.PyTricia(max_entries=3)
+        cache["10.0.0.0/16"] = 'a'
+        cache["10.1.0.0/16"] = 'b'
+        cache["10.2.0.0/16"] = 'c'
+        cache["10.3.0.0/16"] = 'd'
+        self.assertListEqual(sorted(cache.keys()), ["10.1.0.0/16", "10.2.0.0/16", "10.3.0.0/16"])
+        cache.accumulate(["10.1.1.1", "10.3.1.1"])
+        cache["10.4.0.0/16"] = 'e'
+        self.assertListEqual(sorted(cache.keys()), ["10.1.0.0/16", "10.3.0.0/16", "10.4.0.0/16"])
+
+    def testFreeze(self):
+        pyt = pytricia.PyTricia()
+        pyt["0.0.0.0/0"] = 'default'
+        pyt["10.0.0.0/8"] = 'a'
+        pyt["10.1.0.0/16"] = 'b'
+        pyt["10.1.1.1/32"] = 'c'
+        addrs = ["{}.{}.1.{}".format(i, j, k) for i in (9, 10, 11) for j in range(4) for k in range(4)]
+        expected = [pyt[a] for a in addrs]
+        pyt.freeze()
+        self.assertListEqual([pyt[a] for a in addrs], expected)
+        self.assertListEqual(pyt.get_many(addrs), expected)
+        self.assertEqual(pyt.get_key("10.1.1.1"), "10.1.1.1/32")
+        self.assertEqual(pyt.get_key("10.1.1.0/24"), "10.1.0.0/16")
+        self.assertTrue("172.16.0.1" in pyt)
+
+        # updates show up in a frozen table
+        del pyt["0.0.0.0/0"]
+        pyt["10.1.1.0/24"] = 'd'
+        self.assertFalse("172.16.0.1" in pyt)
+        self.assertEqual(pyt["10.1.1.2"], 'd')
+        self.assertEqual(pyt.get_many(["10.1.1.1", "10.1.1.2", "9.0.0.0"]), ['c', 'd', None])
+        pyt.thaw()
+        self.assertEqual(pyt["10.1.1.2"], 'd')
+
+        pyt6 = pytricia.PyTricia(128, socket.AF_INET6)
+        pyt6["2001:db8::/32"] = 'x'
+        pyt6["2001:db8:1::/48"] = 'y'
+        pyt6.freeze()
+        self.assertListEqual(pyt6.get_many(["2001:db8:1::1", "2001:db8:2::1", "3000::1"]), ['y', 'x', None])
+        packed = socket.inet_pton(socket.AF_INET6, "2001:db8:1::1")
+        self.assertListEqual(pyt6.get_many(packed), ['y'])
+
+        with self.assertRaises(ValueError) as cm:
+            pyt.freeze(engine="bogus")
+        pyt6["10.0.0.0/8"] = 'v4'
+        with self.assertRaises(ValueError) as cm:
+            pyt6.freeze()
+
+    def testFreezeEngines(self):
+        for engine in ['flat', 'interval', 'poptrie']:
+            pyt = pytricia.PyTricia()
+            pyt["0.0.0.0/1"] = 'low'
+            pyt["10.0.0.0/8"] = 'a'
+            pyt["10.0.0.0/16"] = 'b'
+            pyt["10.0.0.128/25"] = 'c'
+            pyt["10.255.255.255/32"] = 'd'
+            pyt["255.255.255.255/32"] = 'top'
+            addrs = ["0.0.0.0", "9.255.255.255", "10.0.0.0", "10.0.0.127", "10.0.0.128",
+                     "10.0.255.255", "10.1.0.0", "10.255.255.254", "10.255.255.255",
+                     "11.0.0.0", "127.255.255.255", "128.0.0.0", "255.255.255.254", "255.255.255.255"]
+            expected = [pyt.get_key(a) for a in addrs]
+            pyt.freeze(engine=engine)
+            self.assertListEqual([pyt.get_key(a) for a in addrs], expected, engine)
+            self.assertListEqual(pyt.get_many(addrs), [pyt.get(a) for a in addrs], engine)
+
+            pyt6 = pytricia.PyTricia(128, socket.AF_INET6)
+            pyt6["2001:db8::/32"] = 'x'
+            pyt6["2001:db8:0:1::/64"] = 'y'
+            pyt6["ffff::/16"] = 'z'
+            pyt6.freeze(engine=engine)
+            self.assertListEqual(pyt6.get_many(["2001:db8::1", "2001:db8:0:1::1", "2001:db8:0:2::",
+                                                "2001:db9::", "ffff:ffff::", "fffe::1"]),
+                                 ['x', 'y', 'x', None, 'z', None], engine)
+
+    def testFreezePatch(self):
+        pyt = pytricia.PyTricia()
+        ref = pytricia.PyTricia()
+        for i in range(64):
+            pyt["10.%d.0.0/16" % i] = ref["10.%d.0.0/16" % i] = i
+        pyt.freeze(engine='poptrie')
+        addrs = ["10.%d.%d.1" % (i, j) for i in range(0, 70, 3) for j in (0, 128, 255)] + ["0.0.0.0", "255.255.255.255"]
+        changes = [("10.3.128.0/17", 'a'), ("10.0.0.0/8", 'b'), ("10.3.0.0/16", None),
+                   ("0.0.0.0/0", 'c'), ("10.9.0.0/24", 'd'), ("10.0.0.0/8", None), ("0.0.0.0/0", None)]
+        for prefix, value in changes:
+            for t in (pyt, ref):
+                if value is None:
+                    del t[prefix]
+                else:
+                    t[prefix] = value
+            self.assertListEqual([pyt.get(a) for a in addrs], [ref.get(a) for a in addrs], prefix)
+
+    def testStats(self):
+        pyt = pytricia.PyTricia()
+        pyt["10.0.0.0/8"] = 'a'
+        pyt["10.1.0.0/16"] = 'b'
+        pyt["10.2.0.0/16"] = 'c'
+        stats = pyt.stats()
+        self.assertEqual(stats['prefixes'], 3)
+        self.assertEqual(stats['ipv4'], 3)
+        self.assertEqual(stats['ipv6'], 0)
+        self.assertEqual(stats['nodes'], stats['prefixes'] + stats['glue'])
+        self.assertDictEqual(stats['lengths'], {8: 1, 16: 2})
+        self.assertEqual(stats['changes'], 3)
+        self.assertIsNone(stats['engine'])
+        pyt.freeze(engine='poptrie')
+        self.assertEqual(pyt.stats()['engine'], 'poptrie')
+
+    def testFreezeAuto(self):
+        pyt = pytricia.PyTricia()
+        pyt.freeze(engine='auto')
+        self.assertIsNone(pyt.get("10.0.0.1"))
+        for i in range(256):
+            pyt["10.%d.0.0/16" % i] = i
+        pyt["10.0.0.0/8"] = 'eight'
+        addrs = ["10.%d.1.1" % i for i in range(0, 256, 7)] + ["11.0.0.0", "9.255.255.255"]
+        expected = [pyt.get(a) for a in addrs]
+        stats = pyt.stats()
+        self.assertTrue(stats['auto'])
+        self.assertIn(stats['engine'], ['flat', 'interval', 'poptrie'])
+        self.assertListEqual(pyt.get_many(addrs), expected)
+        for i in range(0, 256, 2):
+            del pyt["10.%d.0.0/16" % i]
+        self.assertListEqual([pyt.get(a) for a in addrs],
+                             ['eight' if i % 2 == 0 else i for i in range(0, 256, 7)] + [None, None])
+        pyt.thaw()
+        self.assertFalse(pyt.stats()['auto'])
+
+    def testEmitC(self):
+        pyt = pytricia.PyTricia()
+        pyt["10.0.0.0/8"] = 'a'
+        pyt["10.1.0.0/16"] = 'b'
+        pyt["192.168.0.0/24"] = 'c'
+        source = pyt.emit_c(name="acl_lookup")
+        self.assertIn("acl_lookup(const unsigned char *addr)", source)
+        with self.assertRaises(ValueError):
+            pyt.emit_c(name="not valid")
+        with self.assertRaises(ValueError):
+            pyt.freeze(engine='native')
+
+        cc = shutil.which("cc") if hasattr(shutil, "which") else None
+        if not cc:
+            return
+        tmpdir = tempfile.mkdtemp()
+        with open(os.path.join(tmpdir, "acl.c"), "w") as outfile:
+            outfile.write(source)
+        lib = os.path.join(tmpdir, "acl.so")
+        if subprocess.call([cc, "-shared", "-fPIC", "-o", lib, os.path.join(tmpdir, "acl.c")]) != 0:
+            return
+        compiled = ctypes.CDLL(lib)
+        fn = ctypes.cast(compiled.acl_lookup, ctypes.c_void_p).value
+        signature = ctypes.c_uint64.in_dll(compiled, "acl_lookup_signature").value
+        addrs = ["9.255.255.255", "10.0.0.1", "10.1.2.3", "10.2.0.0", "192.168.0.7", "192.168.1.0"]
+        expected = [pyt.get(a) for a in addrs]
+        with self.assertRaises(ValueError):
+            pyt.freeze(engine='native', lookup=fn)
+        pyt.freeze(engine='native', lookup=fn, signature=signature)
+        self.assertListEqual([pyt.get(a) for a in addrs], expected)
+        self.assertListEqual(pyt.get_many(addrs), expected)
+        pyt["10.2.0.0/16"] = 'd'
+        self.assertEqual(pyt["10.2.0.0"], 'd')
+        pyt.thaw()
+
+        # a lookup emitted for other prefixes is refused
+        del pyt["10.2.0.0/16"]
+        del pyt["10.1.0.0/16"]
+        with self.assertRaises(ValueError):
+            pyt.freeze(engine='native', lookup=fn, signature=signature)
+        self.assertEqual(pyt.get("10.1.2.3"), 'a')
+
+    def testHeavyHitters(self):
+        hhh = pytricia.PyTriciaHHH(epsilon=0.01)
+        addrs = ["10.1.2.%d" % (i % 256) for i in range(3000)] + \
+                ["10.%d.%d.1" % (i % 256, i // 256) for i in range(2000)] + \
+                ["192.0.2.7"] * 1000 + \
+                ["%d.%d.1.1" % (i % 200 + 20, i // 200) for i in range(4000)]
+        hhh.update(addrs)
+        self.assertEqual(hhh.total(), len(addrs))
+        hitters = hhh.heavy_hitters(0.05)
+        self.assertListEqual(sorted(hitters), ['0.0.0.0/0', '10.0.0.0/8', '10.1.2.0/24', '192.0.2.7/32'])
+        self.assertAlmostEqual(sum(hitters.values()), len(addrs))
+        self.assertGreater(hitters['10.1.2.0/24'], 2500)
+        hhh.decay(0.5)
+        self.assertEqual(hhh.total(), len(addrs) / 2.0)
+        hhh.update(["192.0.2.7"], [10000])
+        self.assertGreater(hhh.heavy_hitters(0.5)['192.0.2.7/32'], 10000)
+        small = pytricia.PyTriciaHHH(epsilon=0.01, max_nodes=10)
+        small.update(addrs)
+        self.assertLessEqual(len(small), 10)
+        self.assertEqual(small.total(), len(addrs))
+        with self.assertRaises(ValueError):
+            hhh.decay(2)
+
+        # a full table is folded well below max_nodes, not just under it
+        small = pytricia.PyTriciaHHH(epsilon=0.001, max_nodes=100)
+        sizes = []
+        for i in range(5000):
+            small.update(["%d.%d.%d.1" % (i % 97 + 1, i % 89, i % 83)])
+            sizes.append(len(small))
+        self.assertLessEqual(max(sizes), 100)
+        drops = [after for before, after in zip(sizes, sizes[1:]) if after < before]
+        self.assertTrue(drops)
+        self.assertLessEqual(max(drops), 75)
+        self.assertEqual(pytricia.PyTriciaHHH(max_nodes=4).update(["10.0.0.1"] * 10, [0] * 10), None)
+
+        # a bad weight or key anywhere in a batch leaves the tracker untouched
+        hhh = pytricia.PyTriciaHHH(max_nodes=4)
+        hhh.update(["10.0.0.1", "10.0.0.2"])
+        before = hhh.heavy_hitters(0.1)
+        for weights in ([1.0, -1.0], [1.0, float('nan')], [1.0, float('inf')], [1e308, 1e308]):
+            with self.assertRaises(ValueError):
+                hhh.update(["10.0.0.1", "10.0.0.2"], weights)
+        with self.assertRaises(ValueError):
+            hhh.update(["10.0.0.1", "2001:db8::1"])
+        self.assertEqual(hhh.total(), 2.0)
+        self.assertEqual(hhh.heavy_hitters(0.1), before)
+
+        class Bare(pytricia.PyTriciaHHH):
+            def __init__(self):
+                pass
+        hhh = Bare()
+        hhh.update(["10.0.0.1"])
+        self.assertEqual(hhh.total(), 1.0)
+
+    def testPairRules(self):
+        acl = pytricia.PyTricia2D()
+        acl.insert("0.0.0.0/0", "0.0.0.0/0", 'deny', priority=0)
+        acl.insert("10.0.0.0/8", "192.168.1.0/24", 'allow', priority=10)
+        acl.insert("10.1.0.0/16", "192.168.0.0/16", 'log', priority=5)
+        acl.insert("10.1.2.0/24", "192.168.1.7/32", 'block', priority=10)
+        self.assertEqual(len(acl), 4)
+        self.assertEqual(acl.classify("10.9.9.9", "192.168.1.1"), 'allow')
+        self.assertEqual(acl.classify("10.1.9.9", "192.168.2.1"), 'log')
+        self.assertEqual(acl.classify("10.1.9.9", "192.168.1.1"), 'allow')
+        self.assertEqual(acl.classify("10.1.2.3", "192.168.1.7"), 'block')
+        self.assertEqual(acl.classify("11.0.0.1", "192.168.1.1"), 'deny')
+        self.assertListEqual(acl.classify_many(["10.9.9.9", "10.1.2.3"], ["192.168.1.1", "192.168.1.7"]),
+                             ['allow', 'block'])
+        acl.delete("10.0.0.0/8", "192.168.1.0/24")
+        self.assertEqual(acl.classify("10.1.9.9", "192.168.1.1"), 'log')
+        acl.delete("0.0.0.0/0", "0.0.0.0/0")
+        self.assertEqual(acl.classify("11.0.0.1", "192.168.1.1", 'none'), 'none')
+        self.assertIn(("10.1.2.0/24", "192.168.1.7/32", 10, 'block'), acl.rules())
+        with self.assertRaises(KeyError):
+            acl.delete("10.0.0.0/8", "192.168.1.0/24")
+
+        class Bare(pytricia.PyTricia2D):
+            def __init__(self):
+                pass
+        acl = Bare()
+        acl.insert("10.0.0.0/8", "0.0.0.0/0", 'allow')
+        self.assertEqual(acl.classify("10.1.2.3", "8.8.8.8"), 'allow')
+
+    def testTernaryRules(self):
+        t = pytricia.PyTriciaTernary()
+        t.insert("10.0.0.0/8", None, 'ten')
+        t.insert("10.0.0.5", "255.0.0.255", 'host5', priority=1)
+        t.insert("0.0.0.1", "0.0.0.1", 'odd', priority=5)
+        t.insert("10.0.0.0", "0.255.255.255", 'acl', wildcard=True)
+        self.assertEqual(len(t), 3)
+        self.assertEqual(t.masks(), 3)
+        self.assertEqual(t.match("10.9.9.4"), 'acl')
+        self.assertEqual(t.match("10.9.9.5"), 'odd')
+        self.assertEqual(t.match("11.9.9.4", 'none'), 'none')
+        self.assertListEqual(t.match_many(["10.9.9.4", "11.0.0.3"]), ['acl', 'odd'])
+        t.delete("0.0.0.1", "0.0.0.1")
+        self.assertEqual(t.match("10.9.9.5"), 'host5')
+        self.assertIn(("10.0.0.5", "255.0.0.255", 1, 'host5'), t.rules())
+        with self.assertRaises(KeyError):
+            t.delete("0.0.0.1", "0.0.0.1")
+        with self.assertRaises(ValueError):
+            t.insert("2001:db8::1", "ffff::", 'v6')
+
+        # replacing a mask's top rule with a lower priority lowers the mask
+        t = pytricia.PyTriciaTernary()
+        t.insert("10.0.0.0", "255.0.0.0", 'ten', priority=9)
+        t.insert("11.0.0.0", "255.0.0.0", 'eleven', priority=1)
+        t.insert("0.0.0.1", "0.0.0.255", 'one', priority=5)
+        self.assertEqual(t.match("10.0.0.1"), 'ten')
+        t.insert("10.0.0.0", "255.0.0.0", 'ten', priority=0)
+        self.assertEqual(t.match("10.0.0.1"), 'one')
+        t.insert("11.0.0.0", "255.0.0.0", 'eleven', priority=7)
+        self.assertEqual(t.match("11.0.0.1"), 'eleven')
+
+        # removing a rule below the mask's best leaves the mask's order alone;
+        # removing the best lowers it
+        t.insert("12.0.0.0", "255.0.0.0", 'twelve', priority=3)
+        t.delete("12.0.0.0", "255.0.0.0")
+        self.assertEqual(t.match("11.0.0.1"), 'eleven')
+        self.assertEqual(t.match("12.0.0.2"), None)
+        t.insert("11.0.0.1", "0.0.0.255", 'low', priority=6)
+        self.assertEqual(t.match("11.0.0.1"), 'eleven')
+        t.delete("11.0.0.0", "255.0.0.0")
+        self.assertEqual(t.match("11.0.0.1"), 'low')
+
+        t = pytricia.PyTriciaTernary()
+        ntoa = lambda a: socket.inet_ntoa(struct.pack(">I", a))
+        rules = {}
+        for i in range(200):
+            mask = random.getrandbits(32) & random.getrandbits(32)
+            value = random.getrandbits(32) & mask
+            if (value, mask) not in rules:
+                rules[(value, mask)] = (random.randint(0, 9), i)
+                t.insert(ntoa(value), ntoa(mask), i, priority=rules[(value, mask)][0])
+        for _ in range(1000):
+            addr = random.getrandbits(32)
+            hits = [r for (value, mask), r in rules.items() if addr & mask == value]
+            expected = max(hits, key=lambda r: (r[0], -r[1]))[1] if hits else None
+            self.assertEqual(t.match(ntoa(addr)), expected)
+
+    def testVRF(self):
+        vrf = pytricia.PyTriciaVRF()
+        vrf.insert('red', "10.0.0.0/8", 'red10')
+        vrf.insert('blue', "10.0.0.0/8", 'blue10')
+        vrf.insert('blue', "10.1.0.0/16", 'blue101')
+        vrf.insert(7, "0.0.0.0/0", 'default')
+        self.assertEqual(len(vrf), 3)
+        self.assertEqual(vrf.stats(), {'tables': 3, 'routes': 4, 'prefixes': 3})
+        self.assertEqual(vrf.get('red', "10.1.2.3"), 'red10')
+        self.assertEqual(vrf.get('blue', "10.1.2.3"), 'blue101')
+        self.assertEqual(vrf.get('red', "11.0.0.1", 'none'), 'none')
+        self.assertListEqual(vrf.get_many(['red', 'blue', 'blue', 7], ["10.1.2.3"] * 3 + ["1.2.3.4"]),
+                             ['red10', 'blue101', 'blue101', 'default'])
+        with self.assertRaises(KeyError):
+            vrf.get('green', "10.1.2.3")
+        vrf.delete('red', "10.0.0.0/8")
+        self.assertListEqual(vrf.keys('blue'), ["10.0.0.0/8", "10.1.0.0/16"])
+        vrf.drop('blue')
+        self.assertEqual(vrf.stats(), {'tables': 2, 'routes': 1, 'prefixes': 1})
+        with self.assertRaises(KeyError):
+            vrf.delete('red', "10.0.0.0/8")
+
+        # host bits are dropped, so no table decides how another spells a key
+        vrf = pytricia.PyTriciaVRF()
+        vrf.insert('a', "10.1.2.3/8", 1)
+        vrf.insert('b', "10.0.0.0/8", 2)
+        self.assertListEqual(vrf.keys('a'), ["10.0.0.0/8"])
+        self.assertListEqual(vrf.keys('b'), ["10.0.0.0/8"])
+        self.assertEqual(vrf.stats()['prefixes'], 1)
+
+        class Bare(pytricia.PyTriciaVRF):
+            def __init__(self):
+                pass
+        vrf = Bare()
+        vrf.insert('a', "10.0.0.0/8", 1)
+        self.assertEqual(vrf.get('a', "10.1.2.3"), 1)
+        self.assertEqual(vrf.stats(), {'tables': 1, 'routes': 1, 'prefixes': 1})
+
+        vrf = pytricia.PyTriciaVRF(socket.AF_INET6)
+        vrf.insert('a', "2001:db8::/32", 1)
+        self.assertEqual(vrf.get('a', "2001:db8::1"), 1)
+        with self.assertRaises(RuntimeError):
+            vrf.__init__()
+
+    def testLookupMulti(self):
+        asn = pytricia.PyTricia()
+        asn["10.0.0.0/8"] = 65000
+        asn["0.0.0.0/0"] = 1
+        geo = pytricia.PyTricia()
+        geo["10.1.0.0/16"] = 'US'
+        blocked = pytricia.PyTricia()
+        blocked["10.1.2.3/32"] = True
+        blocked.freeze()
+        keys = ["10.1.2.3", "10.9.9.9", "8.8.8.8"]
+        self.assertListEqual(pytricia.lookup_multi([asn, geo, blocked], keys),
+                             [[65000, 65000, 1], ['US', None, None], [True, None, None]])
+        self.assertListEqual(pytricia.lookup_multi([asn, geo], array.array('I', [0x0a010203]), 'x'),
+                             [[65000], ['US']])
+        self.assertListEqual(pytricia.lookup_multi([], keys), [])
+        with self.assertRaises(TypeError):
+            pytricia.lookup_multi([asn, {}], keys)
+
+    def testExpiry(self):
+        pyt = pytricia.PyTricia()
+        pyt["10.0.0.0/8"] = 'ten'
+        pyt.insert("10.1.0.0/16", 'hour', ttl=3600)
+        pyt.insert("10.2.0.0/16", 'day', ttl=86400)
+        pyt.insert("10.3.0.0/16", 'renewed', ttl=60)
+        pyt.insert("10.3.0.0/16", 'forever')
+        pyt.insert("10.4.0.0/16", 'deleted', ttl=60)
+        del pyt["10.4.0.0/16"]
+        now = time.time()
+        self.assertEqual(pyt.expire(now), 0)
+        self.assertEqual(pyt.get("10.1.2.3"), 'hour')
+        self.assertEqual(pyt.expire(now + 7200), 1)
+        self.assertEqual(pyt.get("10.1.2.3"), 'ten')
+        self.assertEqual(pyt.expire(now + 10 ** 8), 1)
+        self.assertListEqual(sorted(pyt.keys()), ["10.0.0.0/8", "10.3.0.0/16"])
+        with self.assertRaises(ValueError):
+            pyt.insert("10.5.0.0/16", 'x', ttl=-1)
+
+        pyt = pytricia.PyTricia(hide_expired=True)
+        pyt["10.0.0.0/8"] = 'ten'
+        pyt.insert("10.1.0.0/16", 'gone', ttl=0)
+        pyt.insert("10.1.2.0/24", 'here', ttl=3600)
+        self.assertEqual(pyt["10.1.9.9"], 'ten')
+        self.assertListEqual(pyt.get_many(["10.1.9.9", "10.1.2.3"]), ['ten', 'here'])
+        self.assertEqual(len(pyt), 3)
+        self.assertEqual(pyt.expire(), 1)
+        self.assertEqual(len(pyt), 2)
+
+    def testExpiryFreesBookkeeping(self):
+        try:
+            import tracemalloc
+        except ImportError:
+            return
+        pyt = pytricia.PyTricia()
+        def churn():
+            for i in range(2000):
+                pyt.insert("10.%d.%d.0/24" % (i // 256, i % 256), i, ttl=0)
+            self.assertEqual(pyt.expire(time.time() + 1), 2000)
+        churn()
+        tracemalloc.start()
+        try:
+            before = tracemalloc.get_traced_memory()[0]
+            for _ in range(5):
+                churn()
+            grown = tracemalloc.get_traced_memory()[0] - before
+        finally:
+            tracemalloc.stop()
+        self.assertLess(grown, 2000 * 8)
+
+    def testEviction(self):
+        cache = pytricia.PyTricia(max_entries=3)
+        cache["10.0.0.0/8"] = 'a'
+        cache["10.1.0.0/16"] = 'b'
+        cache["192.168.0.0/16"] = 'c'
+        cache.get("192.168.1.1")
+        cache["172.16.0.0/12"] = 'd'
+        # 10.0.0.0/8 covers another entry, and 192.168.0.0/16 was just used
+        self.assertListEqual(sorted(cache.keys()), ["10.0.0.0/8", "172.16.0.0/12", "192.168.0.0/16"])
+        self.assertEqual(cache.stats()['evictions'], 1)
+        cache["172.16.0.0/12"] = 'e'
+        self.assertEqual(len(cache), 3)
+        for i in range(100):
+            cache["10.%d.0.0/16" % i] = i
+            self.assertEqual(len(cache), 3)
+        self.assertIn("10.99.0.0/16", cache.keys())
+        with self.assertRaises(ValueError):
+            pytricia.PyTricia(max_entries=5, eviction='lru')
+
+    def testNavigation(self):
+        pyt = pytricia.PyTricia()
+        self.assertIsNone(pyt.first())
+        self.assertIsNone(pyt.next_prefix("10.0.0.0/8"))
+        for prefix in ["10.0.0.0/8", "10.0.0.0/16", "10.1.0.0/16", "192.168.0.0/24"]:
+            pyt[prefix] = prefix.upper()
+        self.assertEqual(pyt.first(), ("10.0.0.0/8", "10.0.0.0/8"))
+        self.assertEqual(pyt.last(), ("192.168.0.0/24", "192.168.0.0/24"))
+        self.assertEqual(pyt.next_prefix("10.0.0.0/8"), ("10.0.0.0/16", "10.0.0.0/16"))
+        self.assertEqual(pyt.next_prefix("10.0.0.0/16")[0], "10.1.0.0/16")
+        self.assertEqual(pyt.next_prefix("10.0.5.0/24")[0], "10.1.0.0/16")
+        self.assertIsNone(pyt.next_prefix("192.168.0.0/24"))
+        self.assertEqual(pyt.prev_prefix("10.1.0.0/16")[0], "10.0.0.0/16")
+        self.assertEqual(pyt.prev_prefix("172.16.0.0/12")[0], "10.1.0.0/16")
+        self.assertIsNone(pyt.prev_prefix("10.0.0.0/8"))
+        self.assertEqual(pyt.floor("10.0.0.0")[0], "10.0.0.0/16")
+        self.assertEqual(pyt.floor("10.200.0.1")[0], "10.1.0.0/16")
+        self.assertIsNone(pyt.floor("9.255.255.255"))
+        self.assertEqual(pyt.ceiling("10.0.0.0")[0], "10.0.0.0/8")
+        self.assertEqual(pyt.ceiling("10.0.0.1")[0], "10.1.0.0/16")
+        self.assertIsNone(pyt.ceiling("192.168.0.1"))
+
+    def testFindFree(self):
+        pyt = pytricia.PyTricia()
+        self.assertEqual(pyt.find_free(24, "10.0.0.0/8"), "10.0.0.0/24")
+        pyt["10.0.0.0/24"] = 1
+        pyt["10.0.2.0/23"] = 2
+        self.assertEqual(pyt.find_free(24, "10.0.0.0/8"), "10.0.1.0/24")
+        self.assertEqual(pyt.find_free(23, "10.0.0.0/8"), "10.0.4.0/23")
+        pyt["10.0.1.0/24"] = 3
+        self.assertEqual(pyt.find_free(24, "10.0.0.0/8"), "10.0.4.0/24")
+        del pyt["10.0.0.0/24"]
+        self.assertEqual(pyt.find_free(24, "10.0.0.0/8"), "10.0.0.0/24")
+        self.assertEqual(pyt.find_free(8), "0.0.0.0/8")
+        self.assertIsNone(pyt.find_free(25, "10.0.2.0/24"))
+        self.assertRaises(ValueError, pyt.find_free, 4, "10.0.0.0/8")
+        self.assertRaises(ValueError, pyt.find_free, 33)
+
+        pyt = pytricia.PyTricia(128)
+        pyt["2001:db8::/48"] = 1
+        self.assertEqual(pyt.find_free(48, "2001:db8::/32"), "2001:db8:1::/48")
+
+        # blocks longer than the table's prefixlen still see its prefixes
+        pyt = pytricia.PyTricia(24)
+        pyt["10.0.0.0/24"] = 1
+        pyt["10.0.1.0/24"] = 2
+        self.assertIsNone(pyt.find_free(25, "10.0.0.0/23"))
+        self.assertEqual(pyt.find_free(25, "10.0.0.0/22"), "10.0.2.0/25")
+        pyt = pytricia.PyTricia(16)
+        pyt["10.0.0.0/16"] = 1
+        self.assertEqual(pyt.find_free(20, "10.0.0.0/15"), "10.1.0.0/20")
+
+        pyt = pytricia.PyTricia()
+        pyt["2001:db8::/48"] = 1
+        self.assertEqual(pyt.find_free(48, "2001:db8::/32"), "2001:db8:1::/48")
+
+    def testOverlaps(self):
+        prefixes = ["10.0.0.0/8", "192.168.0.0/16", "10.1.0.0/16", "10.1.2.0/24", "172.16.0.0/12", "10.1.0.0/16"]
+        outer, inner = pytricia.find_overlaps(prefixes)
+        self.assertEqual(sorted(zip(outer, inner)), [(0, 2), (0, 3), (0, 5), (2, 3), (2, 5), (5, 3)])
+        self.assertIn(pytricia.find_overlaps(prefixes, first=True), list(zip(outer, inner)))
+        self.assertIsNone(pytricia.find_overlaps(["10.0.0.0/8", "11.0.0.0/8", "2001:db8::/32"], first=True))
+        self.assertEqual(pytricia.find_overlaps([]), ([], []))
+        self.assertEqual(pytricia.find_overlaps(["10.1.0.0/8", "10.0.0.0/16"]), ([0], [1]))
+
+        pyt = pytricia.PyTricia()
+        for prefix in prefixes:
+            pyt[prefix] = 1
+        keys = pyt.keys()
+        outer, inner = pyt.conflicts()
+        self.assertEqual(sorted((keys[o], keys[i]) for o, i in zip(outer, inner)),
+                         [("10.0.0.0/8", "10.1.0.0/16"), ("10.0.0.0/8", "10.1.2.0/24"), ("10.1.0.0/16", "10.1.2.0/24")])
+        self.assertEqual(pyt.conflicts(first=True), (0, 1))
+        del pyt["10.0.0.0/8"]
+        del pyt["10.1.0.0/16"]
+        self.assertEqual(pyt.conflicts(), ([], []))
+        self.assertIsNone(pyt.conflicts(first=True))
+
+    def testToRanges(self):
+        pyt = pytricia.PyTricia()
+        self.assertEqual(pyt.to_ranges(), ([], [], []))
+        pyt["10.0.0.0/8"] = "a"
+        pyt["10.1.0.0/16"] = "b"
+        pyt["10.2.0.0/16"] = "a"
+        starts, ends, values = pyt.to_ranges()
+        self.assertEqual(list(zip(starts, ends, values)), [
+            ("10.0.0.0", "10.0.255.255", "a"),
+            ("10.1.0.0", "10.1.255.255", "b"),
+            ("10.2.0.0", "10.2.255.255", "a"),
+            ("10.3.0.0", "10.255.255.255", "a")])
+        starts, ends, values = pyt.to_ranges(merge=True)
+        self.assertEqual(list(zip(starts, ends, values)), [
+            ("10.0.0.0", "10.0.255.255", "a"),
+            ("10.1.0.0", "10.1.255.255", "b"),
+            ("10.2.0.0", "10.255.255.255", "a")])
+        pyt["11.0.0.0/8"] = "a"
+        self.assertEqual(pyt.to_ranges(merge=True)[1][-1], "11.255.255.255")
+        pyt["0.0.0.0/0"] = "z"
+        self.assertEqual(pyt.to_ranges()[1][-1], "255.255.255.255")
+
+    def testCoverage(self):
+        pyt = pytricia.PyTricia()
+        self.assertEqual(pyt.coverage(), 0)
+        pyt["10.0.0.0/8"] = 64500
+        pyt["10.1.0.0/16"] = 64501
+        pyt["10.1.2.0/24"] = 64500
+        pyt["192.168.0.0/16"] = 64502
+        self.assertEqual(pyt.coverage(), 2**24 + 2**16)
+        total, counts = pyt.coverage(by_value=True)
+        self.assertEqual(total, 2**24 + 2**16)
+        self.assertEqual(counts, {64500: 2**24 - 2**16 + 2**8, 64501: 2**16 - 2**8, 64502: 2**16})
+
+        pyt = pytricia.PyTricia(128, socket.AF_INET6)
+        pyt["::/0"] = "default"
+        pyt["2001:db8::/32"] = "doc"
+        self.assertEqual(pyt.coverage(), 2**128)
+        self.assertEqual(pyt.coverage(by_value=True)[1], {"default": 2**128 - 2**96, "doc": 2**96})
+        self.assertEqual(pyt.coverage(family=socket.AF_INET), 0)
+
+    def testJoin(self):
+        routes = pytricia.PyTricia()
+        routes["0.0.0.0/0"] = "default"
+        routes["10.0.0.0/8"] = "core"
+        routes["10.1.0.0/16"] = "edge"
+        customers = pytricia.PyTricia()
+        customers["10.1.2.0/24"] = "acme"
+        customers["10.2.0.0/16"] = "globex"
+        customers["192.0.2.0/24"] = "initech"
+        prefixes, matches, values = customers.join(routes)
+        self.assertEqual(list(zip(prefixes, matches, values)), [
+            ("10.1.2.0/24", "10.1.0.0/16", "edge"),
+            ("10.2.0.0/16", "10.0.0.0/8", "core"),
+            ("192.0.2.0/24", "0.0.0.0/0", "default")])
+        prefixes, matches, values = customers.join(routes, mode="all")
+        self.assertEqual(prefixes.count("10.1.2.0/24"), 3)
+        self.assertEqual(matches[:3], ["0.0.0.0/0", "10.0.0.0/8", "10.1.0.0/16"])
+        del routes["0.0.0.0/0"]
+        self.assertEqual(customers.join(routes)[1], ["10.1.0.0/16", "10.0.0.0/8", None])
+        self.assertEqual(routes.join(routes)[1], routes.keys())
+        self.assertRaises(ValueError, customers.join, routes, "some")
+        self.assertRaises(TypeError, customers.join, {})
+
+    def testBulkDelete(self):
+        pyt = pytricia.PyTricia()
+        for i, prefix in enumerate(["10.0.0.0/8", "10.1.0.0/16", "10.1.2.0/24", "10.2.0.0/16", "192.168.0.0/16"]):
+            pyt[prefix] = i
+        self.assertEqual(pyt.delete_subtree("10.1.0.0/16"), 2)
+        self.assertEqual(sorted(pyt.keys()), ["10.0.0.0/8", "10.2.0.0/16", "192.168.0.0/16"])
+        self.assertEqual(pyt.delete_subtree("10.0.0.0/9"), 1)
+        self.assertEqual(pyt.delete_subtree("172.16.0.0/12"), 0)
+        self.assertEqual(pyt.get_key("10.2.3.4"), "10.0.0.0/8")
+
+        for i, prefix in enumerate(["10.1.0.0/16", "10.1.2.0/24", "10.2.0.0/16", "172.16.0.0/12"]):
+            pyt[prefix] = i
+        self.assertEqual(pyt.prune(lambda v: v % 2 == 1), 2)
+        self.assertEqual(sorted(pyt.keys()), ["10.0.0.0/8", "10.1.0.0/16", "10.2.0.0/16", "192.168.0.0/16"])
+        self.assertEqual(pyt.prune(values={0, 4}, within="10.0.0.0/8"), 2)
+        self.assertEqual(sorted(pyt.keys()), ["10.2.0.0/16", "192.168.0.0/16"])
+        self.assertRaises(TypeError, pyt.prune)
+        self.assertRaises(TypeError, pyt.prune, 42)
+        self.assertRaises(RuntimeError, pyt.prune, lambda v: pyt.delete("10.2.0.0/16"))
+        self.assertRaises(ZeroDivisionError, pyt.prune, lambda v: 1 / 0)
+        self.assertEqual(len(pyt), 2)
+        self.assertEqual(pyt.prune(lambda v: True), 2)
+        self.assertEqual(len(pyt), 0)
+
+    def testValueIndex(self):
+        for indexed in (True, False):
+            pyt = pytricia.PyTricia(index_values=indexed)
+            pyt["104.16.0.0/13"] = 13335
+            pyt["1.1.1.0/24"] = 13335
+            pyt["8.8.8.0/24"] = 15169
+            pyt["104.24.0.0/14"] = 13335
+            self.assertEqual(pyt.keys_for(13335), ["1.1.1.0/24", "104.16.0.0/13", "104.24.0.0/14"])
+            self.assertEqual(pyt.count_for(13335), 3)
+            self.assertEqual(pyt.keys_for(64512), [])
+            pyt["1.1.1.0/24"] = 15169
+            del pyt["104.24.0.0/14"]
+            self.assertEqual(pyt.keys_for_many([13335, 15169]), [["104.16.0.0/13"], ["1.1.1.0/24", "8.8.8.0/24"]])
+            self.assertEqual(pyt.count_for_many([15169, 13335, 1]), [2, 1, 0])
+            pyt.prune(values={15169})
+            self.assertEqual(pyt.count_for(15169), 0)
+            self.assertRaises(TypeError, pyt.keys_for, [])
+
+        pyt = pytricia.PyTricia(index_values=True)
+        with self.assertRaises(TypeError):
+            pyt["10.0.0.0/8"] = []
+        self.assertEqual(len(pyt), 0)
+
+    def testMerkle(self):
+        a = pytricia.PyTricia()
+        b = pytricia.PyTricia()
+        self.assertEqual(a.root_hash(), b.root_hash())
+        prefixes = ["10.0.0.0/8", "10.1.0.0/16", "10.1.2.0/24", "192.168.0.0/16", "172.16.0.0/12"]
+        for i, prefix in enumerate(prefixes):
+            a[prefix] = ("as", i)
+        for i, prefix in reversed(list(enumerate(prefixes))):
+            b[prefix] = ("as", i)
+        self.assertEqual(a.root_hash(), b.root_hash())
+        self.assertEqual(a.diff(b), ([], [], []))
+
+        b["10.1.2.0/24"] = "moved"
+        del b["172.16.0.0/12"]
+        b["10.1.3.0/24"] = 7
+        self.assertNotEqual(a.root_hash(), b.root_hash())
+        self.assertEqual(a.subtree_hash("192.168.0.0/16"), b.subtree_hash("192.168.0.0/16"))
+        self.assertNotEqual(a.subtree_hash("10.0.0.0/8"), b.subtree_hash("10.0.0.0/8"))
+        self.assertEqual(a.diff(b), (["172.16.0.0/12"], ["10.1.3.0/24"], ["10.1.2.0/24"]))
+
+        b["10.1.2.0/24"] = ("as", 2)
+        b["172.16.0.0/12"] = ("as", 4)
+        del b["10.1.3.0/24"]
+        self.assertEqual(a.root_hash(), b.root_hash())
+
+        with self.assertRaises(TypeError):
+            a["8.8.8.0/24"] = object()
+        with self.assertRaises(TypeError):
+            a.insert("8.8.8.0/24", object())
+        self.assertEqual(a.root_hash(), b.root_hash())
+        c = pytricia.PyTricia()
+        c["8.8.8.0/24"] = object()
+        self.assertRaises(TypeError, c.root_hash)
+
+        # the same on every host, whatever its word size or byte order
+        d = pytricia.PyTricia(128)
+        d["10.0.0.0/8"] = ("as", 1, 2.5, b"x", None, True, 2 ** 70)
+        d["2001:db8::/32"] = "v6"
+        self.assertEqual(d.root_hash(), 0x99533cca0e758eb5)
+
+    def testHistory(self):
+        pyt = pytricia.PyTricia(history=3)
+        self.assertEqual(pyt.versions()[0][0], 0)
+        pyt["10.0.0.0/8"] = "a"
+        pyt["10.1.0.0/16"] = "b"
+        pyt["10.0.0.0/8"] = "c"
+        del pyt["10.1.0.0/16"]
+        self.assertEqual([v for v, _ in pyt.versions()], [2, 3, 4])
+
+        before = pyt.at(2)
+        self.assertEqual(before.version, 2)
+        self.assertEqual(len(before), 2)
+        self.assertEqual(before.get("10.1.2.3"), "b")
+        self.assertEqual(before.get_key("10.1.2.3"), "10.1.0.0/16")
+        self.assertEqual(before["10.2.0.0/16"], "a")
+        self.assertTrue(before.has_key("10.0.0.0/8"))
+        self.assertEqual(sorted(before.keys()), ["10.0.0.0/8", "10.1.0.0/16"])
+        self.assertEqual(pyt.at(3)["10.1.2.3"], "b")
+        self.assertEqual(pyt.at(3)["10.2.0.0/16"], "c")
+        now = pyt.at()
+        self.assertEqual(now.version, 4)
+        self.assertEqual(now.get("10.1.2.3"), "c")
+        self.assertFalse("8.8.8.8" in now)
+        self.assertEqual(pyt.at(now.time).version, 4)
+
+        self.assertRaises(KeyError, pyt.at, 1)
+        self.assertRaises(KeyError, pyt.at, 0.0)
+        self.assertRaises(TypeError, pyt.at, "1")
+        del pyt
+        self.assertEqual(before["10.1.0.0/16"], "b")
+        self.assertRaises(ValueError, pytricia.PyTricia().at)
+
+        pyt = pytricia.PyTricia(128, history=10)
+        for i in range(8):
+            pyt["10.%d.0.0/16" % i] = i
+        pyt["2001:db8::/32"] = 6
+        self.assertEqual(pyt.delete_subtree("10.0.0.0/8"), 8)
+        self.assertEqual(len(pyt.at(9)), 9)
+        self.assertEqual(pyt.at(9)["2001:db8::1"], 6)
+        self.assertEqual(pyt.at(10).keys(), ["2001:db8::/32"])
+
     def testExceptions(self):
         pyt = pytricia.PyTricia(32)
         with self.assertRaises(ValueError) as cm:
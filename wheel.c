@@ -0,0 +1,213 @@
+/*
+ * This file is part of Pytricia.
+ * Joel Sommers <jsommers@colgate.edu>
+ *
+ * Pytricia is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pytricia is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Pytricia.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "wheel.h"
+
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+
+struct _wheel_t {
+    int64_t tick;               /* the level 0 slot being served */
+    size_t count;
+    size_t level_count[WHEEL_LEVELS];
+    wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static int64_t
+_wheel_tick(double t) {
+    double f = floor(t);
+    if (f >= 4.0e18) {
+        return (int64_t)4e18;
+    }
+    if (f <= -4.0e18) {
+        return -(int64_t)4e18;
+    }
+    return (int64_t)f;
+}
+
+wheel_t *
+wheel_new(double now) {
+    wheel_t *wheel = calloc(1, sizeof(*wheel));
+
+    if (wheel) {
+        wheel->tick = _wheel_tick(now);
+    }
+    return wheel;
+}
+
+void
+wheel_free(wheel_t *wheel) {
+    int level, slot;
+
+    if (!wheel) {
+        return;
+    }
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < WHEEL_SLOTS; slot++) {
+            wheel_timer_t *timer = wheel->slots[level][slot];
+            while (timer) {
+                wheel_timer_t *next = timer->next;
+                free(timer);
+                timer = next;
+            }
+        }
+    }
+    free(wheel);
+}
+
+size_t
+wheel_count(wheel_t *wheel) {
+    return wheel->count;
+}
+
+static void
+_wheel_link(wheel_t *wheel, wheel_timer_t *timer) {
+    int64_t due = _wheel_tick(timer->deadline);
+    int64_t reach = (int64_t)1 << (WHEEL_BITS * WHEEL_LEVELS);
+    int level = 0;
+    wheel_timer_t **head;
+
+    if (due < wheel->tick) {
+        due = wheel->tick;
+    }
+    // beyond the top level's reach: park as far out as it goes, and the
+    // timer is placed again when the wheel gets there
+    if (due - wheel->tick >= reach) {
+        due = wheel->tick + reach - 1;
+    }
+    while (level < WHEEL_LEVELS - 1 && (due >> (WHEEL_BITS * (level + 1))) != (wheel->tick >> (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    timer->level = level;
+    timer->slot = (int)((due >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+    head = &wheel->slots[level][timer->slot];
+    timer->prev = NULL;
+    timer->next = *head;
+    if (*head) {
+        (*head)->prev = timer;
+    }
+    *head = timer;
+    wheel->level_count[level]++;
+}
+
+static void
+_wheel_unlink(wheel_t *wheel, wheel_timer_t *timer) {
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        wheel->slots[timer->level][timer->slot] = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+    wheel->level_count[timer->level]--;
+}
+
+wheel_timer_t *
+wheel_add(wheel_t *wheel, double deadline, void *item) {
+    wheel_timer_t *timer = malloc(sizeof(*timer));
+
+    if (timer) {
+        timer->deadline = deadline;
+        timer->item = item;
+        _wheel_link(wheel, timer);
+        wheel->count++;
+    }
+    return timer;
+}
+
+void
+wheel_cancel(wheel_t *wheel, wheel_timer_t *timer) {
+    _wheel_unlink(wheel, timer);
+    wheel->count--;
+    free(timer);
+}
+
+// the wheel just reached a new tick: bring down the timers of every
+// higher-level slot that starts here, top level first
+static void
+_wheel_cascade(wheel_t *wheel) {
+    int level;
+
+    for (level = WHEEL_LEVELS - 1; level > 0; level--) {
+        int64_t span = (int64_t)1 << (WHEEL_BITS * level);
+        if ((wheel->tick & (span - 1)) != 0) {
+            continue;
+        }
+        int slot = (int)((wheel->tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+        wheel_timer_t *timer = wheel->slots[level][slot];
+        wheel->slots[level][slot] = NULL;
+        while (timer) {
+            wheel_timer_t *next = timer->next;
+            wheel->level_count[level]--;
+            _wheel_link(wheel, timer);
+            timer = next;
+        }
+    }
+}
+
+long
+wheel_expire(wheel_t *wheel, double now, void ***items) {
+    int64_t target = _wheel_tick(now);
+    size_t n = 0;
+    void **due = malloc((wheel->count ? wheel->count : 1) * sizeof(*due));
+
+    if (!due) {
+        return -1;
+    }
+    for (;;) {
+        wheel_timer_t *timer = wheel->slots[0][wheel->tick & (WHEEL_SLOTS - 1)];
+        while (timer) {
+            wheel_timer_t *next = timer->next;
+            if (timer->deadline <= now) {
+                due[n++] = timer->item;
+                wheel_cancel(wheel, timer);
+            }
+            timer = next;
+        }
+        if (wheel->tick >= target) {
+            break;
+        }
+        if (wheel->count == 0) {
+            wheel->tick = target;
+            break;
+        }
+
+        // nothing falls due before the next slot boundary of the lowest
+        // level holding timers, so jump straight there
+        int level = 0;
+        while (level < WHEEL_LEVELS - 1 && wheel->level_count[level] == 0) {
+            level++;
+        }
+        int64_t step = (int64_t)1 << (WHEEL_BITS * level);
+        int64_t next = (wheel->tick | (step - 1)) + 1;
+        if (next > target) {
+            wheel->tick = target;
+        } else {
+            wheel->tick = next;
+            _wheel_cascade(wheel);
+        }
+    }
+    *items = due;
+    return (long)n;
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of Pytricia.
+ * Joel Sommers <jsommers@colgate.edu>
+ *
+ * Pytricia is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pytricia is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Pytricia.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A hierarchical timer wheel.  Time is counted in whole ticks of one
+ * second; level 0 has a slot per tick for the next 256 ticks, and each
+ * level above covers 256 times the span of the one below.  Timers move down
+ * a level when the wheel reaches their slot, so adding and cancelling a
+ * timer take constant time, and advancing costs one step per elapsed tick
+ * that has timers due (empty stretches are skipped a whole slot at a time).
+ * Deadlines keep their fractional part and are compared exactly.
+ */
+
+#ifndef _WHEEL_H
+#define _WHEEL_H
+
+#include <stddef.h>
+
+typedef struct _wheel_t wheel_t;
+
+typedef struct _wheel_timer_t {
+    double deadline;
+    void *item;
+    int level, slot;            /* where the wheel keeps it */
+    struct _wheel_timer_t *prev, *next;
+} wheel_timer_t;
+
+/* now is where the wheel starts; returns NULL if memory runs out */
+wheel_t *wheel_new (double now);
+
+/* frees every pending timer, but not the items */
+void wheel_free (wheel_t *wheel);
+
+size_t wheel_count (wheel_t *wheel);
+
+/* returns NULL if memory runs out */
+wheel_timer_t *wheel_add (wheel_t *wheel, double deadline, void *item);
+
+/* unlink and free a pending timer */
+void wheel_cancel (wheel_t *wheel, wheel_timer_t *timer);
+
+/*
+ * Move the wheel up to now and take off every timer due by then.  Hands
+ * back a malloc'ed array of their items and returns how many, or -1 if
+ * memory runs out, in which case nothing was taken off.
+ */
+long wheel_expire (wheel_t *wheel, double now, void ***items);
+
+#endif /* _WHEEL_H */